@@ -0,0 +1,42 @@
+#!/bin/sh
+# Sweep every engine over circle counts and spawn distributions
+# Results are appended to OUTPUT (default bench_results.csv); use a .json
+# OUTPUT to get JSON lines instead
+#
+# Build main, unigrid and quadtree first, then run from this directory:
+#   ./bench.sh
+# Environment overrides:
+#   OUTPUT                    Results file (default bench_results.csv)
+#   TICKS                     Ticks per run (default 60)
+#   COUNTS                    Circle counts (default "1000 10000 50000 100000 500000")
+#   DISTRIBUTIONS             Spawn distributions (default all four)
+#   EXE                       Executable suffix, e.g. ".exe" on Windows
+#   BRUTE_FORCE_MAX_CIRCLES   Skip brute force above this count (default 10000)
+#   CENTER_MAX_CIRCLES        Skip the center distribution above this count
+#                             (default 50000); every circle starts in one cell
+
+OUTPUT=${OUTPUT:-bench_results.csv}
+TICKS=${TICKS:-60}
+COUNTS=${COUNTS:-"1000 10000 50000 100000 500000"}
+DISTRIBUTIONS=${DISTRIBUTIONS:-"center uniform clustered big-heavy"}
+EXE=${EXE:-""}
+BRUTE_FORCE_MAX_CIRCLES=${BRUTE_FORCE_MAX_CIRCLES:-10000}
+CENTER_MAX_CIRCLES=${CENTER_MAX_CIRCLES:-50000}
+
+for program in main unigrid quadtree; do
+  for distribution in $DISTRIBUTIONS; do
+    for count in $COUNTS; do
+      if [ "$program" = "main" ] && [ "$count" -gt "$BRUTE_FORCE_MAX_CIRCLES" ]; then
+        echo "Skipping $program with $count circles (BRUTE_FORCE_MAX_CIRCLES)"
+        continue
+      fi
+      if [ "$distribution" = "center" ] && [ "$count" -gt "$CENTER_MAX_CIRCLES" ]; then
+        echo "Skipping $distribution with $count circles (CENTER_MAX_CIRCLES)"
+        continue
+      fi
+
+      "./$program$EXE" --headless --ticks "$TICKS" --circles "$count" \
+        --distribution "$distribution" --bench-out "$OUTPUT" || exit 1
+    done
+  done
+done
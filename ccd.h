@@ -0,0 +1,161 @@
+#ifndef CCD_H
+#define CCD_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "solver.h"
+
+// Continuous collision detection shared by main.cpp, unigrid.cpp and
+// quadtree.cpp
+// A circle that moves further than its radius in one tick is fast. Pairs with
+// a fast circle that do not overlap at the end of the tick are swept from
+// oldPosition to position, so circles that passed through each other between
+// two ticks are still found. Both circles are moved back to where they first
+// touched and the pair goes to the solver like any other contact. The rest of
+// that tick's motion is dropped, which is what keeps them from tunneling
+
+// Fraction of the tick (0 to 1) at which a and b first touch, if both move in
+// a straight line from oldPosition to position
+// Returns false if they do not touch, or only move apart while touching
+template <typename CircleT>
+static bool getTimeOfImpact(const CircleT& a, const CircleT& b, float* time) {
+  // Solve |offset + motion * t| = a.radius + b.radius for the smallest t
+  Vector2 offset = Vector2Subtract(a.oldPosition, b.oldPosition);
+  Vector2 motion = Vector2Subtract(
+    Vector2Subtract(a.position, a.oldPosition),
+    Vector2Subtract(b.position, b.oldPosition)
+  );
+  float sumOfRadii = a.radius + b.radius;
+  float approach = Vector2DotProduct(offset, motion);
+  if (approach >= 0.0f) return false;
+
+  float distanceLeft =
+    Vector2DotProduct(offset, offset) - sumOfRadii * sumOfRadii;
+  if (distanceLeft <= 0.0f) {
+    // Already touching when the tick started
+    *time = 0.0f;
+    return true;
+  }
+
+  float motionSqr = Vector2DotProduct(motion, motion);
+  float discriminant = approach * approach - motionSqr * distanceLeft;
+  if (discriminant < 0.0f) return false;
+
+  float t = (-approach - sqrtf(discriminant)) / motionSqr;
+  if (t > 1.0f) return false;
+  *time = t;
+  return true;
+}
+
+// Mirror a circle that went past an edge of a width by height screen back
+// in, and point its velocity away from that edge
+// halfSize is half the width and height of its AABB, see getShapeHalfSize()
+// This is where the circle would be had it bounced off the edge during the
+// tick, so fast circles neither stop short of an edge nor go through it
+static Vector2 reflectOffEdges(
+  Vector2 position, Vector2* velocity, const Vector2 halfSize,
+  const float width, const float height
+) {
+  float maxX = width - halfSize.x;
+  float maxY = height - halfSize.y;
+  if (position.x > maxX) {
+    position.x = 2.0f * maxX - position.x;
+    velocity->x = -fabsf(velocity->x);
+  } else if (position.x < halfSize.x) {
+    position.x = 2.0f * halfSize.x - position.x;
+    velocity->x = fabsf(velocity->x);
+  }
+  if (position.y > maxY) {
+    position.y = 2.0f * maxY - position.y;
+    velocity->y = -fabsf(velocity->y);
+  } else if (position.y < halfSize.y) {
+    position.y = 2.0f * halfSize.y - position.y;
+    velocity->y = fabsf(velocity->y);
+  }
+  // Only a circle that crossed the whole screen in one tick is still outside
+  position.x = Clamp(position.x, halfSize.x, maxX);
+  position.y = Clamp(position.y, halfSize.y, maxY);
+  return position;
+}
+
+struct SweptHit {
+  uint32_t a;
+  uint32_t b;
+  float time;
+};
+
+struct SweptHits {
+  std::vector<SweptHit> hits;
+  // 1 if the circle was already moved back this tick
+  std::vector<uint8_t> rewound;
+
+  void beginTick() { hits.clear(); }
+
+  // CircleT needs index, radius, oldPosition and position
+  // Returns true if the pair touched during the tick
+  template <typename CircleT>
+  bool test(const CircleT& a, const CircleT& b) {
+    float time;
+    if (!getTimeOfImpact(a, b, &time)) return false;
+    hits.push_back({a.index, b.index, time});
+    return true;
+  }
+
+  // Move the circles of every hit back to where they touched, earliest hit
+  // first, and add the hit to contactSolver
+  // A circle is only moved back once per tick, so its later hits wait for
+  // the next tick
+  // Returns the number of hits that became contacts
+  template <typename GetCircle>
+  size_t resolve(
+    const size_t circleCount, GetCircle getCircle, ContactSolver& contactSolver,
+    const float elasticity, const float bounceThreshold
+  ) {
+    if (hits.empty()) return 0;
+
+    // Broadphases can report a pair more than once
+    std::sort(hits.begin(), hits.end(), [](const SweptHit& x, const SweptHit& y) {
+      return getPairId(x.a, x.b) < getPairId(y.a, y.b);
+    });
+    hits.erase(
+      std::unique(
+        hits.begin(), hits.end(),
+        [](const SweptHit& x, const SweptHit& y) {
+          return getPairId(x.a, x.b) == getPairId(y.a, y.b);
+        }
+      ),
+      hits.end()
+    );
+    // Ties keep the pair id order, so the result does not depend on the
+    // order the broadphase found them in
+    std::stable_sort(
+      hits.begin(), hits.end(),
+      [](const SweptHit& x, const SweptHit& y) { return x.time < y.time; }
+    );
+
+    rewound.assign(circleCount, 0);
+    size_t resolved = 0;
+    for (size_t i = 0; i < hits.size(); i++) {
+      const SweptHit& hit = hits[i];
+      if (rewound[hit.a] || rewound[hit.b]) continue;
+      rewound[hit.a] = 1;
+      rewound[hit.b] = 1;
+
+      auto& a = getCircle(hit.a);
+      auto& b = getCircle(hit.b);
+      a.setPosition(Vector2Lerp(a.oldPosition, a.position, hit.time));
+      b.setPosition(Vector2Lerp(b.oldPosition, b.position, hit.time));
+      contactSolver.addContact(a, b, elasticity, bounceThreshold);
+      resolved += 1;
+    }
+    return resolved;
+  }
+};
+
+#endif
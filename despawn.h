@@ -0,0 +1,151 @@
+#ifndef DESPAWN_H
+#define DESPAWN_H
+
+#include <raylib.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "solver.h"
+
+// Removing circles, shared by main.cpp, unigrid.cpp and quadtree.cpp
+// A despawned circle's slot is filled with the last circle (swap and pop), so
+// removing one never shifts the rest. Anything that holds on to a circle across
+// ticks keeps a CircleHandle instead of an index: a slot in CircleHandles that
+// follows the circle wherever it is moved, plus the slot's generation, which
+// changes when the circle is despawned so old handles stop finding anything
+// even after the slot is reused. The grid and quadtree store plain indices
+// since they are refilled every substep
+const uint32_t INVALID_CIRCLE(UINT32_MAX);
+
+// Holding this mouse button despawns circles in a square around the mouse
+const MouseButton DESPAWN_BUTTON(MOUSE_BUTTON_RIGHT);
+const float DESPAWN_HALF_WIDTH(20.0f);
+
+struct CircleHandle {
+  uint32_t slot = INVALID_CIRCLE;
+  uint32_t generation = 0;
+};
+
+struct CircleHandles {
+  // Index of the circle in each slot, INVALID_CIRCLE for free slots
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> generations;
+  std::vector<uint32_t> freeSlots;
+
+  CircleHandle add(const uint32_t index) {
+    CircleHandle handle;
+    if (freeSlots.empty()) {
+      handle.slot = static_cast<uint32_t>(indices.size());
+      indices.push_back(index);
+      generations.push_back(0);
+    } else {
+      handle.slot = freeSlots.back();
+      freeSlots.pop_back();
+      indices[handle.slot] = index;
+    }
+    handle.generation = generations[handle.slot];
+    return handle;
+  }
+
+  void move(const CircleHandle handle, const uint32_t index) {
+    indices[handle.slot] = index;
+  }
+
+  void remove(const CircleHandle handle) {
+    generations[handle.slot] += 1;
+    indices[handle.slot] = INVALID_CIRCLE;
+    freeSlots.push_back(handle.slot);
+  }
+
+  // Forget every circle, like when a snapshot replaces them all
+  void removeAll() {
+    for (uint32_t slot = 0; slot < indices.size(); slot++) {
+      if (indices[slot] != INVALID_CIRCLE) remove({slot, generations[slot]});
+    }
+  }
+
+  // Current index of the circle with handle, or INVALID_CIRCLE if it is gone
+  uint32_t find(const CircleHandle handle) const {
+    if (handle.slot >= indices.size()) return INVALID_CIRCLE;
+    if (generations[handle.slot] != handle.generation) return INVALID_CIRCLE;
+    return indices[handle.slot];
+  }
+
+  // Current index of the circle in slot, whatever its generation
+  uint32_t findSlot(const uint32_t slot) const {
+    return slot < indices.size() ? indices[slot] : INVALID_CIRCLE;
+  }
+
+  size_t memoryUsage() const {
+    return (indices.capacity() + generations.capacity() +
+            freeSlots.capacity()) *
+           sizeof(uint32_t);
+  }
+};
+
+// Give a handle to every circle without one, starting it with lifetime ticks
+// to live, and point every handle at its circle's current index
+// Call after circles were spawned, loaded or reordered
+// CircleT needs handle and ticksToLive
+template <typename GetCircle>
+static void assignCircleHandles(
+  CircleHandles& handles, const size_t count, GetCircle getCircle,
+  const int lifetime
+) {
+  for (size_t i = 0; i < count; i++) {
+    auto& circle = getCircle(i);
+    if (circle.handle.slot == INVALID_CIRCLE) {
+      circle.handle = handles.add(static_cast<uint32_t>(i));
+      circle.ticksToLive = lifetime;
+    } else {
+      handles.move(circle.handle, static_cast<uint32_t>(i));
+    }
+  }
+}
+
+// Point the contact cache at slots instead of indices before circles move
+// getCircle(i) is the circle at index i
+template <typename GetCircle>
+static void remapContactsToSlots(ContactSolver& solver, GetCircle getCircle) {
+  solver.remapCachedContacts([&](uint32_t index, uint32_t* slot) {
+    *slot = getCircle(index).handle.slot;
+    return true;
+  });
+}
+
+// And back to indices afterwards, dropping contacts with despawned circles
+static void remapContactsToIndices(
+  ContactSolver& solver, const CircleHandles& handles
+) {
+  solver.remapCachedContacts([&](uint32_t slot, uint32_t* index) {
+    *index = handles.findSlot(slot);
+    return *index != INVALID_CIRCLE;
+  });
+}
+
+// Sort indices so that popping the last circle into each of them in turn
+// never moves a circle that is still waiting to be despawned
+static void sortForDespawn(std::vector<uint32_t>& indices) {
+  std::sort(indices.begin(), indices.end(), std::greater<uint32_t>());
+  indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+}
+
+// Count down every circle's ticks to live and add the indices of those that
+// ran out to expired
+// Circles with no lifetime (0 ticks to live) never expire
+template <typename GetCircle>
+static void findExpiredCircles(
+  const size_t count, GetCircle getCircle, std::vector<uint32_t>& expired
+) {
+  for (size_t i = 0; i < count; i++) {
+    auto& circle = getCircle(i);
+    if (circle.ticksToLive <= 0) continue;
+    circle.ticksToLive -= 1;
+    if (circle.ticksToLive == 0) expired.push_back(static_cast<uint32_t>(i));
+  }
+}
+
+#endif
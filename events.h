@@ -0,0 +1,237 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "despawn.h"
+#include "solver.h"
+
+// Collision events shared by main.cpp, unigrid.cpp and quadtree.cpp
+// The narrowphase does not report anything itself. After each substep the
+// contacts the solver was given are copied out as touching pairs, keyed by
+// the handles of their circles so they survive despawns and reordering, and
+// once per tick the pairs are looked up in a hash table of last tick's to
+// find which pairs began, kept or stopped touching. The events are rebuilt on the
+// simulation's thread at the end of step(), so game logic can read them
+// between ticks without locking anything. Nothing is collected until an
+// event type is subscribed to, and only subscribed types are written out
+enum class CollisionEventType { begin, persist, end };
+
+struct CollisionEvent {
+  CollisionEventType type;
+  CircleHandle a;
+  CircleHandle b;
+  // From a to b, and how far they overlap, both zero for end events
+  Vector2 normal;
+  float penetration;
+};
+
+// Pair id to where the pair is in a list of touching pairs, with open
+// addressing like PairImpulseTable
+// Ids and positions share a slot, so a lookup misses the cache once
+struct TouchingPairTable {
+  struct Slot {
+    uint64_t pairId;  // 0 marks an empty slot
+    uint32_t position;
+  };
+  std::vector<Slot> slots;
+  uint64_t mask = 0;
+
+  // Empty the table and make room for count pairs
+  void reset(const size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+    slots.assign(capacity, Slot{0, 0});
+    mask = capacity - 1;
+  }
+
+  size_t getSlot(const uint64_t pairId) const {
+    uint64_t slot = (pairId * 0x9E3779B97F4A7C15ull) >> 32;
+    while (slots[slot & mask].pairId != 0 &&
+           slots[slot & mask].pairId != pairId) {
+      slot++;
+    }
+    return slot & mask;
+  }
+
+  // Returns false, and leaves the table alone, if the pair is already in it
+  bool insert(const uint64_t pairId, const uint32_t position) {
+    Slot& slot = slots[getSlot(pairId)];
+    if (slot.pairId == pairId) return false;
+    slot.pairId = pairId;
+    slot.position = position;
+    return true;
+  }
+
+  // Position of the pair, or INVALID_CIRCLE if it is not in the table
+  uint32_t find(const uint64_t pairId) const {
+    if (slots.empty()) return INVALID_CIRCLE;
+    const Slot& slot = slots[getSlot(pairId)];
+    return slot.pairId == pairId ? slot.position : INVALID_CIRCLE;
+  }
+
+  size_t memoryUsage() const { return slots.capacity() * sizeof(Slot); }
+};
+
+struct CollisionEvents {
+  // Bit t is set if CollisionEventType t is subscribed to
+  uint32_t subscribed = 0;
+  // Events of the last tick: begins and persists in the order the pairs were
+  // found, then ends
+  std::vector<CollisionEvent> events;
+
+  struct TouchingPair {
+    uint64_t pairId;  // From the handles' slots, see getPairId()
+    CircleHandle a;
+    CircleHandle b;
+    Vector2 normal;
+    float penetration;
+  };
+  // Pairs touching this tick, from every substep so far
+  std::vector<TouchingPair> touching;
+  TouchingPairTable touchingTable;
+  // Pairs that touched last tick
+  std::vector<TouchingPair> previous;
+  TouchingPairTable previousTable;
+  // Whether each pair in previous was found again this tick
+  std::vector<char> previousFound;
+
+  static uint32_t getTypeBit(const CollisionEventType type) {
+    return 1u << static_cast<int>(type);
+  }
+
+  void subscribe(const CollisionEventType type) {
+    subscribed |= getTypeBit(type);
+  }
+
+  void subscribeAll() {
+    subscribe(CollisionEventType::begin);
+    subscribe(CollisionEventType::persist);
+    subscribe(CollisionEventType::end);
+  }
+
+  bool isSubscribed(const CollisionEventType type) const {
+    return (subscribed & getTypeBit(type)) != 0;
+  }
+
+  // Copy out the pairs the solver was given this substep
+  // getCircle(i) returns the circle with index i, which needs a handle
+  template <typename GetCircle>
+  void addContacts(const std::vector<Contact>& contacts, GetCircle getCircle) {
+    if (subscribed == 0) return;
+    for (size_t i = 0; i < contacts.size(); i++) {
+      const Contact& contact = contacts[i];
+      TouchingPair pair;
+      pair.a = getCircle(contact.a).handle;
+      pair.b = getCircle(contact.b).handle;
+      pair.normal = contact.normal;
+      // a always has the lower slot, so a pair looks the same every tick
+      if (pair.b.slot < pair.a.slot) {
+        std::swap(pair.a, pair.b);
+        pair.normal = Vector2Negate(pair.normal);
+      }
+      pair.pairId = getPairId(pair.a.slot, pair.b.slot);
+      pair.penetration = contact.penetration;
+      touching.push_back(pair);
+    }
+  }
+
+  // Turn this tick's pairs into events, once per tick after the last substep
+  // Pairs that stopped being tested because both circles fell asleep are
+  // still touching, so they are kept instead of ending
+  // getCircle(i) returns the circle with index i, which needs sleeping
+  template <typename GetCircle>
+  void endTick(const CircleHandles& handles, GetCircle getCircle) {
+    events.clear();
+    if (subscribed == 0) {
+      touching.clear();
+      previous.clear();
+      previousTable.reset(0);
+      return;
+    }
+
+    // Substeps find the same pair more than once, keep the first
+    // Sleeping pairs from last tick are added below, so leave room for them
+    touchingTable.reset(touching.size() + previous.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < touching.size(); i++) {
+      if (!touchingTable.insert(touching[i].pairId, kept)) continue;
+      touching[kept] = touching[i];
+      kept += 1;
+    }
+    touching.resize(kept);
+
+    previousFound.assign(previous.size(), 0);
+    for (size_t i = 0; i < touching.size(); i++) {
+      uint32_t found = previousTable.find(touching[i].pairId);
+      // The same slots with other generations are a new pair, one of the
+      // old circles was despawned and its slot reused
+      if (found != INVALID_CIRCLE && isSamePair(previous[found], touching[i])) {
+        previousFound[found] = 1;
+        addEvent(CollisionEventType::persist, touching[i]);
+      } else {
+        addEvent(CollisionEventType::begin, touching[i]);
+      }
+    }
+
+    for (size_t i = 0; i < previous.size(); i++) {
+      if (previousFound[i]) continue;
+      const TouchingPair& pair = previous[i];
+      uint32_t a = handles.find(pair.a);
+      uint32_t b = handles.find(pair.b);
+      if (a != INVALID_CIRCLE && b != INVALID_CIRCLE &&
+          getCircle(a).sleeping && getCircle(b).sleeping &&
+          touchingTable.insert(pair.pairId, touching.size())) {
+        addEvent(CollisionEventType::persist, pair);
+        touching.push_back(pair);
+        continue;
+      }
+      TouchingPair ended = pair;
+      ended.normal = {0.0f, 0.0f};
+      ended.penetration = 0.0f;
+      addEvent(CollisionEventType::end, ended);
+    }
+
+    previous.swap(touching);
+    std::swap(previousTable, touchingTable);
+    touching.clear();
+  }
+
+  // Run visit(event) over the last tick's events of type
+  template <typename Visit>
+  void forEachEvent(const CollisionEventType type, Visit visit) const {
+    for (size_t i = 0; i < events.size(); i++) {
+      if (events[i].type == type) visit(events[i]);
+    }
+  }
+
+  size_t memoryUsage() const {
+    return events.capacity() * sizeof(CollisionEvent) +
+           (touching.capacity() + previous.capacity()) * sizeof(TouchingPair) +
+           touchingTable.memoryUsage() + previousTable.memoryUsage() +
+           previousFound.capacity();
+  }
+
+  static bool isSamePair(const TouchingPair& a, const TouchingPair& b) {
+    return a.pairId == b.pairId && a.a.generation == b.a.generation &&
+           a.b.generation == b.b.generation;
+  }
+
+  void addEvent(const CollisionEventType type, const TouchingPair& pair) {
+    if (!isSubscribed(type)) return;
+    CollisionEvent event;
+    event.type = type;
+    event.a = pair.a;
+    event.b = pair.b;
+    event.normal = pair.normal;
+    event.penetration = pair.penetration;
+    events.push_back(event);
+  }
+};
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef FLUID_H
+#define FLUID_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "jobs.h"
+#include "shape.h"
+
+// Smoothed-particle hydrodynamics for unigrid.cpp
+// In fluid mode every circle is also a fluid particle. Each substep the
+// density at every particle is summed from the particles within the kernel
+// radius around it, which sets its pressure, and then every particle is
+// pushed away from denser neighbors and dragged along with the velocity of the
+// ones around it. The kernels are the 2D versions of Muller et al. 2003: poly6
+// for density, spiky for pressure and the laplacian of the viscosity kernel
+// Circles still collide as usual, the fluid acts between circles that are
+// close but not touching yet. Walls and other immovable bodies are not
+// particles
+// Neighbors come from a grid of particle centers with cells one kernel radius
+// wide, so every neighbor is in the 3 by 3 cells around a particle. Particles
+// are sorted by cell into flat arrays, which makes each row of those cells one
+// run of particles, and kernels are summed over a run FLUID_LANES particles at
+// a time into separate sums, without branches, so the compiler can turn them
+// into SIMD
+const float DEFAULT_FLUID_KERNEL_RADIUS(30.0f);
+const float DEFAULT_FLUID_REST_DENSITY(0.002f);
+const float DEFAULT_FLUID_STIFFNESS(100000.0f);
+const float DEFAULT_FLUID_VISCOSITY(3.0f);
+const int FLUID_LANES(4);
+// Particles per job when kernels are split between threads
+const size_t FLUID_CHUNK_SIZE(256);
+
+struct FluidSettings {
+  bool enabled = false;
+  float kernelRadius = DEFAULT_FLUID_KERNEL_RADIUS;
+  // Mass per square pixel the fluid settles at
+  float restDensity = DEFAULT_FLUID_REST_DENSITY;
+  // Pressure per unit of density above restDensity
+  // Below it there is no pressure, which keeps sparse particles from clumping
+  float stiffness = DEFAULT_FLUID_STIFFNESS;
+  float viscosity = DEFAULT_FLUID_VISCOSITY;
+};
+
+struct FluidSolver {
+  FluidSettings settings;
+
+  // Grid over a width by height screen, with particles off it filed in the
+  // edge cells
+  int columns = 0;
+  int rows = 0;
+  // Cell (x, y) holds particles [cellStarts[c], cellStarts[c + 1]), with
+  // c = y * columns + x
+  std::vector<uint32_t> cellStarts;
+  // Cell of every circle, UINT32_MAX for circles that are not particles
+  std::vector<uint32_t> circleCells;
+
+  // Every particle, sorted by cell
+  std::vector<uint32_t> circleIndices;
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> velocityX;
+  std::vector<float> velocityY;
+  std::vector<float> mass;
+  std::vector<float> density;
+  // Area each particle stands for, mass over density
+  std::vector<float> volume;
+  std::vector<float> pressure;
+
+  // Force on every circle this substep, by index, zero for circles that are
+  // not particles
+  std::vector<Vector2> forces;
+
+  void getCell(const float px, const float py, int* cellX, int* cellY) const {
+    *cellX = Clamp(floorf(px / settings.kernelRadius), 0.0f, columns - 1.0f);
+    *cellY = Clamp(floorf(py / settings.kernelRadius), 0.0f, rows - 1.0f);
+  }
+
+  // Sort the particles among count circles by cell, counting first so each
+  // particle is written straight into place
+  // CircleT needs shape, mass, position and velocity
+  template <typename GetCircle>
+  void fill(
+    const size_t count, GetCircle getCircle, const int width, const int height
+  ) {
+    columns = static_cast<int>(ceilf(width / settings.kernelRadius));
+    rows = static_cast<int>(ceilf(height / settings.kernelRadius));
+    cellStarts.assign(columns * rows + 1, 0);
+    circleCells.assign(count, UINT32_MAX);
+    for (size_t i = 0; i < count; i++) {
+      const auto& circle = getCircle(i);
+      if (circle.shape != ShapeType::circle || circle.mass >= IMMOVABLE_MASS) {
+        continue;
+      }
+      int cellX;
+      int cellY;
+      getCell(circle.position.x, circle.position.y, &cellX, &cellY);
+      circleCells[i] = cellY * columns + cellX;
+      cellStarts[circleCells[i] + 1] += 1;
+    }
+    for (size_t c = 1; c < cellStarts.size(); c++) {
+      cellStarts[c] += cellStarts[c - 1];
+    }
+
+    size_t particleCount = cellStarts.back();
+    circleIndices.resize(particleCount);
+    x.resize(particleCount);
+    y.resize(particleCount);
+    velocityX.resize(particleCount);
+    velocityY.resize(particleCount);
+    mass.resize(particleCount);
+    density.resize(particleCount);
+    volume.resize(particleCount);
+    pressure.resize(particleCount);
+    std::vector<uint32_t> nextSlot(cellStarts.begin(), cellStarts.end() - 1);
+    for (size_t i = 0; i < count; i++) {
+      if (circleCells[i] == UINT32_MAX) continue;
+      const auto& circle = getCircle(i);
+      uint32_t slot = nextSlot[circleCells[i]]++;
+      circleIndices[slot] = static_cast<uint32_t>(i);
+      x[slot] = circle.position.x;
+      y[slot] = circle.position.y;
+      velocityX[slot] = circle.velocity.x;
+      velocityY[slot] = circle.velocity.y;
+      mass[slot] = static_cast<float>(circle.mass);
+    }
+  }
+
+  // Run visit(begin, end) for every row of the 3 by 3 cells around the cell of
+  // particle i, where [begin, end) are particles
+  template <typename Visit>
+  void forEachNeighborRun(const size_t i, Visit visit) const {
+    int cellX;
+    int cellY;
+    getCell(x[i], y[i], &cellX, &cellY);
+    int minX = cellX > 0 ? cellX - 1 : 0;
+    int maxX = cellX < columns - 1 ? cellX + 1 : columns - 1;
+    int minY = cellY > 0 ? cellY - 1 : 0;
+    int maxY = cellY < rows - 1 ? cellY + 1 : rows - 1;
+    for (int cy = minY; cy <= maxY; cy++) {
+      visit(
+        cellStarts[cy * columns + minX], cellStarts[cy * columns + maxX + 1]
+      );
+    }
+  }
+
+  // Mass of particles [begin, end) around particle i, added to sums[0] and
+  // on, one particle per sum, without the kernel constant
+  template <int Count>
+  void addDensityTerms(const size_t i, const uint32_t begin, float sums[]) const {
+    const float hSqr = settings.kernelRadius * settings.kernelRadius;
+    for (int k = 0; k < Count; k++) {
+      uint32_t j = begin + k;
+      float dx = x[i] - x[j];
+      float dy = y[i] - y[j];
+      float q = fmaxf(hSqr - (dx * dx + dy * dy), 0.0f);
+      sums[k] += mass[j] * q * q * q;
+    }
+  }
+
+  // Density at particle i, itself included, with the poly6 kernel
+  float sumDensity(const size_t i) const {
+    const float poly6 = 4.0f / (PI * powf(settings.kernelRadius, 8.0f));
+
+    float sums[FLUID_LANES] = {};
+    forEachNeighborRun(i, [&](uint32_t begin, const uint32_t end) {
+      for (; begin + FLUID_LANES <= end; begin += FLUID_LANES) {
+        addDensityTerms<FLUID_LANES>(i, begin, sums);
+      }
+      for (; begin < end; begin++) addDensityTerms<1>(i, begin, sums);
+    });
+
+    float sum = 0.0f;
+    for (int k = 0; k < FLUID_LANES; k++) sum += sums[k];
+    return poly6 * sum;
+  }
+
+  // Pressure and viscosity of particles [begin, end) on particle i, added to
+  // sums[0] and on, one particle per sum, without the kernel constants
+  // Outside the kernel q is 0, and i itself adds nothing as dx, dy and its
+  // velocity difference are 0
+  template <int Count>
+  void addForceTerms(
+    const size_t i, const uint32_t begin, float pressureX[], float pressureY[],
+    float viscosityX[], float viscosityY[]
+  ) const {
+    const float h = settings.kernelRadius;
+    for (int k = 0; k < Count; k++) {
+      uint32_t j = begin + k;
+      float dx = x[i] - x[j];
+      float dy = y[i] - y[j];
+      float distance = sqrtf(dx * dx + dy * dy);
+      float q = fmaxf(h - distance, 0.0f);
+      // Spiky gradient, along the direction from j to i
+      float push = volume[j] * (pressure[i] + pressure[j]) * 0.5f * q * q /
+                   fmaxf(distance, SHAPE_EPSILON);
+      pressureX[k] += push * dx;
+      pressureY[k] += push * dy;
+      // Viscosity laplacian
+      float drag = volume[j] * q;
+      viscosityX[k] += drag * (velocityX[j] - velocityX[i]);
+      viscosityY[k] += drag * (velocityY[j] - velocityY[i]);
+    }
+  }
+
+  // Force on particle i from the pressure and viscosity around it
+  Vector2 sumForce(const size_t i) const {
+    const float h = settings.kernelRadius;
+    const float spiky = 30.0f / (PI * powf(h, 5.0f));
+    const float viscosityLaplacian = 40.0f / (PI * powf(h, 5.0f));
+
+    float pressureX[FLUID_LANES] = {};
+    float pressureY[FLUID_LANES] = {};
+    float viscosityX[FLUID_LANES] = {};
+    float viscosityY[FLUID_LANES] = {};
+    forEachNeighborRun(i, [&](uint32_t begin, const uint32_t end) {
+      for (; begin + FLUID_LANES <= end; begin += FLUID_LANES) {
+        addForceTerms<FLUID_LANES>(
+          i, begin, pressureX, pressureY, viscosityX, viscosityY
+        );
+      }
+      for (; begin < end; begin++) {
+        addForceTerms<1>(i, begin, pressureX, pressureY, viscosityX, viscosityY);
+      }
+    });
+
+    Vector2 force = {0.0f, 0.0f};
+    for (int k = 0; k < FLUID_LANES; k++) {
+      force.x += spiky * pressureX[k] +
+                 settings.viscosity * viscosityLaplacian * viscosityX[k];
+      force.y += spiky * pressureY[k] +
+                 settings.viscosity * viscosityLaplacian * viscosityY[k];
+    }
+    // Force per area, over the area the particle stands for
+    return Vector2Scale(force, volume[i]);
+  }
+
+  // Fill forces for count circles on a width by height screen, splitting the
+  // particles between jobPool's threads
+  template <typename GetCircle>
+  void computeForces(
+    const size_t count, GetCircle getCircle, const int width, const int height,
+    JobPool& jobPool
+  ) {
+    fill(count, getCircle, width, height);
+
+    jobPool.parallelFor(
+      circleIndices.size(), FLUID_CHUNK_SIZE,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          density[i] = sumDensity(i);
+          volume[i] = mass[i] / density[i];
+          pressure[i] =
+            settings.stiffness * fmaxf(density[i] - settings.restDensity, 0.0f);
+        }
+      }
+    );
+
+    forces.assign(count, {0.0f, 0.0f});
+    jobPool.parallelFor(
+      circleIndices.size(), FLUID_CHUNK_SIZE,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          forces[circleIndices[i]] = sumForce(i);
+        }
+      }
+    );
+  }
+
+  size_t memoryUsage() const {
+    return (cellStarts.capacity() + circleCells.capacity() +
+            circleIndices.capacity()) *
+             sizeof(uint32_t) +
+           (x.capacity() + y.capacity() + velocityX.capacity() +
+            velocityY.capacity() + mass.capacity() + density.capacity() +
+            volume.capacity() + pressure.capacity()) *
+             sizeof(float) +
+           forces.capacity() * sizeof(Vector2);
+  }
+};
+
+#endif
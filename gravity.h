@@ -0,0 +1,75 @@
+#ifndef GRAVITY_H
+#define GRAVITY_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+
+#include "shape.h"
+
+// N-body gravity for quadtree.cpp
+// Every circle pulls every other one towards it with
+// strength * m1 * m2 / (d^2 + GRAVITY_SOFTENING^2), the softening keeping
+// circles that touch from flinging each other apart. Summing every pair is
+// O(n^2), so forces use the Barnes-Hut approximation instead: every quad keeps
+// the total mass and center of mass of the circles in it and below it, and a
+// quad seen from a circle under an angle smaller than theta, its width over
+// its distance to the circle, pulls as one body at its center of mass. A
+// circle then sums O(log n) pulls, and theta trades accuracy for speed: 0 is
+// exact, 0.5 is off by a few percent, 1 is coarse
+// Immovable bodies, the walls of shape.h, neither count as mass nor move
+const float DEFAULT_GRAVITY_THETA(0.5f);
+const float GRAVITY_SOFTENING(8.0f);
+// Circles per job when forces are split between threads
+const size_t GRAVITY_CHUNK_SIZE(256);
+
+struct GravitySettings {
+  // 0 turns gravity off
+  float strength = 0.0f;
+  float theta = DEFAULT_GRAVITY_THETA;
+
+  bool enabled() const { return strength > 0.0f; }
+
+  // Pull on a body of mass at position from a body of sourceMass at source
+  Vector2 getAttraction(
+    const Vector2 position, const float mass, const Vector2 source,
+    const float sourceMass
+  ) const {
+    Vector2 offset = Vector2Subtract(source, position);
+    float inverseDistance = 1.0f / sqrtf(
+      Vector2LengthSqr(offset) + GRAVITY_SOFTENING * GRAVITY_SOFTENING
+    );
+    return Vector2Scale(
+      offset, strength * mass * sourceMass * inverseDistance * inverseDistance *
+                inverseDistance
+    );
+  }
+};
+
+// Mass of every body filed in a quad and every quad below it, summed
+struct MassSummary {
+  float mass = 0.0f;
+  // Sum of mass * position, so the center of mass is moment / mass
+  Vector2 moment = {0.0f, 0.0f};
+
+  void clear() {
+    mass = 0.0f;
+    moment = {0.0f, 0.0f};
+  }
+
+  void add(const float bodyMass, const Vector2 position) {
+    mass += bodyMass;
+    moment = Vector2Add(moment, Vector2Scale(position, bodyMass));
+  }
+
+  Vector2 getCenterOfMass() const { return Vector2Scale(moment, 1.0f / mass); }
+};
+
+// Mass a body pulls others with
+// CircleT needs mass
+template <typename CircleT>
+static float getGravityMass(const CircleT& body) {
+  return body.mass >= IMMOVABLE_MASS ? 0.0f : static_cast<float>(body.mass);
+}
+
+#endif
@@ -0,0 +1,394 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "events.h"
+#include "fluid.h"
+#include "gravity.h"
+#include "layers.h"
+#include "query.h"
+#include "reorder.h"
+#include "rng.h"
+#include "solver.h"
+#include "spawn.h"
+#include "stats.h"
+#include "substep.h"
+
+// Command-line options shared by main.cpp, unigrid.cpp and quadtree.cpp
+//   --headless        Run without opening a window
+//   --ticks N         Number of physics ticks to run when headless
+//   --presses N       Press the spawn key N times before the first tick
+//   --stats-every N   Print collision counters every N ticks (0 = summary only)
+//   --circles N       Spawn N circles before the first tick
+//   --distribution D  How --circles lays them out: center, uniform, clustered
+//                     or big-heavy
+//   --radius MIN MAX  Radius range of the small circles spawned by --circles
+//   --velocity MIN MAX
+//                     Speed range of the circles spawned by --circles
+//   --mass M          Mass of the small circles spawned by --circles
+//   --threads N       Worker threads (default: one per core)
+//   --load PATH       Start from a snapshot instead of an empty screen
+//   --save PATH       Save a snapshot when the program ends
+//   --record PATH     Record the run into PATH and PATH.idx
+//   --record-every N  Record every Nth tick (default 1)
+//   --play PATH       Show a recording instead of running the simulation
+//   --record-input PATH
+//                     Log inputs and per-tick checksums into PATH
+//   --replay-input PATH
+//                     Replay a logged run headlessly and check its checksums
+//   --seed N          Seed for everything spawned (default DEFAULT_SEED)
+//   --solver-iterations N
+//                     Contact solver passes per tick (default
+//                     DEFAULT_SOLVER_ITERATIONS)
+//   --no-warm-start   Start every contact from zero impulse
+//   --position-iterations N
+//                     Passes moving overlapping circles apart per tick
+//                     (default DEFAULT_POSITION_ITERATIONS, 0 turns them off)
+//   --tick-rate HZ    Physics ticks per simulated second (default TARGET_FPS)
+//   --adaptive-substeps
+//                     Split fast or deeply overlapping ticks into substeps
+//   --max-substeps N  Most substeps per tick (default DEFAULT_MAX_SUBSTEPS)
+//   --queries N       Run a batch of N spatial queries after every headless
+//                     tick and time it
+//   --lifetime TICKS  Despawn every circle TICKS ticks after it spawned
+//                     (default 0, never)
+//   --layers N        Split new circles between N layers that only collide
+//                     with themselves (default 1, at most MAX_LAYERS)
+//   --events          Collect collision events and print how many there were
+//   --walls           Add two slanted capsule walls, a box pillar and a box
+//                     paddle, see addWalls() in shape.h
+//   --obstacles PATH  Load static obstacles from PATH, see
+//                     StaticObstacles::load()
+//   --maze SPACING    Add the walls of a maze with SPACING pixel rooms as
+//                     static obstacles
+//   --reorder-every TICKS
+//                     Sort circles by cell every TICKS ticks (default
+//                     DEFAULT_REORDER_INTERVAL, 0 never), grid and quadtree
+//                     only
+//   --gravity G       Pull every circle towards every other one with strength
+//                     G (default 0, off), quadtree only, see gravity.h
+//   --theta T         Barnes-Hut opening angle for --gravity (default
+//                     DEFAULT_GRAVITY_THETA, 0 is exact)
+//   --fluid           Push and drag circles like the particles of a fluid,
+//                     grid only, see fluid.h
+//   --fluid-radius R  Kernel radius for --fluid (default
+//                     DEFAULT_FLUID_KERNEL_RADIUS)
+//   --bench-out PATH  Append the headless run's timings to PATH, as JSON lines
+//                     if PATH ends in .json and as CSV otherwise
+struct Options {
+  bool headless = false;
+  int ticks = 600;
+  int presses = 0;
+  int statsEvery = 0;
+  int circles = 0;
+  SpawnParams spawn;
+  int threads = 0;
+  const char* loadPath = nullptr;
+  const char* savePath = nullptr;
+  const char* recordPath = nullptr;
+  int recordEvery = 1;
+  const char* playPath = nullptr;
+  const char* recordInputPath = nullptr;
+  const char* replayInputPath = nullptr;
+  uint64_t seed = DEFAULT_SEED;
+  int solverIterations = DEFAULT_SOLVER_ITERATIONS;
+  bool warmStarting = true;
+  int positionIterations = DEFAULT_POSITION_ITERATIONS;
+  int tickRate = 0;  // 0 keeps the program's TARGET_FPS
+  bool adaptiveSubsteps = false;
+  int maxSubsteps = DEFAULT_MAX_SUBSTEPS;
+  int queries = 0;
+  int lifetime = 0;
+  int reorderInterval = DEFAULT_REORDER_INTERVAL;
+  bool events = false;
+  int layers = 1;
+  bool walls = false;
+  const char* obstaclesPath = nullptr;
+  float mazeSpacing = 0.0f;
+  float gravity = 0.0f;
+  float theta = DEFAULT_GRAVITY_THETA;
+  bool fluid = false;
+  float fluidRadius = DEFAULT_FLUID_KERNEL_RADIUS;
+  const char* benchOut = nullptr;
+};
+
+static void printUsage(const char* program) {
+  fprintf(
+    stderr,
+    "Usage: %s [--headless] [--ticks N] [--presses N] [--stats-every N]\n"
+    "       [--circles N] [--distribution center|uniform|clustered|big-heavy]\n"
+    "       [--radius MIN MAX] [--velocity MIN MAX] [--mass M] [--threads N]\n"
+    "       [--load PATH] [--save PATH] [--record PATH] [--record-every N]\n"
+    "       [--play PATH] [--record-input PATH] [--replay-input PATH]\n"
+    "       [--seed N] [--solver-iterations N] [--no-warm-start]\n"
+    "       [--position-iterations N]\n"
+    "       [--tick-rate HZ] [--adaptive-substeps] [--max-substeps N]\n"
+    "       [--queries N] [--lifetime TICKS] [--reorder-every TICKS]\n"
+    "       [--events] [--layers N] [--walls] [--obstacles PATH]\n"
+    "       [--maze SPACING] [--gravity G] [--theta T] [--fluid]\n"
+    "       [--fluid-radius R] [--bench-out PATH]\n",
+    program
+  );
+}
+
+static Options parseOptions(const int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    bool hasTwoValues = i + 2 < argc;
+    if (strcmp(argv[i], "--headless") == 0) {
+      options.headless = true;
+    } else if (strcmp(argv[i], "--ticks") == 0 && hasValue) {
+      options.ticks = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--presses") == 0 && hasValue) {
+      options.presses = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--stats-every") == 0 && hasValue) {
+      options.statsEvery = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--circles") == 0 && hasValue) {
+      options.circles = atoi(argv[++i]);
+      if (options.circles < 0) {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--distribution") == 0 && hasValue &&
+               parseSpawnDistribution(argv[i + 1], &options.spawn.distribution)) {
+      i++;
+    } else if (strcmp(argv[i], "--radius") == 0 && hasTwoValues) {
+      options.spawn.radiusMin = atoi(argv[++i]);
+      options.spawn.radiusMax = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--velocity") == 0 && hasTwoValues) {
+      options.spawn.velocityMin = atof(argv[++i]);
+      options.spawn.velocityMax = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--mass") == 0 && hasValue) {
+      options.spawn.mass = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && hasValue) {
+      options.threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--load") == 0 && hasValue) {
+      options.loadPath = argv[++i];
+    } else if (strcmp(argv[i], "--save") == 0 && hasValue) {
+      options.savePath = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && hasValue) {
+      options.recordPath = argv[++i];
+    } else if (strcmp(argv[i], "--record-every") == 0 && hasValue) {
+      options.recordEvery = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--play") == 0 && hasValue) {
+      options.playPath = argv[++i];
+    } else if (strcmp(argv[i], "--record-input") == 0 && hasValue) {
+      options.recordInputPath = argv[++i];
+    } else if (strcmp(argv[i], "--replay-input") == 0 && hasValue) {
+      options.replayInputPath = argv[++i];
+    } else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+      options.seed = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--solver-iterations") == 0 && hasValue) {
+      options.solverIterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--no-warm-start") == 0) {
+      options.warmStarting = false;
+    } else if (strcmp(argv[i], "--position-iterations") == 0 && hasValue) {
+      options.positionIterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tick-rate") == 0 && hasValue) {
+      options.tickRate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--adaptive-substeps") == 0) {
+      options.adaptiveSubsteps = true;
+    } else if (strcmp(argv[i], "--max-substeps") == 0 && hasValue) {
+      options.maxSubsteps = atoi(argv[++i]);
+      if (options.maxSubsteps < 1) {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--queries") == 0 && hasValue) {
+      options.queries = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--lifetime") == 0 && hasValue) {
+      options.lifetime = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reorder-every") == 0 && hasValue) {
+      options.reorderInterval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--events") == 0) {
+      options.events = true;
+    } else if (strcmp(argv[i], "--layers") == 0 && hasValue) {
+      options.layers = atoi(argv[++i]);
+      if (options.layers < 1 || options.layers > MAX_LAYERS) {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--walls") == 0) {
+      options.walls = true;
+    } else if (strcmp(argv[i], "--obstacles") == 0 && hasValue) {
+      options.obstaclesPath = argv[++i];
+    } else if (strcmp(argv[i], "--maze") == 0 && hasValue) {
+      options.mazeSpacing = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--gravity") == 0 && hasValue) {
+      options.gravity = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--theta") == 0 && hasValue) {
+      options.theta = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--fluid") == 0) {
+      options.fluid = true;
+    } else if (strcmp(argv[i], "--fluid-radius") == 0 && hasValue) {
+      options.fluidRadius = atof(argv[++i]);
+      if (options.fluidRadius <= 0.0f) {
+        printUsage(argv[0]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--bench-out") == 0 && hasValue) {
+      options.benchOut = argv[++i];
+    } else {
+      printUsage(argv[0]);
+      exit(1);
+    }
+  }
+  return options;
+}
+
+// Append one benchmark result to path
+static void writeBenchResult(
+  const char* path, const char* engine, const Options& options,
+  const size_t circleCount, const double nanosecondsPerTick,
+  const size_t memoryBytes, const CollisionStats& averageStats
+) {
+  size_t pathLength = strlen(path);
+  bool isJson =
+    pathLength >= 5 && strcmp(path + pathLength - 5, ".json") == 0;
+
+  FILE* file = fopen(path, "a");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return;
+  }
+
+  const char* distribution = getSpawnDistributionName(options.spawn.distribution);
+  if (isJson) {
+    fprintf(
+      file,
+      "{\"engine\": \"%s\", \"circles\": %zu, \"distribution\": \"%s\", "
+      "\"ticks\": %d, \"ns_per_tick\": %.0f, \"memory_bytes\": %zu, "
+      "\"pairs_per_tick\": %lld, \"overlaps_per_tick\": %lld}\n",
+      engine, circleCount, distribution, options.ticks, nanosecondsPerTick,
+      memoryBytes, averageStats.candidatePairs, averageStats.overlaps
+    );
+  } else {
+    // Write the header if the file is new
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0) {
+      fprintf(
+        file,
+        "engine,circles,distribution,ticks,ns_per_tick,memory_bytes,"
+        "pairs_per_tick,overlaps_per_tick\n"
+      );
+    }
+    fprintf(
+      file, "%s,%zu,%s,%d,%.0f,%zu,%lld,%lld\n", engine, circleCount,
+      distribution, options.ticks, nanosecondsPerTick, memoryBytes,
+      averageStats.candidatePairs, averageStats.overlaps
+    );
+  }
+  fclose(file);
+}
+
+// Queries an AI layer might make around count random circles: in turn the
+// 8 nearest, a 50 px circle, a 100 px box and a 300 px ray
+template <typename Simulation>
+static void addHeadlessQueries(
+  Simulation& simulation, QueryBatch& batch, Rng& rng, const int count
+) {
+  batch.clear();
+  if (simulation.circleCount() == 0) return;
+  for (int i = 0; i < count; i++) {
+    Vector2 point = simulation.getCircle(
+      rng.nextInt(static_cast<int>(simulation.circleCount()))
+    ).position;
+    switch (i % 4) {
+      case 0:
+        batch.addNearest(point, 8);
+        break;
+      case 1:
+        batch.addCircle(point, 50.0f, 32);
+        break;
+      case 2:
+        batch.addAabb(
+          Vector2SubtractValue(point, 50.0f), Vector2AddValue(point, 50.0f), 32
+        );
+        break;
+      default:
+        batch.addRaycast(
+          point, {rng.nextFloat() - 0.5f, rng.nextFloat() - 0.5f}, 300.0f
+        );
+        break;
+    }
+  }
+}
+
+// Step the simulation without a window and print the collision counters
+// Simulation needs step(), circleCount() and memoryUsage(), getCircle()
+// and runQueries() for --queries, and collisionEvents for --events
+template <typename Simulation>
+static void runHeadless(
+  Simulation& simulation, const CollisionStats& stats, const Options& options,
+  const char* engine, const char* nodeLabel
+) {
+  CollisionStats total;
+  char label[50];
+  std::chrono::nanoseconds elapsed(0);
+  QueryBatch queries;
+  Rng queryRng(options.seed, 1);
+  std::chrono::nanoseconds queryElapsed(0);
+  // Events of each CollisionEventType, over the whole run
+  long long eventCounts[3] = {};
+  for (int tick = 0; tick < options.ticks; tick++) {
+    auto start = std::chrono::steady_clock::now();
+    simulation.step();
+    elapsed += std::chrono::steady_clock::now() - start;
+    total.add(stats);
+    const std::vector<CollisionEvent>& events = simulation.collisionEvents.events;
+    for (size_t i = 0; i < events.size(); i++) {
+      eventCounts[static_cast<int>(events[i].type)] += 1;
+    }
+    if (options.queries > 0) {
+      addHeadlessQueries(simulation, queries, queryRng, options.queries);
+      start = std::chrono::steady_clock::now();
+      simulation.runQueries(queries);
+      queryElapsed += std::chrono::steady_clock::now() - start;
+    }
+    if (options.statsEvery > 0 && tick % options.statsEvery == 0) {
+      sprintf(label, "tick %d", tick);
+      stats.print(stdout, label, nodeLabel);
+    }
+  }
+
+  double nanosecondsPerTick =
+    options.ticks > 0 ? static_cast<double>(elapsed.count()) / options.ticks
+                      : 0.0;
+  size_t memoryBytes = simulation.memoryUsage();
+
+  printf(
+    "%s: %d ticks, %zu circles, %.0f ns/tick, %zu bytes\n", engine,
+    options.ticks, simulation.circleCount(), nanosecondsPerTick, memoryBytes
+  );
+  total.divide(options.ticks);
+  total.print(stdout, "average per tick", nodeLabel);
+  if (options.queries > 0 && options.ticks > 0) {
+    printf(
+      "%d queries per tick, %.0f ns/query\n", options.queries,
+      static_cast<double>(queryElapsed.count()) /
+        (static_cast<double>(options.ticks) * options.queries)
+    );
+  }
+  if (options.events && options.ticks > 0) {
+    printf(
+      "events per tick: %lld begin, %lld persist, %lld end\n",
+      eventCounts[0] / options.ticks, eventCounts[1] / options.ticks,
+      eventCounts[2] / options.ticks
+    );
+  }
+
+  if (options.benchOut) {
+    writeBenchResult(
+      options.benchOut, engine, options, simulation.circleCount(),
+      nanosecondsPerTick, memoryBytes, total
+    );
+  }
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that split a loop into chunks
+// Until start() is called every loop runs on the calling thread
+struct JobPool {
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable wakeWorkers;
+  std::condition_variable workersDone;
+
+  // The loop being run, read by workers after they wake up
+  std::function<void(size_t, size_t)> job;
+  size_t jobCount = 0;
+  size_t jobGrain = 1;
+  std::atomic<size_t> nextChunk{0};
+
+  int busyWorkers = 0;
+  unsigned long long generation = 0;
+  bool stopping = false;
+
+  JobPool() {}
+
+  ~JobPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wakeWorkers.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+      workers[i].join();
+    }
+  }
+
+  // Start threadCount - 1 workers; the calling thread is the last one
+  // If threadCount is 0, use one thread per core
+  void start(int threadCount) {
+    if (threadCount <= 0) {
+      threadCount = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    for (int i = 1; i < threadCount; i++) {
+      workers.push_back(std::thread([this]() { work(); }));
+    }
+  }
+
+  size_t threadCount() const { return workers.size() + 1; }
+
+  // Run loop(begin, end) over [0, count) in chunks of grain
+  // Returns once every chunk is done
+  void parallelFor(
+    const size_t count, const size_t grain,
+    const std::function<void(size_t, size_t)>& loop
+  ) {
+    if (count == 0) return;
+    if (workers.empty() || count <= grain) {
+      loop(0, count);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = loop;
+      jobCount = count;
+      jobGrain = grain;
+      nextChunk = 0;
+      busyWorkers = static_cast<int>(workers.size());
+      generation += 1;
+    }
+    wakeWorkers.notify_all();
+
+    runChunks();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    workersDone.wait(lock, [this]() { return busyWorkers == 0; });
+    job = nullptr;
+  }
+
+  // Take chunks of the current loop until there are none left
+  void runChunks() {
+    while (true) {
+      size_t begin = nextChunk.fetch_add(jobGrain);
+      if (begin >= jobCount) return;
+      size_t end = (begin + jobGrain < jobCount) ? begin + jobGrain : jobCount;
+      job(begin, end);
+    }
+  }
+
+  void work() {
+    unsigned long long seenGeneration = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeWorkers.wait(lock, [this, seenGeneration]() {
+          return stopping || generation != seenGeneration;
+        });
+        if (stopping) return;
+        seenGeneration = generation;
+      }
+
+      runChunks();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      busyWorkers -= 1;
+      if (busyWorkers == 0) workersDone.notify_one();
+    }
+  }
+};
+
+#endif
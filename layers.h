@@ -0,0 +1,75 @@
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <stdint.h>
+
+#include "despawn.h"
+
+// Collision layers shared by main.cpp, unigrid.cpp and quadtree.cpp
+// A circle is in the layers set in its category and collides with the layers
+// set in its mask, and a pair only collides if each is in the other's mask.
+// The check comes before the distance test. Grid cells and quads also keep a
+// LayerSummary of what was filed in them, so a circle skips a whole cell or
+// quad that holds nothing it collides with
+const uint32_t DEFAULT_CATEGORY(1);
+const uint32_t ALL_LAYERS(UINT32_MAX);
+// Category and mask are 32 bits
+const int MAX_LAYERS(32);
+
+static bool shouldCollide(
+  const uint32_t categoryA, const uint32_t maskA, const uint32_t categoryB,
+  const uint32_t maskB
+) {
+  return (categoryA & maskB) != 0 && (categoryB & maskA) != 0;
+}
+
+// CircleT needs category and mask
+template <typename CircleT>
+static bool shouldCollide(const CircleT& a, const CircleT& b) {
+  return shouldCollide(a.category, a.mask, b.category, b.mask);
+}
+
+// Every category and every mask filed in a cell or quad, ORed together
+struct LayerSummary {
+  uint32_t categories = 0;
+  uint32_t masks = 0;
+
+  void clear() {
+    categories = 0;
+    masks = 0;
+  }
+
+  void add(const uint32_t category, const uint32_t mask) {
+    categories |= category;
+    masks |= mask;
+  }
+
+  void add(const LayerSummary& other) { add(other.categories, other.masks); }
+
+  // False if nothing summarized collides with a circle of category and mask
+  bool mayCollide(const uint32_t category, const uint32_t mask) const {
+    return shouldCollide(category, mask, categories, masks);
+  }
+
+  // False if nothing summarized collides with anything else summarized
+  bool mayCollideWithin() const { return (categories & masks) != 0; }
+};
+
+// Put every circle without a handle yet into one of layerCount layers, in
+// turn, where each layer only collides with itself
+// Call before the new circles get handles
+// CircleT needs handle, category and mask
+template <typename GetCircle>
+static void assignCircleLayers(
+  const size_t count, GetCircle getCircle, const int layerCount
+) {
+  if (layerCount <= 1) return;
+  for (size_t i = 0; i < count; i++) {
+    auto& circle = getCircle(i);
+    if (circle.handle.slot != INVALID_CIRCLE) continue;
+    circle.category = 1u << (i % layerCount);
+    circle.mask = circle.category;
+  }
+}
+
+#endif
@@ -5,6 +5,26 @@
 
 #include <vector>
 
+#include "ccd.h"
+#include "despawn.h"
+#include "events.h"
+#include "headless.h"
+#include "jobs.h"
+#include "layers.h"
+#include "obstacles.h"
+#include "picking.h"
+#include "query.h"
+#include "recording.h"
+#include "replay.h"
+#include "rng.h"
+#include "shape.h"
+#include "sleep.h"
+#include "snapshot.h"
+#include "solver.h"
+#include "spawn.h"
+#include "stats.h"
+#include "substep.h"
+
 const int WINDOW_WIDTH(1280);
 const int WINDOW_HEIGHT(720);
 const char* WINDOW_NAME("Spatial Data Structures");
@@ -13,6 +33,9 @@ const int TARGET_FPS(60);
 const float TIMESTEP(1.0f / TARGET_FPS);
 
 const KeyboardKey SPAWN_KEY(KEY_SPACE);
+const KeyboardKey STATS_KEY(KEY_W);
+const KeyboardKey SAVE_KEY(KEY_F5);
+const KeyboardKey LOAD_KEY(KEY_F9);
 
 enum CircleSize { small = 0, big = 1 };
 
@@ -32,17 +55,25 @@ const float FRICTION(-0.75f);
 const float VELOCITY_THRESHOLD(5.0f);
 const float ELASTICITY(0.5f);
 
+// Counters for the current tick
+static CollisionStats collisionStats;
+// Touching and woken circles for the current tick
+static SleepSystem sleepSystem;
+// Contacts found this tick and impulses cached from the last one
+static ContactSolver contactSolver;
+// Fast circles that touched between the start and the end of the tick
+static SweptHits sweptHits;
+
 // https://cplusplus.com/forum/beginner/81180/
 // Returns a random float within min and max
-static float randf(const float min, const float max) {
-  float result =
-    (rand() / static_cast<float>(RAND_MAX) * (max - min + 1)) + min;
+static float randf(Rng& rng, const float min, const float max) {
+  float result = (rng.nextFloat() * (max - min + 1)) + min;
   return result;
 }
 
 // Returns 1 or -1
-static int directionMultiplier() {
-  int randomNumber = rand() % 100;  // 0 to 99
+static int directionMultiplier(Rng& rng) {
+  int randomNumber = rng.nextInt(100);  // 0 to 99
   if (randomNumber < 50) {
     return -1.0f;
   }
@@ -50,41 +81,65 @@ static int directionMultiplier() {
 }
 
 struct Circle {
-  int radius;
-  int mass;
-  Color color;
-
-  Vector2 acceleration;
-  Vector2 velocity;
-  Vector2 position;
+  int radius = 0;
+  int mass = 0;
+  Color color = {0, 0, 0, 0};
+
+  Vector2 acceleration = {0.0f, 0.0f};
+  Vector2 velocity = {0.0f, 0.0f};
+  Vector2 position = {0.0f, 0.0f};
+  Vector2 oldPosition = {0.0f, 0.0f};
+
+  // Index in the simulation's circle storage
+  uint32_t index = 0;
+  bool sleeping = false;
+  // Ticks in a row this circle has not moved
+  int restingTicks = 0;
+  // Moved further than its radius this tick, see ccd.h
+  bool fast = false;
+  // Finds this circle again after it moves to another index, see despawn.h
+  CircleHandle handle;
+  // Ticks until it despawns, 0 for never
+  int ticksToLive = 0;
+  // Layers this circle is in and layers it collides with, see layers.h
+  uint32_t category = DEFAULT_CATEGORY;
+  uint32_t mask = ALL_LAYERS;
+  // Boxes and capsules are circles with another shape, whose radius bounds
+  // the whole shape, see shape.h
+  ShapeType shape = ShapeType::circle;
+  Vector2 halfExtents = {0.0f, 0.0f};  // Box only
+  Vector2 halfAxis = {0.0f, 0.0f};  // Capsule only, from its middle to one end
+  float capsuleRadius = 0.0f;  // Capsule only
 
   Circle() {}
 
   // If big, spawn at bottom middle of screen
   // Else, spawn at middle
-  void spawn(const CircleSize size = small) {
+  void spawn(Rng& rng, const CircleSize size = small) {
     color = {
-      static_cast<unsigned char>(rand() % 256),
-      static_cast<unsigned char>(rand() % 256),
-      static_cast<unsigned char>(rand() % 256), 255};
-    velocity.x =
-      randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) * directionMultiplier();
+      static_cast<unsigned char>(rng.nextInt(256)),
+      static_cast<unsigned char>(rng.nextInt(256)),
+      static_cast<unsigned char>(rng.nextInt(256)), 255};
+    velocity.x = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) *
+                 directionMultiplier(rng);
     if (size == CircleSize::small) {
-      radius = rand() % (SMALL_CIRCLE_RADIUS_MAX - SMALL_CIRCLE_RADIUS_MIN) +
+      radius = rng.nextInt(SMALL_CIRCLE_RADIUS_MAX - SMALL_CIRCLE_RADIUS_MIN) +
                SMALL_CIRCLE_RADIUS_MIN;
       mass = SMALL_CIRCLE_MASS;
       position = {WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2};
-      velocity.y =
-        randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) * directionMultiplier();
+      velocity.y = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) *
+                   directionMultiplier(rng);
     } else {
       radius = BIG_CIRCLE_RADIUS;
       mass = BIG_CIRCLE_MASS;
       position = {WINDOW_WIDTH / 2, WINDOW_HEIGHT - (float)radius};
-      velocity.y = randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX);
+      velocity.y = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX);
     }
   }
 
-  void draw() { DrawCircle(position.x, position.y, radius, color); }
+  void draw() { drawShape(*this, color); }
+
+  void setPosition(const Vector2 newPosition) { position = newPosition; }
 
   void update(
     const Vector2 force = {0.0f, 0.0f}, const float timestep = TIMESTEP
@@ -92,19 +147,33 @@ struct Circle {
     // acceleration = Vector2Add(
     //   Vector2Scale(force, 1 / mass), (Vector2Scale(velocity, FRICTION))
     // ); // With friction
-    acceleration = Vector2Scale(force, 1 / mass);  // No friction
-    velocity = Vector2Add(velocity, Vector2Scale(acceleration, TIMESTEP));
+    acceleration = Vector2Scale(force, 1.0f / mass);  // No friction
+    velocity = Vector2Add(velocity, Vector2Scale(acceleration, timestep));
     velocity.x = (abs(velocity.x) < VELOCITY_THRESHOLD) ? 0.0f : velocity.x;
     velocity.y = (abs(velocity.y) < VELOCITY_THRESHOLD) ? 0.0f : velocity.y;
-    position = Vector2Add(position, Vector2Scale(velocity, TIMESTEP));
+    restingTicks =
+      (velocity.x == 0.0f && velocity.y == 0.0f) ? restingTicks + 1 : 0;
+    fast = Vector2Length(velocity) * timestep > radius;
+    oldPosition = position;
+    position = Vector2Add(position, Vector2Scale(velocity, timestep));
   }
 
-  void handleCircleCollision(const std::vector<Circle> circles) {
+  void handleCircleCollision(const std::vector<Circle>& circles) {
     for (int i = 0; i < circles.size(); i++) {
 			Circle* a = this;
-      Circle b = circles[i];
+      const Circle& b = circles[i];
+
+			// Awake pairs come up from both sides, so only the lower index handles
+			// them. Sleeping circles never look for pairs themselves
+			if (b.index <= a->index && !b.sleeping) continue;
+      if (!shouldCollide(*a, b)) continue;
 
-			if (a == &b) continue;
+      collisionStats.candidatePairs += 1;
+
+      if (!isCirclePair(*a, b)) {
+        handleShapeCollision(*a, b);
+        continue;
+      }
 
       float sumOfRadii(pow(a->radius + b.radius, 2));
       float distanceBetweenCenters(Vector2DistanceSqr(a->position, b.position)
@@ -112,85 +181,619 @@ struct Circle {
 
       // Collision detected
       if (sumOfRadii >= distanceBetweenCenters) {
-        Vector2 collisionNormalAB(
-          {b.position.x - a->position.x, b.position.y - a->position.y}
-        );
-        Vector2 relativeVelocityAB(Vector2Subtract(a->velocity, b.velocity));
-        Vector2 collisionNormalABNormalized(Vector2Normalize(collisionNormalAB)
-        );
-        Vector2 relativeVelocityABNormalized(Vector2Normalize(relativeVelocityAB
-        ));
-
-        // I think we should also separate balls that are touching
-        if (Vector2Length(relativeVelocityAB) <= 0.1f) {
-          a->position = Vector2Subtract(
-            a->position, Vector2Scale(collisionNormalABNormalized, 0.5f)
-          );
-          b.position = Vector2Add(
-            b.position, Vector2Scale(collisionNormalABNormalized, 0.5f)
-          );
-        }
-
-        // Collision response
-        // Check dot product between collision normal and relative velocity
-        if (Vector2DotProduct(relativeVelocityABNormalized, collisionNormalABNormalized) > 0) {
-          float impulse =
-            Circle::getImpulse(*a, b, relativeVelocityAB, collisionNormalAB);
-          a->velocity = Vector2Add(
-            a->velocity,
-            Vector2Scale(
-              Vector2Scale(collisionNormalAB, 1.0f / a->mass), impulse
-            )
-          );
-          b.velocity = Vector2Subtract(
-            b.velocity,
-            Vector2Scale(
-              Vector2Scale(collisionNormalAB, 1.0f / b.mass), impulse
-            )
-          );
-        }
+        collisionStats.addOverlap(a->index, b.index);
+        sleepSystem.addTouchingPair(a->index, b.index);
+        // Response happens once every contact of the tick is known
+        contactSolver.addContact(*a, b, ELASTICITY, VELOCITY_THRESHOLD);
+      } else if (a->fast || b.fast) {
+        sweptHits.test(*a, b);
       }
     }
   }
 
+  // Collide a pair with a box or capsule through the table in shape.h
+  // These pairs are never swept, see ccd.h
+  static void handleShapeCollision(const Circle& a, const Circle& b) {
+    ShapeContact shapeContact;
+    if (!collideShapes(a, b, &shapeContact)) return;
+    collisionStats.addOverlap(a.index, b.index);
+    sleepSystem.addTouchingPair(a.index, b.index);
+    contactSolver.addContact(
+      a, b, shapeContact, ELASTICITY, VELOCITY_THRESHOLD
+    );
+  }
+
+  // Mirror the circle back in if it went past a screen edge, so it ends up
+  // where it would be had it bounced off the edge itself
   void handleEdgeCollision(
     const int screenWidth = WINDOW_WIDTH, const int screenHeight = WINDOW_HEIGHT
   ) {
-    // Check if the circle should bounce off of the screen edge
-    bool circleIsOutOfBoundsX =
-      position.x >= (screenWidth - radius) || position.x <= radius;
-    bool circleIsOutOfBoundsY =
-      position.y >= (screenHeight - radius) || position.y <= radius;
-    if (circleIsOutOfBoundsX) {
-      velocity.x *= -1.0f;
+    position = reflectOffEdges(
+      position, &velocity, getShapeHalfSize(*this), screenWidth, screenHeight
+    );
+  }
+};
+
+// What --circles spawns unless told otherwise
+static SpawnParams getDefaultSpawnParams() {
+  SpawnParams params;
+  params.radiusMin = SMALL_CIRCLE_RADIUS_MIN;
+  params.radiusMax = SMALL_CIRCLE_RADIUS_MAX;
+  params.mass = SMALL_CIRCLE_MASS;
+  params.bigRadius = BIG_CIRCLE_RADIUS;
+  params.bigMass = BIG_CIRCLE_MASS;
+  params.smallCirclesPerBigCircle =
+    SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY *
+    NUMBER_OF_PRESSES_UNTIL_BIG_CIRCLE_SPAWNS;
+  params.velocityMin = CIRCLE_VELOCITY_MIN;
+  params.velocityMax = CIRCLE_VELOCITY_MAX;
+  params.screenWidth = WINDOW_WIDTH;
+  params.screenHeight = WINDOW_HEIGHT;
+  return params;
+}
+
+struct Simulation {
+  std::vector<Circle> smallCircles;
+  std::vector<Circle> bigCircles;
+
+  // Used for everything spawned into this simulation
+  Rng rng;
+  JobPool jobPool;
+
+  // Ticks run so far
+  uint32_t tick = 0;
+  // Seconds simulated per tick
+  float timestep = TIMESTEP;
+  // Split ticks into substeps when circles move fast or overlap deeply
+  bool adaptiveSubsteps = false;
+  int maxSubsteps = DEFAULT_MAX_SUBSTEPS;
+  Recorder recorder;
+  InputLog inputLog;
+
+  // Finds circles by handle after despawns move them to other indices
+  CircleHandles circleHandles;
+  // Pairs that began, kept or stopped touching last tick, see events.h
+  CollisionEvents collisionEvents;
+  // Ticks every circle spawned from now on lives, 0 for forever
+  int lifetime = 0;
+  std::vector<uint32_t> despawnScratch;
+  // Layers new circles are split between, see layers.h
+  int layerCount = 1;
+  // Walls that never move, baked once at startup, see obstacles.h
+  StaticObstacles obstacles;
+
+  // Counts the number of times the user has spawned 10 small circles
+  int numberOfSpawnKeyPresses = 0;
+
+  size_t circleCount() const { return smallCircles.size() + bigCircles.size(); }
+
+  // Bytes held by the circles and the obstacles
+  size_t memoryUsage() const {
+    return sizeof(Simulation) +
+           (smallCircles.capacity() + bigCircles.capacity()) * sizeof(Circle) +
+           circleHandles.memoryUsage() + collisionEvents.memoryUsage() +
+           obstacles.memoryUsage();
+  }
+
+  void handleSpawnKeyPress() {
+    numberOfSpawnKeyPresses += 1;
+    // New small circles shift the indices of the big ones, so the contact
+    // cache goes through handle slots
+    remapContactsToSlots(contactSolver, [&](uint32_t index) -> Circle& {
+      return getCircle(index);
+    });
+    recorder.circlesMoved = true;
+    // If user reaches 10 presses, spawn a big boy
+    if (numberOfSpawnKeyPresses % 10 == 0) {
+      bigCircles.push_back(Circle());
+      bigCircles[bigCircles.size() - 1].spawn(rng, CircleSize::big);
+      numberOfSpawnKeyPresses = 0;
     }
-    if (circleIsOutOfBoundsY) {
-      velocity.y *= -1.0f;
+
+    // Spawn small circles
+    int numberOfSmallCirclesAfterSpawning =
+      smallCircles.size() + SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY;
+    for (size_t i = smallCircles.size();
+         i < numberOfSmallCirclesAfterSpawning; i++) {
+      smallCircles.push_back(Circle());
+      smallCircles[i].spawn(rng);
     }
+    assignHandles();
+    remapContactsToIndices(contactSolver, circleHandles);
+  }
+
+  // Add body as a wall or paddle, see shape.h: as heavy as IMMOVABLE_MASS,
+  // in every layer and never despawning, so whatever hits it bounces off and
+  // it keeps moving at velocity
+  // Walls live in bigCircles, so their indices move as circles spawn and
+  // despawn like any other big circle's
+  // Returns its handle, which is what stays put
+  CircleHandle addWall(Circle body, const Vector2 velocity) {
+    body.mass = IMMOVABLE_MASS;
+    body.color = DARKGRAY;
+    body.velocity = velocity;
+    body.oldPosition = body.position;
+    bigCircles.push_back(body);
+    assignHandles();
+    Circle& wall = bigCircles.back();
+    wall.category = ALL_LAYERS;
+    wall.mask = ALL_LAYERS;
+    wall.ticksToLive = 0;
+    return wall.handle;
   }
 
-  static float getImpulse(
-    Circle a, Circle b, Vector2 relativeVelocity, Vector2 collisionNormal
+  CircleHandle addBox(
+    const Vector2 center, const Vector2 halfExtents, const Vector2 velocity
   ) {
-    float impulse(-(
-      ((1.0f + ELASTICITY) *
-       (Vector2DotProduct(relativeVelocity, collisionNormal)) /
-       (Vector2DotProduct(collisionNormal, collisionNormal) *
-        ((1.0f / a.mass) + (1.0f / b.mass))))
-    ));
+    Circle box;
+    makeBox(box, center, halfExtents);
+    return addWall(box, velocity);
+  }
+
+  CircleHandle addCapsule(
+    const Vector2 center, const Vector2 halfAxis, const float radius,
+    const Vector2 velocity
+  ) {
+    Circle capsule;
+    makeCapsule(capsule, center, halfAxis, radius);
+    return addWall(capsule, velocity);
+  }
+
+  // Spawn count circles in bulk
+  // Anything params leaves at zero comes from this program's constants
+  void populate(const size_t count, const SpawnParams& requestedParams) {
+    SpawnParams params = requestedParams.withDefaults(getDefaultSpawnParams());
+    std::vector<Circle> spawned;
+    spawnCircles(spawned, count, params, rng, jobPool);
+    // New small circles shift the indices of the big ones, so the contact
+    // cache goes through handle slots
+    remapContactsToSlots(contactSolver, [&](uint32_t index) -> Circle& {
+      return getCircle(index);
+    });
+    recorder.circlesMoved = true;
+
+    // Sort them into smallCircles and bigCircles
+    size_t numberOfBigCircles = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (shouldSpawnBig(params.distribution, i, params.smallCirclesPerBigCircle)) {
+        numberOfBigCircles += 1;
+      }
+    }
+    smallCircles.reserve(smallCircles.size() + count - numberOfBigCircles);
+    bigCircles.reserve(bigCircles.size() + numberOfBigCircles);
+    for (size_t i = 0; i < count; i++) {
+      if (shouldSpawnBig(params.distribution, i, params.smallCirclesPerBigCircle)) {
+        bigCircles.push_back(spawned[i]);
+      } else {
+        smallCircles.push_back(spawned[i]);
+      }
+    }
+    assignHandles();
+    remapContactsToIndices(contactSolver, circleHandles);
+  }
 
-    return impulse;
+  // Write every circle to a snapshot file, small circles first
+  bool saveSnapshot(const char* path) const {
+    Snapshot snapshot;
+    const std::vector<CachedContact>& contacts = contactSolver.cachedContacts;
+    snapshot.allocate(
+      circleCount(), contacts.size(), numberOfSpawnKeyPresses, tick, rng
+    );
+    for (size_t i = 0; i < smallCircles.size(); i++) {
+      snapshot.storeCircle(i, smallCircles[i]);
+    }
+    for (size_t i = 0; i < bigCircles.size(); i++) {
+      snapshot.storeCircle(smallCircles.size() + i, bigCircles[i]);
+    }
+    for (size_t i = 0; i < contacts.size(); i++) {
+      snapshot.storeContact(i, contacts[i].a, contacts[i].b, contacts[i].impulse);
+    }
+    return snapshot.save(path);
+  }
+
+  // Replace every circle with the ones in a snapshot file
+  bool loadSnapshot(const char* path) {
+    Snapshot snapshot;
+    if (!snapshot.load(path)) return false;
+
+    smallCircles.clear();
+    bigCircles.clear();
+    for (size_t i = 0; i < snapshot.circleCount(); i++) {
+      Circle circle;
+      snapshot.loadCircle(i, circle);
+      if (circle.radius >= BIG_CIRCLE_RADIUS) {
+        bigCircles.push_back(circle);
+      } else {
+        smallCircles.push_back(circle);
+      }
+    }
+
+    numberOfSpawnKeyPresses = snapshot.header->numberOfSpawnKeyPresses;
+    tick = snapshot.header->tick;
+    rng = snapshot.getRng();
+    recorder.circlesMoved = true;
+    contactSolver.clearCache();
+    for (size_t i = 0; i < snapshot.contactCount(); i++) {
+      contactSolver.addCachedContact(
+        snapshot.contactA[i], snapshot.contactB[i], snapshot.contactImpulse[i]
+      );
+    }
+    contactSolver.indexCachedContacts();
+    circleHandles.removeAll();
+    // Layers come from the snapshot, so only handles are handed out
+    auto getCircleByIndex = [this](size_t index) -> Circle& {
+      return getCircle(index);
+    };
+    assignCircleHandles(circleHandles, circleCount(), getCircleByIndex, lifetime);
+    return true;
+  }
+
+  // Checksum of every circle, small circles first
+  uint64_t checksum() const {
+    uint64_t checksum = CHECKSUM_OFFSET_BASIS;
+    for (size_t i = 0; i < smallCircles.size(); i++) {
+      checksum = addCircleToChecksum(checksum, smallCircles[i]);
+    }
+    for (size_t i = 0; i < bigCircles.size(); i++) {
+      checksum = addCircleToChecksum(checksum, bigCircles[i]);
+    }
+    return checksum;
+  }
+
+  // Add the current tick to the recording
+  void record() {
+    recorder.beginFrame(tick, circleCount());
+    for (size_t i = 0; i < smallCircles.size(); i++) {
+      recorder.addCircle(smallCircles[i]);
+    }
+    for (size_t i = 0; i < bigCircles.size(); i++) {
+      recorder.addCircle(bigCircles[i]);
+    }
+    recorder.endFrame();
+  }
+
+  // Circle with the given index, counting small circles first
+  Circle& getCircle(const size_t index) {
+    if (index < smallCircles.size()) return smallCircles[index];
+    return bigCircles[index - smallCircles.size()];
+  }
+
+  // Wake a circle from outside the tick, like when the mouse grabs it
+  void wakeCircle(const size_t index) {
+    Circle& circle = getCircle(index);
+    circle.restingTicks = 0;
+    circle.sleeping = false;
+  }
+
+  // Give new circles handles, and point old ones at where they are now, since
+  // new small circles shift the indices of the big ones
+  void assignHandles() {
+    auto getCircleByIndex = [this](size_t index) -> Circle& {
+      return getCircle(index);
+    };
+    assignCircleLayers(circleCount(), getCircleByIndex, layerCount);
+    assignCircleHandles(circleHandles, circleCount(), getCircleByIndex, lifetime);
+  }
+
+  // Remove the circles at indices, given in any order, and empty indices
+  // Each one's slot takes the last circle of the same size, which still
+  // shifts the big circles when small ones are removed, so handles are
+  // reassigned afterwards
+  void despawnCircles(std::vector<uint32_t>& indices) {
+    if (indices.empty()) return;
+    // Indices change below, so the contact cache goes through handle slots
+    remapContactsToSlots(contactSolver, [&](uint32_t index) -> Circle& {
+      return getCircle(index);
+    });
+
+    sortForDespawn(indices);
+    for (size_t i = 0; i < indices.size(); i++) {
+      size_t index = indices[i];
+      circleHandles.remove(getCircle(index).handle);
+      bool isSmall = index < smallCircles.size();
+      std::vector<Circle>& storage = isSmall ? smallCircles : bigCircles;
+      size_t slot = isSmall ? index : index - smallCircles.size();
+      if (slot != storage.size() - 1) storage[slot] = storage.back();
+      storage.pop_back();
+    }
+    indices.clear();
+    assignHandles();
+    refreshQueryIndex();
+
+    remapContactsToIndices(contactSolver, circleHandles);
+    recorder.circlesMoved = true;
+  }
+
+  // Despawn the circle with handle
+  // Returns false if it was already gone
+  bool despawn(const CircleHandle handle) {
+    uint32_t index = circleHandles.find(handle);
+    if (index == INVALID_CIRCLE) return false;
+    despawnScratch.assign(1, index);
+    despawnCircles(despawnScratch);
+    return true;
+  }
+
+  // Despawn every circle overlapping a box
+  // Returns the number despawned
+  size_t despawnInAabb(const Vector2 topLeft, const Vector2 bottomRight) {
+    despawnScratch.resize(circleCount());
+    size_t found = queryAabb(
+      topLeft, bottomRight, despawnScratch.data(), despawnScratch.size()
+    );
+    despawnScratch.resize(found);
+    despawnCircles(despawnScratch);
+    return found;
+  }
+
+  // Brute force has no index to refresh, but circles spawned since the last
+  // tick still need theirs
+  void refreshQueryIndex() {
+    for (size_t i = 0; i < circleCount(); i++) {
+      getCircle(i).index = i;
+    }
+  }
+
+  // Write the indices of the circles overlapping a circle into indices
+  // Returns the number found, which can be more than capacity
+  size_t queryCircle(
+    const Vector2 center, const float radius, uint32_t* indices,
+    const size_t capacity
+  ) {
+    QueryBuffer buffer(indices, capacity);
+    QueryShape query = makeQueryCircle(center, radius);
+    for (size_t i = 0; i < circleCount(); i++) {
+      if (bodyOverlapsQuery(getCircle(i), query)) buffer.add(i);
+    }
+    return buffer.count;
+  }
+
+  // Write the indices of the circles overlapping a box into indices
+  // Returns the number found, which can be more than capacity
+  size_t queryAabb(
+    const Vector2 topLeft, const Vector2 bottomRight, uint32_t* indices,
+    const size_t capacity
+  ) {
+    QueryBuffer buffer(indices, capacity);
+    QueryShape query = makeQueryBox(topLeft, bottomRight);
+    for (size_t i = 0; i < circleCount(); i++) {
+      if (bodyOverlapsQuery(getCircle(i), query)) buffer.add(i);
+    }
+    return buffer.count;
+  }
+
+  // Write the k circles whose centers are nearest to point into indices and
+  // their squared distances into distancesSqr, nearest first
+  // Returns the number found, at most k
+  size_t queryNearest(
+    const Vector2 point, const size_t k, uint32_t* indices, float* distancesSqr
+  ) {
+    NearestHeap nearest(indices, distancesSqr, k);
+    for (size_t i = 0; i < circleCount(); i++) {
+      nearest.offer(i, Vector2DistanceSqr(point, getCircle(i).position));
+    }
+    nearest.sort();
+    return nearest.count;
+  }
+
+  // First circle hit by a ray from origin towards direction within
+  // maxDistance
+  // Returns false if the ray hits nothing
+  bool raycast(
+    const Vector2 origin, const Vector2 direction, const float maxDistance,
+    RaycastHit* hit
+  ) {
+    refreshQueryIndex();
+    Ray2 ray = {origin, Vector2Normalize(direction), maxDistance};
+    *hit = RaycastHit();
+    for (size_t i = 0; i < circleCount(); i++) {
+      testRaycastHit(ray, getCircle(i), hit);
+    }
+    return hit->hit;
+  }
+
+  // Run every query in batch, split across jobPool
+  // Every query scans every circle, so the order does not matter here
+  void runQueries(QueryBatch& batch) {
+    refreshQueryIndex();
+    batch.sort([](const Vector2, uint32_t* x, uint32_t* y) {
+      *x = 0;
+      *y = 0;
+    });
+    batch.run(
+      jobPool, [&](const uint32_t* ids, size_t count, std::vector<uint32_t>&) {
+        for (size_t i = 0; i < count; i++) {
+          const Query& query = batch.queries[ids[i]];
+          QueryResult& result = batch.results[ids[i]];
+          if (query.type == QueryType::nearest) {
+            NearestHeap nearest = batch.getHeap(ids[i]);
+            for (size_t j = 0; j < circleCount(); j++) {
+              nearest.offer(j, Vector2DistanceSqr(query.a, getCircle(j).position));
+            }
+            nearest.sort();
+            result.count = nearest.count;
+            continue;
+          }
+          if (query.type == QueryType::raycast) {
+            Ray2 ray = {query.a, query.b, query.radius};
+            for (size_t j = 0; j < circleCount(); j++) {
+              testRaycastHit(ray, getCircle(j), &result.hit);
+            }
+            continue;
+          }
+
+          QueryBuffer buffer = batch.getBuffer(ids[i]);
+          QueryShape shape = (query.type == QueryType::circle)
+                               ? makeQueryCircle(query.a, query.radius)
+                               : makeQueryBox(query.a, query.b);
+          for (size_t j = 0; j < circleCount(); j++) {
+            if (bodyOverlapsQuery(getCircle(j), shape)) buffer.add(j);
+          }
+          result.count = buffer.count;
+        }
+      }
+    );
+  }
+
+  // Wake circles that were hit and put resting islands to sleep
+  void updateSleep() {
+    auto getCircleByIndex = [this](size_t index) -> Circle& {
+      return getCircle(index);
+    };
+    collisionStats.wakes = sleepSystem.wakeHitCircles(getCircleByIndex);
+    if (tick % SLEEP_CHECK_INTERVAL == 0) {
+      sleepSystem.putRestingIslandsToSleep(circleCount(), getCircleByIndex);
+    }
+
+    for (size_t i = 0; i < circleCount(); i++) {
+      if (getCircle(i).sleeping) collisionStats.sleepingCircles += 1;
+    }
+  }
+
+  // Advance the physics by one timestep, split into substeps if
+  // adaptiveSubsteps is set
+  void step() {
+    collisionStats.reset();
+    sleepSystem.beginTick();
+
+    for (size_t i = 0; i < circleCount(); i++) {
+      getCircle(i).index = i;
+    }
+
+    auto getCircleByIndex = [this](size_t index) -> Circle& {
+      return getCircle(index);
+    };
+    int substeps = 1;
+    if (adaptiveSubsteps) {
+      substeps = chooseSubsteps(
+        circleCount(), getCircleByIndex, contactSolver, timestep, maxSubsteps
+      );
+    }
+    for (int i = 0; i < substeps; i++) {
+      substep(timestep / substeps);
+    }
+    collisionStats.substeps = substeps;
+    updateSleep();
+    collisionEvents.endTick(circleHandles, getCircleByIndex);
+    if (lifetime > 0) {
+      findExpiredCircles(circleCount(), getCircleByIndex, despawnScratch);
+      despawnCircles(despawnScratch);
+    }
+
+    if (recorder.shouldRecord(tick)) record();
+    if (inputLog.isRecording()) inputLog.recordChecksum(tick, checksum());
+    tick += 1;
+  }
+
+  // Move, collide and solve every awake circle once, over dt
+  // Sleeping circles are skipped, but awake ones still collide with them
+  void substep(const float dt) {
+    contactSolver.beginTick();
+    sweptHits.beginTick();
+
+    // Move every circle before testing any pair, so fast circles are swept
+    // along this substep's path and not the last one
+    for (size_t i = 0; i < circleCount(); i++) {
+      Circle* currentCircle = &getCircle(i);
+      if (currentCircle->sleeping) continue;
+      currentCircle->update({0.0f, 0.0f}, dt);
+      currentCircle->handleEdgeCollision();
+      obstacles.collide(*currentCircle, ELASTICITY);
+    }
+
+    for (size_t i = 0; i < circleCount(); i++) {
+      Circle* currentCircle = &getCircle(i);
+      if (currentCircle->sleeping) continue;
+      currentCircle->handleCircleCollision(smallCircles);
+      currentCircle->handleCircleCollision(bigCircles);
+    }
+
+    auto getCircleByIndex = [this](size_t index) -> Circle& {
+      return getCircle(index);
+    };
+    collisionStats.sweptHits += sweptHits.resolve(
+      circleCount(), getCircleByIndex, contactSolver, ELASTICITY,
+      VELOCITY_THRESHOLD
+    );
+    collisionStats.penetration += contactSolver.totalPenetration();
+    // Before solving, while contacts are still in the order they were found
+    collisionEvents.addContacts(contactSolver.contacts, getCircleByIndex);
+    collisionStats.impulses += contactSolver.solve(getCircleByIndex);
+    // The next substep replaces these contacts, so wake whoever they pushed now
+    sleepSystem.wakePushedCircles(contactSolver.contacts, getCircleByIndex);
   }
 };
 
-int main() {
-  srand(GetTime());
+int main(int argc, char** argv) {
+  Options options = parseOptions(argc, argv);
 
-  // Counts the number of times the user has spawned 10 small circles
-  int numberOfSpawnKeyPresses = 0;
+  if (options.playPath) {
+    return runPlayback(
+      options.playPath, WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_NAME,
+      options.tickRate > 0 ? options.tickRate : TARGET_FPS
+    );
+  }
 
-  std::vector<Circle> smallCircles;
-  std::vector<Circle> bigCircles;
+  // A replay has to start from the seed it was recorded with
+  InputLog replayLog;
+  if (options.replayInputPath) {
+    if (!replayLog.load(options.replayInputPath)) return 1;
+    options.seed = replayLog.seed;
+  }
+
+  Simulation simulation;
+  simulation.rng = Rng(options.seed);
+  simulation.jobPool.start(options.threads);
+  if (options.tickRate > 0) simulation.timestep = 1.0f / options.tickRate;
+  simulation.adaptiveSubsteps = options.adaptiveSubsteps;
+  simulation.maxSubsteps = options.maxSubsteps;
+  simulation.lifetime = options.lifetime;
+  simulation.layerCount = options.layers;
+  if (options.events) simulation.collisionEvents.subscribeAll();
+  contactSolver.iterations = options.solverIterations;
+  contactSolver.warmStarting = options.warmStarting;
+  contactSolver.positionIterations = options.positionIterations;
+  contactSolver.jobPool = &simulation.jobPool;
+  for (int i = 0; i < options.presses; i++) {
+    simulation.handleSpawnKeyPress();
+  }
+  simulation.populate(options.circles, options.spawn);
+  if (options.walls) addWalls(simulation, WINDOW_WIDTH, WINDOW_HEIGHT);
+  if (options.obstaclesPath &&
+      !simulation.obstacles.load(options.obstaclesPath)) {
+    return 1;
+  }
+  if (options.mazeSpacing > 0) {
+    addMaze(
+      simulation.obstacles, WINDOW_WIDTH, WINDOW_HEIGHT, options.mazeSpacing,
+      simulation.rng
+    );
+  }
+  simulation.obstacles.bake(WINDOW_WIDTH, WINDOW_HEIGHT);
+  if (options.loadPath && !simulation.loadSnapshot(options.loadPath)) {
+    return 1;
+  }
+  if (options.recordPath &&
+      !simulation.recorder.open(options.recordPath, options.recordEvery)) {
+    return 1;
+  }
+
+  if (options.replayInputPath) {
+    return runReplay(simulation, replayLog);
+  }
+  if (options.recordInputPath &&
+      !simulation.inputLog.openForRecording(
+        options.recordInputPath, options.seed, simulation.checksum()
+      )) {
+    return 1;
+  }
+
+  if (options.headless) {
+    // Brute force has no cells or nodes to report
+    runHeadless(simulation, collisionStats, options, "brute-force", nullptr);
+    if (options.savePath) simulation.saveSnapshot(options.savePath);
+    return 0;
+  }
 
   char smallCircleCountBuffer[50];
   int numberOfSmallCirclesPresentFormatted;
@@ -200,72 +803,87 @@ int main() {
   float accumulator(0.0f);
   float deltaTime(0.0f);
 
+  bool showStats(false);
+  Drag drag;
+
   InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_NAME);
   SetTargetFPS(TARGET_FPS);
   while (!WindowShouldClose()) {
     deltaTime = GetFrameTime();
 
+    if (IsKeyPressed(STATS_KEY)) {
+      showStats = !showStats;
+    }
+
+    if (IsKeyPressed(SAVE_KEY)) {
+      simulation.saveSnapshot(
+        options.savePath ? options.savePath : DEFAULT_SNAPSHOT_PATH
+      );
+    }
+    if (IsKeyPressed(LOAD_KEY)) {
+      simulation.loadSnapshot(
+        options.loadPath ? options.loadPath : DEFAULT_SNAPSHOT_PATH
+      );
+    }
+
     if (IsKeyPressed(SPAWN_KEY)) {
-      numberOfSpawnKeyPresses += 1;
-      // If user reaches 10 presses, spawn a big boy
-      if (numberOfSpawnKeyPresses % 10 == 0) {
-        bigCircles.push_back(Circle());
-        bigCircles[bigCircles.size() - 1].spawn(CircleSize::big);
-        numberOfSpawnKeyPresses = 0;
-      }
+      simulation.inputLog.recordEvent(simulation.tick, InputAction::spawn);
+      simulation.handleSpawnKeyPress();
+    }
 
-      // Spawn small circles
-      int numberOfSmallCirclesAfterSpawning =
-        smallCircles.size() + SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY;
-      for (size_t i = smallCircles.size();
-           i < numberOfSmallCirclesAfterSpawning; i++) {
-        smallCircles.push_back(Circle());
-        smallCircles[i].spawn();
-      }
+    drag.handleMouse(simulation, deltaTime);
+    if (IsMouseButtonDown(DESPAWN_BUTTON)) {
+      simulation.inputLog.recordDespawn(simulation.tick, drag.mouse);
+      simulation.despawnInAabb(
+        Vector2SubtractValue(drag.mouse, DESPAWN_HALF_WIDTH),
+        Vector2AddValue(drag.mouse, DESPAWN_HALF_WIDTH)
+      );
     }
 
     // Physics update
     accumulator += deltaTime;
-    while (accumulator >= TIMESTEP) {
-      for (size_t i = 0; i < smallCircles.size(); i++) {
-        Circle* currentCircle = &smallCircles[i];
-        currentCircle->update();
-        currentCircle->handleCircleCollision(smallCircles);
-        currentCircle->handleCircleCollision(bigCircles);
-        currentCircle->handleEdgeCollision();
-      }
-      for (size_t i = 0; i < bigCircles.size(); i++) {
-        Circle* currentCircle = &bigCircles[i];
-        currentCircle->update();
-        currentCircle->handleCircleCollision(smallCircles);
-        currentCircle->handleCircleCollision(bigCircles);
-        currentCircle->handleEdgeCollision();
-      }
-      accumulator -= TIMESTEP;
+    while (accumulator >= simulation.timestep) {
+      drag.steer(simulation);
+      simulation.step();
+      accumulator -= simulation.timestep;
     }
 
     // Draw
     BeginDrawing();
     ClearBackground(WHITE);
 
-    for (size_t i = 0; i < smallCircles.size(); i++) {
-      smallCircles[i].draw();
+    simulation.obstacles.draw(GRAY);
+    for (size_t i = 0; i < simulation.smallCircles.size(); i++) {
+      simulation.smallCircles[i].draw();
     }
-    for (size_t i = 0; i < bigCircles.size(); i++) {
-      bigCircles[i].draw();
+    for (size_t i = 0; i < simulation.bigCircles.size(); i++) {
+      simulation.bigCircles[i].draw();
     }
+    drag.draw(simulation);
 
     // Small Circle Counter
-    numberOfSmallCirclesPresentFormatted =
-      sprintf(smallCircleCountBuffer, "%d Small Circles", smallCircles.size());
+    numberOfSmallCirclesPresentFormatted = sprintf(
+      smallCircleCountBuffer, "%d Small Circles",
+      simulation.smallCircles.size()
+    );
     DrawText(smallCircleCountBuffer, 10, 10, 20, BLACK);
     // Big Circle Counter
-    numberOfBigCirclesPresentFormatted =
-      sprintf(bigCircleCountBuffer, "%d Big Circles", bigCircles.size());
+    numberOfBigCirclesPresentFormatted = sprintf(
+      bigCircleCountBuffer, "%d Big Circles", simulation.bigCircles.size()
+    );
     DrawText(bigCircleCountBuffer, 10, 30, 20, BLACK);
 
+    DrawText("Press W to toggle collision stats.", 10, 50, 20, BLACK);
+    DrawText("Press F5 to save and F9 to load a snapshot.", 10, 70, 20, BLACK);
+    DrawText("Drag a circle to throw it, hold right click to despawn.", 10, 90, 20, BLACK);
+    if (showStats) {
+      collisionStats.draw(10, 110, nullptr);
+    }
+
     EndDrawing();
   }
 
+  if (options.savePath) simulation.saveSnapshot(options.savePath);
+
   return 0;
-}
\ No newline at end of file
+}
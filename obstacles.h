@@ -0,0 +1,285 @@
+#ifndef OBSTACLES_H
+#define OBSTACLES_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "query.h"
+#include "rng.h"
+#include "shape.h"
+
+// Static obstacles shared by main.cpp, unigrid.cpp and quadtree.cpp
+// Boxes, segments and circles that never move, like the walls of a maze.
+// They are loaded at startup and baked once into their own grid, which keeps
+// each cell's obstacles in one flat array and is never rebuilt, so the
+// dynamic grid or quadtree never holds them and their count does not change
+// what a dynamic update costs. Like the screen edges, obstacles are handled
+// per body right after it moves: the body is pushed out of every obstacle it
+// overlaps and loses the part of its velocity going into it
+// Segments are capsules, with a thickness of twice their radius
+// Obstacles added after bake() are ignored until the next bake()
+const float DEFAULT_OBSTACLE_CELL_SIZE(64.0f);
+const float DEFAULT_MAZE_WALL_THICKNESS(2.0f);
+
+struct Obstacle {
+  // box, capsule for segments, or circle
+  ShapeType shape;
+  Vector2 position;
+  float radius;  // Circle only
+  Vector2 halfExtents;  // Box only
+  Vector2 halfAxis;  // Segment only, from its middle to one end
+  float capsuleRadius;  // Segment only, half its thickness
+  // AABB, for the grid
+  Vector2 topLeft;
+  Vector2 bottomRight;
+};
+
+static Obstacle makeObstacle(
+  const ShapeType shape, const Vector2 position, const Vector2 halfSize
+) {
+  Obstacle obstacle = {};
+  obstacle.shape = shape;
+  obstacle.position = position;
+  obstacle.topLeft = Vector2Subtract(position, halfSize);
+  obstacle.bottomRight = Vector2Add(position, halfSize);
+  return obstacle;
+}
+
+static Obstacle makeBoxObstacle(const Vector2 center, const Vector2 halfExtents) {
+  Obstacle obstacle = makeObstacle(ShapeType::box, center, halfExtents);
+  obstacle.halfExtents = halfExtents;
+  return obstacle;
+}
+
+static Obstacle makeSegmentObstacle(
+  const Vector2 start, const Vector2 end, const float thickness
+) {
+  Vector2 halfAxis = Vector2Scale(Vector2Subtract(end, start), 0.5f);
+  float radius = thickness * 0.5f;
+  Obstacle obstacle = makeObstacle(
+    ShapeType::capsule, Vector2Add(start, halfAxis),
+    {fabsf(halfAxis.x) + radius, fabsf(halfAxis.y) + radius}
+  );
+  obstacle.halfAxis = halfAxis;
+  obstacle.capsuleRadius = radius;
+  return obstacle;
+}
+
+static Obstacle makeCircleObstacle(const Vector2 center, const float radius) {
+  Obstacle obstacle = makeObstacle(ShapeType::circle, center, {radius, radius});
+  obstacle.radius = radius;
+  return obstacle;
+}
+
+struct StaticObstacles {
+  std::vector<Obstacle> obstacles;
+
+  // Baked grid over a width by height screen, with obstacles poking off it
+  // filed in the edge cells
+  float cellSize = DEFAULT_OBSTACLE_CELL_SIZE;
+  int columns = 0;
+  int rows = 0;
+  // Cell (x, y) holds cellObstacles[cellStarts[c], cellStarts[c + 1]), with
+  // c = y * columns + x
+  std::vector<uint32_t> cellStarts;
+  std::vector<uint32_t> cellObstacles;
+
+  bool empty() const { return cellObstacles.empty(); }
+
+  void add(const Obstacle& obstacle) { obstacles.push_back(obstacle); }
+
+  void getCellRange(
+    const Vector2 topLeft, const Vector2 bottomRight, int range[4]
+  ) const {
+    range[0] = Clamp(floorf(topLeft.x / cellSize), 0.0f, columns - 1.0f);
+    range[1] = Clamp(floorf(topLeft.y / cellSize), 0.0f, rows - 1.0f);
+    range[2] = Clamp(floorf(bottomRight.x / cellSize), 0.0f, columns - 1.0f);
+    range[3] = Clamp(floorf(bottomRight.y / cellSize), 0.0f, rows - 1.0f);
+  }
+
+  // File every obstacle in the cells its AABB covers, counting first so each
+  // cell's list is written straight into place
+  void bake(const int width, const int height) {
+    columns = static_cast<int>(ceilf(width / cellSize));
+    rows = static_cast<int>(ceilf(height / cellSize));
+    cellStarts.assign(columns * rows + 1, 0);
+    int range[4];
+    for (size_t i = 0; i < obstacles.size(); i++) {
+      getCellRange(obstacles[i].topLeft, obstacles[i].bottomRight, range);
+      for (int y = range[1]; y <= range[3]; y++) {
+        for (int x = range[0]; x <= range[2]; x++) {
+          cellStarts[y * columns + x + 1] += 1;
+        }
+      }
+    }
+    for (size_t c = 1; c < cellStarts.size(); c++) {
+      cellStarts[c] += cellStarts[c - 1];
+    }
+
+    cellObstacles.resize(cellStarts.back());
+    std::vector<uint32_t> nextSlot(cellStarts.begin(), cellStarts.end() - 1);
+    for (size_t i = 0; i < obstacles.size(); i++) {
+      getCellRange(obstacles[i].topLeft, obstacles[i].bottomRight, range);
+      for (int y = range[1]; y <= range[3]; y++) {
+        for (int x = range[0]; x <= range[2]; x++) {
+          cellObstacles[nextSlot[y * columns + x]++] = static_cast<uint32_t>(i);
+        }
+      }
+    }
+  }
+
+  // Run visit(obstacle) for every obstacle whose AABB overlaps the box
+  // An obstacle filed in several cells is only visited from the cell holding
+  // the top-left corner of where its AABB and the box overlap
+  template <typename Visit>
+  void forEachObstacleInAabb(
+    const Vector2 topLeft, const Vector2 bottomRight, Visit visit
+  ) const {
+    if (empty()) return;
+    int range[4];
+    getCellRange(topLeft, bottomRight, range);
+    for (int y = range[1]; y <= range[3]; y++) {
+      for (int x = range[0]; x <= range[2]; x++) {
+        uint32_t cell = y * columns + x;
+        for (uint32_t i = cellStarts[cell]; i < cellStarts[cell + 1]; i++) {
+          const Obstacle& obstacle = obstacles[cellObstacles[i]];
+          if (!aabbsOverlap(
+                obstacle.topLeft, obstacle.bottomRight, topLeft, bottomRight
+              )) {
+            continue;
+          }
+          int cornerRange[4];
+          getCellRange(
+            {fmaxf(obstacle.topLeft.x, topLeft.x),
+             fmaxf(obstacle.topLeft.y, topLeft.y)},
+            {0.0f, 0.0f}, cornerRange
+          );
+          if (cornerRange[0] != x || cornerRange[1] != y) continue;
+          visit(obstacle);
+        }
+      }
+    }
+  }
+
+  // Push body out of every obstacle it overlaps, one after another, and
+  // bounce it off each with elasticity
+  // CircleT needs velocity, setPosition() and the shape of shape.h
+  // Returns the number of obstacles it touched
+  template <typename CircleT>
+  int collide(CircleT& body, const float elasticity) const {
+    if (empty()) return 0;
+    // Cells are picked from where the body started, so pushing it does not
+    // make an obstacle come up twice
+    Vector2 halfSize = getShapeHalfSize(body);
+    int touched = 0;
+    forEachObstacleInAabb(
+      Vector2Subtract(body.position, halfSize),
+      Vector2Add(body.position, halfSize),
+      [&](const Obstacle& obstacle) {
+        ShapeContact contact;
+        if (!collideShapes(obstacle, body, &contact)) return;
+        touched += 1;
+        body.setPosition(Vector2Add(
+          body.position, Vector2Scale(contact.normal, contact.penetration)
+        ));
+        float normalVelocity = Vector2DotProduct(body.velocity, contact.normal);
+        if (normalVelocity < 0.0f) {
+          body.velocity = Vector2Subtract(
+            body.velocity,
+            Vector2Scale(contact.normal, (1.0f + elasticity) * normalVelocity)
+          );
+        }
+      }
+    );
+    return touched;
+  }
+
+  // Read obstacles from a text file, one per line:
+  //   box CX CY HALF_WIDTH HALF_HEIGHT
+  //   segment X0 Y0 X1 Y1 THICKNESS
+  //   circle CX CY RADIUS
+  bool load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+      fprintf(stderr, "Could not open %s\n", path);
+      return false;
+    }
+
+    bool loaded = true;
+    char type[16];
+    while (loaded && fscanf(file, "%15s", type) == 1) {
+      float v[5];
+      if (strcmp(type, "box") == 0) {
+        loaded = fscanf(file, "%f %f %f %f", &v[0], &v[1], &v[2], &v[3]) == 4;
+        if (loaded) add(makeBoxObstacle({v[0], v[1]}, {v[2], v[3]}));
+      } else if (strcmp(type, "segment") == 0) {
+        loaded = fscanf(
+                   file, "%f %f %f %f %f", &v[0], &v[1], &v[2], &v[3], &v[4]
+                 ) == 5;
+        if (loaded) add(makeSegmentObstacle({v[0], v[1]}, {v[2], v[3]}, v[4]));
+      } else if (strcmp(type, "circle") == 0) {
+        loaded = fscanf(file, "%f %f %f", &v[0], &v[1], &v[2]) == 3;
+        if (loaded) add(makeCircleObstacle({v[0], v[1]}, v[2]));
+      } else {
+        loaded = false;
+      }
+    }
+    fclose(file);
+
+    if (!loaded) fprintf(stderr, "%s is not an obstacle file\n", path);
+    return loaded;
+  }
+
+  void draw(const Color color) const {
+    for (size_t i = 0; i < obstacles.size(); i++) {
+      drawShape(obstacles[i], color);
+    }
+  }
+
+  size_t memoryUsage() const {
+    return obstacles.capacity() * sizeof(Obstacle) +
+           (cellStarts.capacity() + cellObstacles.capacity()) *
+             sizeof(uint32_t);
+  }
+};
+
+// Add the walls of a maze of spacing by spacing rooms covering a width by
+// height screen, carved with the binary tree algorithm: every room opens to
+// the room above or the one to its right
+static void addMaze(
+  StaticObstacles& obstacles, const float width, const float height,
+  const float spacing, Rng& rng
+) {
+  int columns = static_cast<int>(width / spacing);
+  int rows = static_cast<int>(height / spacing);
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < columns; x++) {
+      bool canOpenUp = y > 0;
+      bool canOpenRight = x < columns - 1;
+      bool opensUp = canOpenUp && (!canOpenRight || rng.nextInt(2) == 0);
+      bool opensRight = canOpenRight && !opensUp;
+      Vector2 topLeft = {x * spacing, y * spacing};
+      if (!opensUp && y > 0) {
+        obstacles.add(makeSegmentObstacle(
+          topLeft, {topLeft.x + spacing, topLeft.y},
+          DEFAULT_MAZE_WALL_THICKNESS
+        ));
+      }
+      if (!opensRight && x < columns - 1) {
+        obstacles.add(makeSegmentObstacle(
+          {topLeft.x + spacing, topLeft.y},
+          {topLeft.x + spacing, topLeft.y + spacing},
+          DEFAULT_MAZE_WALL_THICKNESS
+        ));
+      }
+    }
+  }
+}
+
+#endif
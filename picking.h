@@ -0,0 +1,144 @@
+#ifndef PICKING_H
+#define PICKING_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "despawn.h"
+
+// Mouse picking and dragging shared by main.cpp, unigrid.cpp and quadtree.cpp
+// A click is a point query (queryCircle with a radius of 0), so picking walks
+// the same cells or quads as any other query instead of every circle. The
+// grabbed circle is steered toward the mouse one tick at a time, which lets it
+// push other circles through the solver, and is thrown with the mouse's
+// velocity when the button is released
+// Grabs, mouse moves while dragging and releases go into the input log, so
+// replays drag the same circles, see replay.h
+const MouseButton PICK_BUTTON(MOUSE_BUTTON_LEFT);
+// Most circles under the mouse looked at per click
+const size_t PICK_CAPACITY(16);
+// How much of the newest mouse velocity goes into the throw velocity
+const float THROW_SMOOTHING(0.5f);
+// Fastest a dragged or thrown circle can move, in pixels per second
+const float MAX_DRAG_SPEED(3000.0f);
+
+static Vector2 limitSpeed(const Vector2 velocity, const float maxSpeed) {
+  float speed = Vector2Length(velocity);
+  if (speed <= maxSpeed) return velocity;
+  return Vector2Scale(velocity, maxSpeed / speed);
+}
+
+// Simulation needs getCircle(), queryCircle(), wakeCircle(), circleHandles,
+// timestep, tick and inputLog
+struct Drag {
+  // Handle of the grabbed circle, see despawn.h
+  CircleHandle circle;
+  // From the mouse to the circle's center when it was picked
+  Vector2 grabOffset = {0.0f, 0.0f};
+  Vector2 mouse = {0.0f, 0.0f};
+  Vector2 throwVelocity = {0.0f, 0.0f};
+  // Mouse position last written to the input log
+  Vector2 loggedMouse = {0.0f, 0.0f};
+
+  void trackMouse(const Vector2 newMouse, const float deltaTime) {
+    if (deltaTime > 0.0f) {
+      Vector2 mouseVelocity =
+        Vector2Scale(Vector2Subtract(newMouse, mouse), 1.0f / deltaTime);
+      throwVelocity = Vector2Lerp(throwVelocity, mouseVelocity, THROW_SMOOTHING);
+    }
+    mouse = newMouse;
+  }
+
+  // Grab the topmost circle under point, which is the one drawn last
+  // Returns whether one was grabbed
+  template <typename Simulation>
+  bool pick(Simulation& simulation, const Vector2 point) {
+    uint32_t indices[PICK_CAPACITY];
+    size_t found = simulation.queryCircle(point, 0.0f, indices, PICK_CAPACITY);
+    size_t stored = found < PICK_CAPACITY ? found : PICK_CAPACITY;
+    circle = {};
+    if (stored == 0) return false;
+
+    uint32_t topmost = indices[0];
+    for (size_t i = 1; i < stored; i++) {
+      if (indices[i] > topmost) topmost = indices[i];
+    }
+    auto& grabbed = simulation.getCircle(topmost);
+    circle = grabbed.handle;
+    grabOffset = Vector2Subtract(grabbed.position, point);
+    throwVelocity = {0.0f, 0.0f};
+    simulation.wakeCircle(topmost);
+    return true;
+  }
+
+  // Index of the grabbed circle, or INVALID_CIRCLE if there is none or it
+  // was despawned
+  template <typename Simulation>
+  uint32_t findCircle(Simulation& simulation) {
+    uint32_t index = simulation.circleHandles.find(circle);
+    if (index == INVALID_CIRCLE) circle = {};
+    return index;
+  }
+
+  // Set the dragged circle's velocity so the next tick ends with it under
+  // the mouse
+  template <typename Simulation>
+  void steer(Simulation& simulation) {
+    uint32_t index = findCircle(simulation);
+    if (index == INVALID_CIRCLE) return;
+    auto& grabbed = simulation.getCircle(index);
+    Vector2 target = Vector2Add(mouse, grabOffset);
+    grabbed.velocity = limitSpeed(
+      Vector2Scale(
+        Vector2Subtract(target, grabbed.position), 1.0f / simulation.timestep
+      ),
+      MAX_DRAG_SPEED
+    );
+    simulation.wakeCircle(index);
+  }
+
+  // Let go and throw the circle with the mouse's recent velocity
+  template <typename Simulation>
+  void release(Simulation& simulation) {
+    uint32_t index = findCircle(simulation);
+    if (index == INVALID_CIRCLE) return;
+    simulation.getCircle(index).velocity =
+      limitSpeed(throwVelocity, MAX_DRAG_SPEED);
+    simulation.wakeCircle(index);
+    circle = {};
+  }
+
+  template <typename Simulation>
+  void draw(Simulation& simulation) {
+    uint32_t index = findCircle(simulation);
+    if (index == INVALID_CIRCLE) return;
+    auto& grabbed = simulation.getCircle(index);
+    DrawCircleLines(
+      grabbed.position.x, grabbed.position.y, grabbed.radius + 2.0f, BLACK
+    );
+  }
+
+  // Pick, track and release with the mouse, once per frame, logging each
+  // for replays
+  template <typename Simulation>
+  void handleMouse(Simulation& simulation, const float deltaTime) {
+    trackMouse(GetMousePosition(), deltaTime);
+    if (circle.slot != INVALID_CIRCLE && !Vector2Equals(mouse, loggedMouse)) {
+      simulation.inputLog.recordMouse(simulation.tick, mouse);
+      loggedMouse = mouse;
+    }
+    if (IsMouseButtonPressed(PICK_BUTTON)) {
+      simulation.inputLog.recordGrab(simulation.tick, mouse);
+      loggedMouse = mouse;
+      pick(simulation, mouse);
+    }
+    if (IsMouseButtonReleased(PICK_BUTTON)) {
+      simulation.inputLog.recordRelease(simulation.tick, throwVelocity);
+      release(simulation);
+    }
+  }
+};
+
+#endif
@@ -5,6 +5,28 @@
 
 #include <vector>
 
+#include "ccd.h"
+#include "despawn.h"
+#include "events.h"
+#include "gravity.h"
+#include "headless.h"
+#include "jobs.h"
+#include "layers.h"
+#include "obstacles.h"
+#include "picking.h"
+#include "query.h"
+#include "recording.h"
+#include "reorder.h"
+#include "replay.h"
+#include "rng.h"
+#include "shape.h"
+#include "sleep.h"
+#include "snapshot.h"
+#include "solver.h"
+#include "spawn.h"
+#include "stats.h"
+#include "substep.h"
+
 const int WINDOW_WIDTH(1280);
 const int WINDOW_HEIGHT(720);
 const char* WINDOW_NAME("Spatial Data Structures - Quadtree");
@@ -15,6 +37,9 @@ const float TIMESTEP(1.0f / TARGET_FPS);
 const KeyboardKey SPAWN_KEY(KEY_SPACE);
 const KeyboardKey PAUSE_KEY(KEY_A);
 const KeyboardKey DETAILS_KEY(KEY_Q);
+const KeyboardKey STATS_KEY(KEY_W);
+const KeyboardKey SAVE_KEY(KEY_F5);
+const KeyboardKey LOAD_KEY(KEY_F9);
 
 enum CircleSize { small = 0, big = 1 };
 
@@ -47,17 +72,25 @@ const int MAX_DEPTH(7);
 struct Circle;
 struct Quad;
 
+// Counters for the current tick
+static CollisionStats collisionStats;
+// Touching and woken circles for the current tick
+static SleepSystem sleepSystem;
+// Contacts found this tick and impulses cached from the last one
+static ContactSolver contactSolver;
+// Fast circles that touched between the start and the end of the tick
+static SweptHits sweptHits;
+
 // https://cplusplus.com/forum/beginner/81180/
 // Returns a random float within min and max
-static float randf(const float min, const float max) {
-  float result =
-    (rand() / static_cast<float>(RAND_MAX) * (max - min + 1)) + min;
+static float randf(Rng& rng, const float min, const float max) {
+  float result = (rng.nextFloat() * (max - min + 1)) + min;
   return result;
 }
 
 // Returns 1 or -1
-static int directionMultiplier() {
-  int randomNumber = rand() % 100;  // 0 to 99
+static int directionMultiplier(Rng& rng) {
+  int randomNumber = rng.nextInt(100);  // 0 to 99
   if (randomNumber < 50) {
     return -1.0f;
   }
@@ -65,44 +98,65 @@ static int directionMultiplier() {
 }
 
 struct Circle {
-  int radius;
-  int mass;
-  Color color;
-
-  Vector2 acceleration;
-  Vector2 velocity;
-  Vector2 position;
-  Vector2 oldPosition;
-
-  Quad* quad = nullptr;
+  int radius = 0;
+  int mass = 0;
+  Color color = {0, 0, 0, 0};
+
+  Vector2 acceleration = {0.0f, 0.0f};
+  Vector2 velocity = {0.0f, 0.0f};
+  Vector2 position = {0.0f, 0.0f};
+  Vector2 oldPosition = {0.0f, 0.0f};
+
+  // Index in the simulation's circle storage
+  uint32_t index = 0;
+  bool sleeping = false;
+  // Ticks in a row this circle has not moved
+  int restingTicks = 0;
+  // Moved further than its radius this tick, see ccd.h
+  bool fast = false;
+  // Finds this circle again after it moves to another index, see despawn.h
+  CircleHandle handle;
+  // Ticks until it despawns, 0 for never
+  int ticksToLive = 0;
+  // Layers this circle is in and layers it collides with, see layers.h
+  uint32_t category = DEFAULT_CATEGORY;
+  uint32_t mask = ALL_LAYERS;
+  // Boxes and capsules are circles with another shape, whose radius bounds
+  // the whole shape, see shape.h
+  ShapeType shape = ShapeType::circle;
+  Vector2 halfExtents = {0.0f, 0.0f};  // Box only
+  Vector2 halfAxis = {0.0f, 0.0f};  // Capsule only, from its middle to one end
+  float capsuleRadius = 0.0f;  // Capsule only
 
   Circle() {}
 
   // If big, spawn at bottom middle of screen
   // Else, spawn at middle
-  void spawn(const CircleSize size = small) {
+  void spawn(Rng& rng, const CircleSize size = small) {
     color = {
-      static_cast<unsigned char>(rand() % 256),
-      static_cast<unsigned char>(rand() % 256),
-      static_cast<unsigned char>(rand() % 256), 255};
-    velocity.x =
-      randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) * directionMultiplier();
+      static_cast<unsigned char>(rng.nextInt(256)),
+      static_cast<unsigned char>(rng.nextInt(256)),
+      static_cast<unsigned char>(rng.nextInt(256)), 255};
+    velocity.x = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) *
+                 directionMultiplier(rng);
     if (size == CircleSize::small) {
-      radius = rand() % (SMALL_CIRCLE_RADIUS_MAX - SMALL_CIRCLE_RADIUS_MIN) +
+      radius = rng.nextInt(SMALL_CIRCLE_RADIUS_MAX - SMALL_CIRCLE_RADIUS_MIN) +
                SMALL_CIRCLE_RADIUS_MIN;
       mass = SMALL_CIRCLE_MASS;
       position = {WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2};
-      velocity.y =
-        randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) * directionMultiplier();
+      velocity.y = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) *
+                   directionMultiplier(rng);
     } else {
       radius = BIG_CIRCLE_RADIUS;
       mass = BIG_CIRCLE_MASS;
       position = {WINDOW_WIDTH / 2, WINDOW_HEIGHT - (float)radius};
-      velocity.y = randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX);
+      velocity.y = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX);
     }
   }
 
-  void draw() { DrawCircle(position.x, position.y, radius, color); }
+  void draw() { drawShape(*this, color); }
+
+  void setPosition(const Vector2 newPosition) { position = newPosition; }
 
   void update(
     const Vector2 force = {0.0f, 0.0f}, const float timestep = TIMESTEP
@@ -110,22 +164,36 @@ struct Circle {
     // acceleration = Vector2Add(
     //   Vector2Scale(force, 1 / mass), (Vector2Scale(velocity, FRICTION))
     // ); // With friction
-    acceleration = Vector2Scale(force, 1 / mass);  // No friction
-    velocity = Vector2Add(velocity, Vector2Scale(acceleration, TIMESTEP));
+    acceleration = Vector2Scale(force, 1.0f / mass);  // No friction
+    velocity = Vector2Add(velocity, Vector2Scale(acceleration, timestep));
     velocity.x = (abs(velocity.x) < VELOCITY_THRESHOLD) ? 0.0f : velocity.x;
     velocity.y = (abs(velocity.y) < VELOCITY_THRESHOLD) ? 0.0f : velocity.y;
+    restingTicks =
+      (velocity.x == 0.0f && velocity.y == 0.0f) ? restingTicks + 1 : 0;
+    fast = Vector2Length(velocity) * timestep > radius;
     oldPosition = position;
-    position = Vector2Add(position, Vector2Scale(velocity, TIMESTEP));
-
-    quad = nullptr;
+    position = Vector2Add(position, Vector2Scale(velocity, timestep));
   }
 
-  void handleCircleCollision(const std::vector<Circle*> circles) {
-    for (size_t i = 0; i < circles.size(); i++) {
+  // Collide with every circle in others from others[start] on, where others
+  // are indices into circles
+  void handleCircleCollision(
+    std::vector<Circle>& circles, const std::vector<uint32_t>& others,
+    const size_t start = 0
+  ) {
+    for (size_t i = start; i < others.size(); i++) {
       Circle* a = this;
-      Circle* b = circles[i];
+      Circle* b = &circles[others[i]];
 
       if (a == b) continue;
+      if (!shouldCollide(*a, *b)) continue;
+
+      collisionStats.candidatePairs += 1;
+
+      if (!isCirclePair(*a, *b)) {
+        handleShapeCollision(*a, *b);
+        continue;
+      }
 
       float sumOfRadii(pow(a->radius + b->radius, 2));
       float distanceBetweenCenters(Vector2DistanceSqr(a->position, b->position)
@@ -133,66 +201,50 @@ struct Circle {
 
       // Collision detected
       if (sumOfRadii >= distanceBetweenCenters) {
-        Vector2 collisionNormalAB(
-          {b->position.x - a->position.x, b->position.y - a->position.y}
-        );
-        Vector2 relativeVelocityAB(Vector2Subtract(a->velocity, b->velocity));
-        Vector2 collisionNormalABNormalized(Vector2Normalize(collisionNormalAB)
-        );
-        Vector2 relativeVelocityABNormalized(Vector2Normalize(relativeVelocityAB
-        ));
-
-        // Collision response
-        // Check dot product between collision normal and relative velocity
-        if (Vector2DotProduct(relativeVelocityABNormalized, collisionNormalABNormalized) > 0) {
-          float impulse =
-            Circle::getImpulse(*a, *b, relativeVelocityAB, collisionNormalAB);
-          a->velocity = Vector2Add(
-            a->velocity,
-            Vector2Scale(
-              Vector2Scale(collisionNormalAB, 1.0f / a->mass), impulse
-            )
-          );
-          b->velocity = Vector2Subtract(
-            b->velocity,
-            Vector2Scale(
-              Vector2Scale(collisionNormalAB, 1.0f / b->mass), impulse
-            )
-          );
-        }
+        collisionStats.addOverlap(a->index, b->index);
+        sleepSystem.addTouchingPair(a->index, b->index);
+        // Response happens once every contact of the tick is known
+        contactSolver.addContact(*a, *b, ELASTICITY, VELOCITY_THRESHOLD);
+      } else if (a->fast || b->fast) {
+        sweptHits.test(*a, *b);
       }
     }
   }
 
+  // Collide a pair with a box or capsule through the table in shape.h
+  // These pairs are never swept, see ccd.h
+  static void handleShapeCollision(const Circle& a, const Circle& b) {
+    ShapeContact shapeContact;
+    if (!collideShapes(a, b, &shapeContact)) return;
+    collisionStats.addOverlap(a.index, b.index);
+    sleepSystem.addTouchingPair(a.index, b.index);
+    contactSolver.addContact(
+      a, b, shapeContact, ELASTICITY, VELOCITY_THRESHOLD
+    );
+  }
+
+  // Mirror the circle back in if it went past a screen edge, so it ends up
+  // where it would be had it bounced off the edge itself
   void handleEdgeCollision(
     const int screenWidth = WINDOW_WIDTH, const int screenHeight = WINDOW_HEIGHT
   ) {
-    // Check if the circle should bounce off of the screen edge
-    bool circleIsOutOfBoundsX =
-      position.x >= (screenWidth - radius) || position.x <= radius;
-    bool circleIsOutOfBoundsY =
-      position.y >= (screenHeight - radius) || position.y <= radius;
-    if (circleIsOutOfBoundsX) {
-      position = oldPosition;
-      velocity.x *= -1.0f;
-    }
-    if (circleIsOutOfBoundsY) {
-      position = oldPosition;
-      velocity.y *= -1.0f;
-    }
+    position = reflectOffEdges(
+      position, &velocity, getShapeHalfSize(*this), screenWidth, screenHeight
+    );
   }
 
-  static float getImpulse(
-    Circle a, Circle b, Vector2 relativeVelocity, Vector2 collisionNormal
-  ) {
-    float impulse(-(
-      ((1.0f + ELASTICITY) *
-       (Vector2DotProduct(relativeVelocity, collisionNormal)) /
-       (Vector2DotProduct(collisionNormal, collisionNormal) *
-        ((1.0f / a.mass) + (1.0f / b.mass))))
-    ));
-
-    return impulse;
+  // Top left and bottom right of the circle's AABB, or its box's or
+  // capsule's
+  // A fast circle's AABB covers everything it swept through this tick
+  void getBounds(Vector2* topLeft, Vector2* bottomRight) const {
+    Vector2 from = fast ? oldPosition : position;
+    Vector2 halfSize = getShapeHalfSize(*this);
+    *topLeft = {
+      fminf(from.x, position.x) - halfSize.x,
+      fminf(from.y, position.y) - halfSize.y};
+    *bottomRight = {
+      fmaxf(from.x, position.x) + halfSize.x,
+      fmaxf(from.y, position.y) + halfSize.y};
   }
 };
 
@@ -202,14 +254,23 @@ struct Quad {
   int halfWidth;
   int depth;
 
-  Quad* parent;  // Not used as of the moment
+  Quad* parent = nullptr;  // nullptr for the root
 
   Quad* topLeftChild = nullptr;
   Quad* topRightChild = nullptr;
   Quad* bottomLeftChild = nullptr;
   Quad* bottomRightChild = nullptr;
 
-  std::vector<Circle*> objects;
+  // Indices into the circles the tree was filled from, so they stay valid
+  // when the circles are reallocated
+  std::vector<uint32_t> objects;
+  // Layers of the objects in this quad and every quad below it, see layers.h
+  LayerSummary layers;
+  // Mass of the circles whose centers are in this quad and below, filed by
+  // addBody() apart from objects, see gravity.h
+  MassSummary masses;
+  // Deepest quads only: the circles whose centers are in this quad
+  std::vector<uint32_t> bodies;
 
   Quad() {
     center = {WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2};
@@ -243,6 +304,17 @@ struct Quad {
     if (bottomRightChild) bottomRightChild->draw();
   }
 
+  // Bytes held by this quad and its children
+  size_t memoryUsage() const {
+    size_t bytes = sizeof(Quad) +
+                   (objects.capacity() + bodies.capacity()) * sizeof(uint32_t);
+    if (topLeftChild) bytes += topLeftChild->memoryUsage();
+    if (topRightChild) bytes += topRightChild->memoryUsage();
+    if (bottomLeftChild) bytes += bottomLeftChild->memoryUsage();
+    if (bottomRightChild) bytes += bottomRightChild->memoryUsage();
+    return bytes;
+  }
+
   // Return true if any of the children, grandchildren, etc. contains at least
   // one circle
   bool branchContainsObjects() {
@@ -256,52 +328,36 @@ struct Quad {
            bottomRightChild->branchContainsObjects();
   }
 
-  // Return circles that are near this circle
-  std::vector<Circle*> getObjectsForCollisionCheck(const Circle* circle) {
-    std::vector<Circle*> circles;
-		if (!isOverlapping(circle, this)) return circles;
+  // Add the circles in this quad or below that are near circle to found
+  void getObjectsForCollisionCheck(
+    const Circle* circle, std::vector<uint32_t>& found
+  ) {
+    collisionStats.nodesVisited += 1;
+		if (!isOverlapping(circle, this)) return;
+    if (!layers.mayCollide(circle->category, circle->mask)) return;
 
-    if (depth >= MAX_DEPTH) {
-      for (size_t i = 0; i < objects.size(); i++) {
-        circles.push_back(objects[i]);
-      }
-      return circles;
-    }
+    getChildObjectsForCollisionCheck(circle, found);
+    found.insert(found.end(), objects.begin(), objects.end());
+  }
+
+  // Add the circles below this quad that are near circle to found
+  void getChildObjectsForCollisionCheck(
+    const Circle* circle, std::vector<uint32_t>& found
+  ) {
+    if (depth >= MAX_DEPTH) return;
 
     if (isOverlapping(circle, topLeftChild)) {
-      std::vector<Circle*> topLeftChildCircles =
-        topLeftChild->getObjectsForCollisionCheck(circle);
-      for (size_t i = 0; i < topLeftChildCircles.size(); i++) {
-        circles.push_back(topLeftChildCircles[i]);
-      }
+      topLeftChild->getObjectsForCollisionCheck(circle, found);
     }
     if (isOverlapping(circle, topRightChild)) {
-      std::vector<Circle*> topRightChildCircles =
-        topRightChild->getObjectsForCollisionCheck(circle);
-      for (size_t i = 0; i < topRightChildCircles.size(); i++) {
-        circles.push_back(topRightChildCircles[i]);
-      }
+      topRightChild->getObjectsForCollisionCheck(circle, found);
     }
     if (isOverlapping(circle, bottomLeftChild)) {
-      std::vector<Circle*> bottomLeftChildCircles =
-        bottomLeftChild->getObjectsForCollisionCheck(circle);
-      for (size_t i = 0; i < bottomLeftChildCircles.size(); i++) {
-        circles.push_back(bottomLeftChildCircles[i]);
-      }
+      bottomLeftChild->getObjectsForCollisionCheck(circle, found);
     }
     if (isOverlapping(circle, bottomRightChild)) {
-      std::vector<Circle*> bottomRightChildCircles =
-        bottomRightChild->getObjectsForCollisionCheck(circle);
-      for (size_t i = 0; i < bottomRightChildCircles.size(); i++) {
-        circles.push_back(bottomRightChildCircles[i]);
-      }
+      bottomRightChild->getObjectsForCollisionCheck(circle, found);
     }
-
-    for (size_t i = 0; i < objects.size(); i++) {
-      circles.push_back(objects[i]);
-    }
-
-    return circles;
   }
 
   // Subdivide quad
@@ -311,21 +367,25 @@ struct Quad {
       {center.x - halfOfHalfWidth, center.y - halfOfHalfWidth}, halfOfHalfWidth,
       depth + 1
     );
+    topLeftChild->parent = this;
 
     topRightChild = new Quad(
       {center.x + halfOfHalfWidth, center.y - halfOfHalfWidth}, halfOfHalfWidth,
       depth + 1
     );
+    topRightChild->parent = this;
 
     bottomLeftChild = new Quad(
       {center.x - halfOfHalfWidth, center.y + halfOfHalfWidth}, halfOfHalfWidth,
       depth + 1
     );
+    bottomLeftChild->parent = this;
 
     bottomRightChild = new Quad(
       {center.x + halfOfHalfWidth, center.y + halfOfHalfWidth}, halfOfHalfWidth,
       depth + 1
     );
+    bottomRightChild->parent = this;
   }
 
   // Return whether the quad can COMPLETELY contain the circle's AABB
@@ -333,10 +393,9 @@ struct Quad {
     Vector2 quadTopLeft = Vector2SubtractValue(center, halfWidth);
     Vector2 quadBottomRight = Vector2AddValue(center, halfWidth);
 
-    Vector2 circleTopLeft =
-      Vector2SubtractValue(circle->position, circle->radius);
-    Vector2 circleBottomRight =
-      Vector2AddValue(circle->position, circle->radius);
+    Vector2 circleTopLeft;
+    Vector2 circleBottomRight;
+    circle->getBounds(&circleTopLeft, &circleBottomRight);
 
     return (
       circleTopLeft.x >= quadTopLeft.x && circleTopLeft.y >= quadTopLeft.y &&
@@ -369,12 +428,13 @@ struct Quad {
     return position;
   }
 
-  // Insert an object into the appropriate quad
-  void insert(Circle* circle) {
+  // Insert circles[index] into the appropriate quad
+  void insert(const std::vector<Circle>& circles, const uint32_t index) {
+    const Circle* circle = &circles[index];
+    layers.add(circle->category, circle->mask);
     // Leaf check
     if (depth >= MAX_DEPTH) {
-      objects.push_back(circle);
-      circle->quad = this;
+      objects.push_back(index);
       return;
     }
 
@@ -384,26 +444,25 @@ struct Quad {
 
     // If no child can completely contain the circle
     if (childPositionThatContainsCircle == QuadPosition::none) {
-      objects.push_back(circle);
-      circle->quad = this;
+      objects.push_back(index);
       return;
     } else {
       // Pick quad which contains circle
       switch (childPositionThatContainsCircle) {
         case QuadPosition::topLeft:
-          topLeftChild->insert(circle);
+          topLeftChild->insert(circles, index);
           break;
 
         case QuadPosition::topRight:
-          topRightChild->insert(circle);
+          topRightChild->insert(circles, index);
           break;
 
         case QuadPosition::bottomLeft:
-          bottomLeftChild->insert(circle);
+          bottomLeftChild->insert(circles, index);
           break;
 
         case QuadPosition::bottomRight:
-          bottomRightChild->insert(circle);
+          bottomRightChild->insert(circles, index);
           break;
 
         default:
@@ -415,6 +474,7 @@ struct Quad {
   // Recursively free all quads of objects
   void clear() {
     objects.clear();
+    layers.clear();
     if (depth >= MAX_DEPTH) {
       return;
     }
@@ -434,17 +494,29 @@ struct Quad {
   }
 
   // Do physics recursively
-  void update() {
+  // Awake objects also collide with anything in sleepingQuadtree
+  void update(std::vector<Circle>& circles, Quad* sleepingQuadtree = nullptr) {
+    collisionStats.nodesVisited += 1;
     if (!objects.empty()) {
-      std::vector<Circle*> objectsForCollisionCheck;
-      for (size_t i = 0; i < objects.size(); i++) {
-        // Check collision for objects that are in child quads of the circle's
-        // current quad
-        objectsForCollisionCheck =
-          objects[i]->quad->getObjectsForCollisionCheck(objects[i]);
-        objects[i]->handleCircleCollision(objectsForCollisionCheck);
+      collisionStats.occupiedNodes += 1;
+      collisionStats.objectsInOccupiedNodes += objects.size();
 
-        objects[i]->handleEdgeCollision();
+      std::vector<uint32_t> objectsForCollisionCheck;
+      for (size_t i = 0; i < objects.size(); i++) {
+        Circle& circle = circles[objects[i]];
+        // The rest of this quad, after this circle so each pair is handled
+        // once, then the child quads it overlaps
+        circle.handleCircleCollision(circles, objects, i + 1);
+        objectsForCollisionCheck.clear();
+        getChildObjectsForCollisionCheck(&circle, objectsForCollisionCheck);
+        circle.handleCircleCollision(circles, objectsForCollisionCheck);
+        if (sleepingQuadtree) {
+          objectsForCollisionCheck.clear();
+          sleepingQuadtree->getObjectsForCollisionCheck(
+            &circle, objectsForCollisionCheck
+          );
+          circle.handleCircleCollision(circles, objectsForCollisionCheck);
+        }
       }
     }
 
@@ -452,17 +524,304 @@ struct Quad {
       return;
     }
 
-    if (topLeftChild) topLeftChild->update();
-    if (topRightChild) topRightChild->update();
-    if (bottomLeftChild) bottomLeftChild->update();
-    if (bottomRightChild) bottomRightChild->update();
+    if (topLeftChild) topLeftChild->update(circles, sleepingQuadtree);
+    if (topRightChild) topRightChild->update(circles, sleepingQuadtree);
+    if (bottomLeftChild) bottomLeftChild->update(circles, sleepingQuadtree);
+    if (bottomRightChild) bottomRightChild->update(circles, sleepingQuadtree);
   }
 	
+  // Run visit(circle) for every circle in this quad or below whose AABB
+  // overlaps the box
+  // A circle's AABB fits in its quad, so quads outside the box are skipped
+  // The root is never skipped, since it also holds circles poking off the
+  // screen
+  template <typename Visit>
+  void forEachCircleInAabb(
+    const std::vector<Circle>& circles, const Vector2 topLeft,
+    const Vector2 bottomRight, Visit visit
+  ) const {
+    Vector2 quadTopLeft = Vector2SubtractValue(center, halfWidth);
+    Vector2 quadBottomRight = Vector2AddValue(center, halfWidth);
+    if (depth > 1 &&
+        !aabbsOverlap(quadTopLeft, quadBottomRight, topLeft, bottomRight)) {
+      return;
+    }
+
+    for (size_t i = 0; i < objects.size(); i++) {
+      const Circle& circle = circles[objects[i]];
+      if (aabbsOverlap(
+            Vector2SubtractValue(circle.position, circle.radius),
+            Vector2AddValue(circle.position, circle.radius), topLeft,
+            bottomRight
+          )) {
+        visit(circle);
+      }
+    }
+
+    if (depth >= MAX_DEPTH) return;
+    topLeftChild->forEachCircleInAabb(circles, topLeft, bottomRight, visit);
+    topRightChild->forEachCircleInAabb(circles, topLeft, bottomRight, visit);
+    bottomLeftChild->forEachCircleInAabb(circles, topLeft, bottomRight, visit);
+    bottomRightChild->forEachCircleInAabb(circles, topLeft, bottomRight, visit);
+  }
+
+  // Same as forEachCircleInAabb, for the circles of every quad above this one
+  template <typename Visit>
+  void forEachAncestorCircleInAabb(
+    const std::vector<Circle>& circles, const Vector2 topLeft,
+    const Vector2 bottomRight, Visit visit
+  ) const {
+    for (const Quad* quad = parent; quad; quad = quad->parent) {
+      for (size_t i = 0; i < quad->objects.size(); i++) {
+        const Circle& circle = circles[quad->objects[i]];
+        if (aabbsOverlap(
+              Vector2SubtractValue(circle.position, circle.radius),
+              Vector2AddValue(circle.position, circle.radius), topLeft,
+              bottomRight
+            )) {
+          visit(circle);
+        }
+      }
+    }
+  }
+
+  bool containsBox(const Vector2 topLeft, const Vector2 bottomRight) const {
+    return topLeft.x >= center.x - halfWidth &&
+           topLeft.y >= center.y - halfWidth &&
+           bottomRight.x <= center.x + halfWidth &&
+           bottomRight.y <= center.y + halfWidth;
+  }
+
+  // Smallest quad of this tree that completely contains the box, or the root
+  // Starts from `from`, a quad of this tree found for a nearby box, and only
+  // climbs as far up as it has to, so nearby queries share the walk down
+  const Quad* findSmallestQuadContaining(
+    const Vector2 topLeft, const Vector2 bottomRight, const Quad* from
+  ) const {
+    const Quad* quad = from ? from : this;
+    while (quad->parent && !quad->containsBox(topLeft, bottomRight)) {
+      quad = quad->parent;
+    }
+    while (quad->depth < MAX_DEPTH) {
+      const Quad* children[4] = {
+        quad->topLeftChild, quad->topRightChild, quad->bottomLeftChild,
+        quad->bottomRightChild};
+      const Quad* next = nullptr;
+      for (int i = 0; i < 4 && !next; i++) {
+        if (children[i]->containsBox(topLeft, bottomRight)) next = children[i];
+      }
+      if (!next) break;
+      quad = next;
+    }
+    return quad;
+  }
+
+  void queryCircle(
+    const std::vector<Circle>& circles, const Vector2 queryCenter,
+    const float radius, QueryBuffer& buffer
+  ) const {
+    QueryShape query = makeQueryCircle(queryCenter, radius);
+    forEachCircleInAabb(
+      circles, Vector2SubtractValue(queryCenter, radius),
+      Vector2AddValue(queryCenter, radius),
+      [&](const Circle& circle) {
+        if (bodyOverlapsQuery(circle, query)) buffer.add(circle.index);
+      }
+    );
+  }
+
+  void queryAabb(
+    const std::vector<Circle>& circles, const Vector2 topLeft,
+    const Vector2 bottomRight, QueryBuffer& buffer
+  ) const {
+    QueryShape query = makeQueryBox(topLeft, bottomRight);
+    forEachCircleInAabb(circles, topLeft, bottomRight, [&](const Circle& circle) {
+      if (bodyOverlapsQuery(circle, query)) buffer.add(circle.index);
+    });
+  }
+
+  // Children ordered by key, smallest first
+  void getChildrenInOrder(const float keys[4], const Quad* ordered[4]) const {
+    const Quad* children[4] = {
+      topLeftChild, topRightChild, bottomLeftChild, bottomRightChild};
+    int order[4] = {0, 1, 2, 3};
+    for (int i = 1; i < 4; i++) {
+      for (int j = i; j > 0 && keys[order[j]] < keys[order[j - 1]]; j--) {
+        int swap = order[j];
+        order[j] = order[j - 1];
+        order[j - 1] = swap;
+      }
+    }
+    for (int i = 0; i < 4; i++) {
+      ordered[i] = children[order[i]];
+    }
+  }
+
+  // Nearest child first, and skip quads farther away than the k-th nearest
+  // circle found so far
+  void queryNearest(
+    const std::vector<Circle>& circles, const Vector2 point, NearestHeap& nearest
+  ) const {
+    Vector2 quadTopLeft = Vector2SubtractValue(center, halfWidth);
+    Vector2 quadBottomRight = Vector2AddValue(center, halfWidth);
+    if (depth > 1 && distanceSqrToAabb(point, quadTopLeft, quadBottomRight) >=
+                       nearest.worstDistanceSqr()) {
+      return;
+    }
+
+    for (size_t i = 0; i < objects.size(); i++) {
+      nearest.offer(
+        objects[i], Vector2DistanceSqr(point, circles[objects[i]].position)
+      );
+    }
+
+    if (depth >= MAX_DEPTH) return;
+    const Quad* children[4] = {
+      topLeftChild, topRightChild, bottomLeftChild, bottomRightChild};
+    float distancesSqr[4];
+    for (int i = 0; i < 4; i++) {
+      distancesSqr[i] = distanceSqrToAabb(
+        point, Vector2SubtractValue(children[i]->center, children[i]->halfWidth),
+        Vector2AddValue(children[i]->center, children[i]->halfWidth)
+      );
+    }
+    const Quad* ordered[4];
+    getChildrenInOrder(distancesSqr, ordered);
+    for (int i = 0; i < 4; i++) {
+      ordered[i]->queryNearest(circles, point, nearest);
+    }
+  }
+
+  // Children in the order the ray enters them, and skip quads the ray only
+  // enters after the nearest hit so far
+  void raycast(
+    const std::vector<Circle>& circles, const Ray2& ray, RaycastHit* best
+  ) const {
+    Vector2 quadTopLeft = Vector2SubtractValue(center, halfWidth);
+    Vector2 quadBottomRight = Vector2AddValue(center, halfWidth);
+    float enter;
+    float exit;
+    if (depth > 1) {
+      if (!rayHitsAabb(ray, quadTopLeft, quadBottomRight, &enter, &exit)) return;
+      if (best->hit && enter >= best->distance) return;
+    }
+
+    for (size_t i = 0; i < objects.size(); i++) {
+      testRaycastHit(ray, circles[objects[i]], best);
+    }
+
+    if (depth >= MAX_DEPTH) return;
+    const Quad* children[4] = {
+      topLeftChild, topRightChild, bottomLeftChild, bottomRightChild};
+    float enters[4];
+    for (int i = 0; i < 4; i++) {
+      if (!rayHitsAabb(
+            ray,
+            Vector2SubtractValue(children[i]->center, children[i]->halfWidth),
+            Vector2AddValue(children[i]->center, children[i]->halfWidth),
+            &enters[i], &exit
+          )) {
+        enters[i] = INFINITY;
+      }
+    }
+    const Quad* ordered[4];
+    getChildrenInOrder(enters, ordered);
+    for (int i = 0; i < 4; i++) {
+      ordered[i]->raycast(circles, ray, best);
+    }
+  }
+
+  // The child a point falls in, points on a middle line going right or down
+  Quad* getChildContainingPoint(const Vector2 point) const {
+    if (point.y < center.y) {
+      return point.x < center.x ? topLeftChild : topRightChild;
+    }
+    return point.x < center.x ? bottomLeftChild : bottomRightChild;
+  }
+
+  // File circles[index] by its center point, into the deepest quad it falls
+  // in and the masses of every quad on the way
+  // Unlike objects, every circle ends up in the deepest quads, so a quad's
+  // mass is never summed circle by circle unless the quad is that small
+  void addBody(const std::vector<Circle>& circles, const uint32_t index) {
+    const Circle& circle = circles[index];
+    masses.add(getGravityMass(circle), circle.position);
+    if (depth >= MAX_DEPTH) {
+      bodies.push_back(index);
+      return;
+    }
+    getChildContainingPoint(circle.position)->addBody(circles, index);
+  }
+
+  // Recursively forget every circle filed by addBody()
+  void clearBodies() {
+    masses.clear();
+    bodies.clear();
+    if (depth >= MAX_DEPTH) return;
+
+    topLeftChild->clearBodies();
+    topRightChild->clearBodies();
+    bottomLeftChild->clearBodies();
+    bottomRightChild->clearBodies();
+  }
+
+  // Add the pull of every circle filed by addBody() in this quad and below on
+  // circles[index] to force, where onPath is true if the circle itself was
+  // filed in this quad
+  // A quad off the circle's path that is seen under less than theta pulls as
+  // one body from its center of mass, see gravity.h
+  void addGravity(
+    const std::vector<Circle>& circles, const uint32_t index,
+    const GravitySettings& gravity, const bool onPath, Vector2* force
+  ) const {
+    if (masses.mass <= 0.0f) return;
+
+    const Circle& circle = circles[index];
+    if (!onPath) {
+      Vector2 centerOfMass = masses.getCenterOfMass();
+      float width = halfWidth * 2.0f;
+      if (width * width < gravity.theta * gravity.theta *
+                            Vector2DistanceSqr(circle.position, centerOfMass)) {
+        *force = Vector2Add(*force, gravity.getAttraction(
+          circle.position, circle.mass, centerOfMass, masses.mass
+        ));
+        return;
+      }
+    }
+
+    if (depth >= MAX_DEPTH) {
+      for (size_t i = 0; i < bodies.size(); i++) {
+        if (bodies[i] == index) continue;
+        const Circle& other = circles[bodies[i]];
+        *force = Vector2Add(*force, gravity.getAttraction(
+          circle.position, circle.mass, other.position, getGravityMass(other)
+        ));
+      }
+      return;
+    }
+
+    const Quad* pathChild =
+      onPath ? getChildContainingPoint(circle.position) : nullptr;
+    topLeftChild->addGravity(
+      circles, index, gravity, topLeftChild == pathChild, force
+    );
+    topRightChild->addGravity(
+      circles, index, gravity, topRightChild == pathChild, force
+    );
+    bottomLeftChild->addGravity(
+      circles, index, gravity, bottomLeftChild == pathChild, force
+    );
+    bottomRightChild->addGravity(
+      circles, index, gravity, bottomRightChild == pathChild, force
+    );
+  }
+
   // Return true if the circle's AABB and the quad are overlapping
   // https://developer.mozilla.org/en-US/docs/Games/Techniques/2D_collision_detection
   static bool isOverlapping(const Circle* c, const Quad* q) {
-    Vector2 circleTopLeft = Vector2SubtractValue(c->position, c->radius);
-    Vector2 circleBottomRight = Vector2AddValue(c->position, c->radius);
+    Vector2 circleTopLeft;
+    Vector2 circleBottomRight;
+    c->getBounds(&circleTopLeft, &circleBottomRight);
 
     Vector2 quadTopLeft = Vector2SubtractValue(q->center, q->halfWidth);
     Vector2 quadBottomRight = Vector2AddValue(q->center, q->halfWidth);
@@ -476,19 +835,687 @@ struct Quad {
   }
 };
 
-int main() {
-  srand(GetTime());
-
-  // Counts the number of times the user has spawned 10 small circles
-  int numberOfSpawnKeyPresses = 0;
+// What --circles spawns unless told otherwise
+static SpawnParams getDefaultSpawnParams() {
+  SpawnParams params;
+  params.radiusMin = SMALL_CIRCLE_RADIUS_MIN;
+  params.radiusMax = SMALL_CIRCLE_RADIUS_MAX;
+  params.mass = SMALL_CIRCLE_MASS;
+  params.bigRadius = BIG_CIRCLE_RADIUS;
+  params.bigMass = BIG_CIRCLE_MASS;
+  params.smallCirclesPerBigCircle =
+    SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY *
+    NUMBER_OF_PRESSES_UNTIL_BIG_CIRCLE_SPAWNS;
+  params.velocityMin = CIRCLE_VELOCITY_MIN;
+  params.velocityMax = CIRCLE_VELOCITY_MAX;
+  params.screenWidth = WINDOW_WIDTH;
+  params.screenHeight = WINDOW_HEIGHT;
+  return params;
+}
 
+struct Simulation {
   Quad quadtree = Quad();
+  // Only rebuilt when a circle falls asleep or wakes up
+  Quad sleepingQuadtree = Quad();
+
+  std::vector<Circle> circles;
+  std::vector<uint32_t> awakeCircles;
+  std::vector<uint32_t> sleepingCircles;
+  // Set whenever circles are added or change between awake and asleep
+  bool sleepListsDirty = true;
+  // Set whenever circles may have moved since quadtree was filled
+  bool queryIndexDirty = true;
+
+  // Used for everything spawned into this simulation
+  Rng rng;
+  JobPool jobPool;
+
+  // Ticks run so far
+  uint32_t tick = 0;
+  // Seconds simulated per tick
+  float timestep = TIMESTEP;
+  // Split ticks into substeps when circles move fast or overlap deeply
+  bool adaptiveSubsteps = false;
+  int maxSubsteps = DEFAULT_MAX_SUBSTEPS;
+  Recorder recorder;
+  InputLog inputLog;
+
+  // Finds circles by handle after despawns move them to other indices
+  CircleHandles circleHandles;
+  // Pairs that began, kept or stopped touching last tick, see events.h
+  CollisionEvents collisionEvents;
+  // Ticks every circle spawned from now on lives, 0 for forever
+  int lifetime = 0;
+  std::vector<uint32_t> despawnScratch;
+  // Layers new circles are split between, see layers.h
+  int layerCount = 1;
+  // Walls that never move, baked once at startup, see obstacles.h
+  StaticObstacles obstacles;
+  // Pull between every pair of circles, off unless strength is set, see
+  // gravity.h
+  GravitySettings gravity;
+  // Pull on each circle this substep, by index, while gravity is on
+  std::vector<Vector2> gravityForces;
+
+  // Ticks between sorting circles by cell, 0 for never, see reorder.h
+  int reorderInterval = DEFAULT_REORDER_INTERVAL;
+  CircleReorder reorder;
 
-  std::vector<Circle*> circles;
+  // Counts the number of times the user has spawned 10 small circles
+  int numberOfSpawnKeyPresses = 0;
 
   int numberOfSmallCirclesPresent = 0;
   int numberOfBigCirclesPresent = 0;
 
+  size_t circleCount() const { return circles.size(); }
+
+  Circle& getCircle(const size_t index) { return circles[index]; }
+
+  // Wake a circle from outside the tick, like when the mouse grabs it
+  void wakeCircle(const size_t index) {
+    Circle& circle = circles[index];
+    circle.restingTicks = 0;
+    if (!circle.sleeping) return;
+    circle.sleeping = false;
+    sleepListsDirty = true;
+  }
+
+  // Give new circles handles, see despawn.h
+  void assignHandles() {
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    assignCircleLayers(circles.size(), getCircle, layerCount);
+    assignCircleHandles(circleHandles, circles.size(), getCircle, lifetime);
+  }
+
+  // Remove the circles at indices, given in any order, and empty indices
+  // Each one's slot takes the last circle, so the rest stay where they are
+  void despawnCircles(std::vector<uint32_t>& indices) {
+    if (indices.empty()) return;
+    // Indices change below, so the contact cache goes through handle slots
+    remapContactsToSlots(contactSolver, [&](uint32_t index) -> Circle& {
+      return circles[index];
+    });
+
+    sortForDespawn(indices);
+    for (size_t i = 0; i < indices.size(); i++) {
+      uint32_t index = indices[i];
+      // Walls are not counted
+      if (circles[index].shape == ShapeType::circle) {
+        if (circles[index].radius >= BIG_CIRCLE_RADIUS) {
+          numberOfBigCirclesPresent -= 1;
+        } else {
+          numberOfSmallCirclesPresent -= 1;
+        }
+      }
+      circleHandles.remove(circles[index].handle);
+      if (index != circles.size() - 1) {
+        circles[index] = std::move(circles.back());
+        circles[index].index = index;
+        circleHandles.move(circles[index].handle, index);
+      }
+      circles.pop_back();
+    }
+    indices.clear();
+
+    remapContactsToIndices(contactSolver, circleHandles);
+    sleepListsDirty = true;
+    queryIndexDirty = true;
+    recorder.circlesMoved = true;
+  }
+
+  // Despawn the circle with handle
+  // Returns false if it was already gone
+  bool despawn(const CircleHandle handle) {
+    uint32_t index = circleHandles.find(handle);
+    if (index == INVALID_CIRCLE) return false;
+    despawnScratch.assign(1, index);
+    despawnCircles(despawnScratch);
+    return true;
+  }
+
+  // Despawn every circle overlapping a box
+  // Returns the number despawned
+  size_t despawnInAabb(const Vector2 topLeft, const Vector2 bottomRight) {
+    despawnScratch.resize(circles.size());
+    size_t found = queryAabb(
+      topLeft, bottomRight, despawnScratch.data(), despawnScratch.size()
+    );
+    despawnScratch.resize(found);
+    despawnCircles(despawnScratch);
+    return found;
+  }
+
+  // Sort circles by the Morton code of their deepest quad, so circles that are close
+  // in space are close in memory too
+  void reorderCircles() {
+    // Indices change below, so the contact cache goes through handle slots
+    remapContactsToSlots(contactSolver, [&](uint32_t index) -> Circle& {
+      return circles[index];
+    });
+    Vector2 rootTopLeft =
+      Vector2SubtractValue(quadtree.center, quadtree.halfWidth);
+    float leafWidth = 2.0f * quadtree.halfWidth / (1 << (MAX_DEPTH - 1));
+    bool moved = reorder.sort(
+      circles, [&](const Vector2 position, uint32_t* x, uint32_t* y) {
+        *x = static_cast<uint32_t>(
+          fmaxf((position.x - rootTopLeft.x) / leafWidth, 0.0f)
+        );
+        *y = static_cast<uint32_t>(
+          fmaxf((position.y - rootTopLeft.y) / leafWidth, 0.0f)
+        );
+      }
+    );
+    if (moved) {
+      assignHandles();
+      sleepListsDirty = true;
+      queryIndexDirty = true;
+      recorder.circlesMoved = true;
+    }
+    remapContactsToIndices(contactSolver, circleHandles);
+  }
+
+  // Bytes held by the circles and the quadtree
+  size_t memoryUsage() const {
+    return sizeof(Simulation) + circles.capacity() * sizeof(Circle) +
+           (awakeCircles.capacity() + sleepingCircles.capacity()) *
+             sizeof(uint32_t) +
+           circleHandles.memoryUsage() + reorder.memoryUsage() +
+           collisionEvents.memoryUsage() + obstacles.memoryUsage() +
+           gravityForces.capacity() * sizeof(Vector2) +
+           quadtree.memoryUsage() - sizeof(Quad) +
+           sleepingQuadtree.memoryUsage() - sizeof(Quad);
+  }
+
+  void handleSpawnKeyPress() {
+    numberOfSpawnKeyPresses += 1;
+    sleepListsDirty = true;
+    // If user reaches 10 presses, spawn a big boy
+    if (numberOfSpawnKeyPresses % NUMBER_OF_PRESSES_UNTIL_BIG_CIRCLE_SPAWNS == 0) {
+      circles.push_back(Circle());
+      circles[circles.size() - 1].spawn(rng, CircleSize::big);
+      numberOfSpawnKeyPresses = 0;
+      numberOfBigCirclesPresent += 1;
+    }
+
+    // Spawn small circles
+    for (int i = 0; i < SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY; i++) {
+      circles.push_back(Circle());
+      circles[circles.size() - 1].spawn(rng);
+    }
+    numberOfSmallCirclesPresent += SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY;
+    assignHandles();
+  }
+
+  // Add body as a wall or paddle, see shape.h: as heavy as IMMOVABLE_MASS,
+  // in every layer and never despawning, so whatever hits it bounces off and
+  // it keeps moving at velocity
+  // Returns its handle
+  CircleHandle addWall(Circle body, const Vector2 velocity) {
+    body.mass = IMMOVABLE_MASS;
+    body.color = DARKGRAY;
+    body.velocity = velocity;
+    body.oldPosition = body.position;
+    circles.push_back(body);
+    sleepListsDirty = true;
+    assignHandles();
+    Circle& wall = circles.back();
+    wall.category = ALL_LAYERS;
+    wall.mask = ALL_LAYERS;
+    wall.ticksToLive = 0;
+    return wall.handle;
+  }
+
+  CircleHandle addBox(
+    const Vector2 center, const Vector2 halfExtents, const Vector2 velocity
+  ) {
+    Circle box;
+    makeBox(box, center, halfExtents);
+    return addWall(box, velocity);
+  }
+
+  CircleHandle addCapsule(
+    const Vector2 center, const Vector2 halfAxis, const float radius,
+    const Vector2 velocity
+  ) {
+    Circle capsule;
+    makeCapsule(capsule, center, halfAxis, radius);
+    return addWall(capsule, velocity);
+  }
+
+  // Spawn count circles in bulk
+  // Anything params leaves at zero comes from this program's constants
+  void populate(const size_t count, const SpawnParams& requestedParams) {
+    SpawnParams params = requestedParams.withDefaults(getDefaultSpawnParams());
+    spawnCircles(circles, count, params, rng, jobPool);
+    sleepListsDirty = true;
+
+    for (size_t i = 0; i < count; i++) {
+      if (shouldSpawnBig(params.distribution, i, params.smallCirclesPerBigCircle)) {
+        numberOfBigCirclesPresent += 1;
+      } else {
+        numberOfSmallCirclesPresent += 1;
+      }
+    }
+    assignHandles();
+  }
+
+  // Write every circle to a snapshot file
+  bool saveSnapshot(const char* path) const {
+    Snapshot snapshot;
+    const std::vector<CachedContact>& contacts = contactSolver.cachedContacts;
+    snapshot.allocate(
+      circles.size(), contacts.size(), numberOfSpawnKeyPresses, tick, rng
+    );
+    for (size_t i = 0; i < circles.size(); i++) {
+      snapshot.storeCircle(i, circles[i]);
+    }
+    for (size_t i = 0; i < contacts.size(); i++) {
+      snapshot.storeContact(i, contacts[i].a, contacts[i].b, contacts[i].impulse);
+    }
+    return snapshot.save(path);
+  }
+
+  // Replace every circle with the ones in a snapshot file
+  bool loadSnapshot(const char* path) {
+    Snapshot snapshot;
+    if (!snapshot.load(path)) return false;
+
+    circles.clear();
+    circles.resize(snapshot.circleCount());
+    jobPool.parallelFor(
+      circles.size(), SPAWN_CHUNK_SIZE,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          snapshot.loadCircle(i, circles[i]);
+        }
+      }
+    );
+
+    numberOfSpawnKeyPresses = snapshot.header->numberOfSpawnKeyPresses;
+    tick = snapshot.header->tick;
+    rng = snapshot.getRng();
+    sleepListsDirty = true;
+    recorder.circlesMoved = true;
+    contactSolver.clearCache();
+    for (size_t i = 0; i < snapshot.contactCount(); i++) {
+      contactSolver.addCachedContact(
+        snapshot.contactA[i], snapshot.contactB[i], snapshot.contactImpulse[i]
+      );
+    }
+    contactSolver.indexCachedContacts();
+    numberOfSmallCirclesPresent = 0;
+    numberOfBigCirclesPresent = 0;
+    for (size_t i = 0; i < circles.size(); i++) {
+      if (circles[i].radius >= BIG_CIRCLE_RADIUS) {
+        numberOfBigCirclesPresent += 1;
+      } else {
+        numberOfSmallCirclesPresent += 1;
+      }
+    }
+    circleHandles.removeAll();
+    // Layers come from the snapshot, so only handles are handed out
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    assignCircleHandles(circleHandles, circles.size(), getCircle, lifetime);
+    return true;
+  }
+
+  // Checksum of every circle
+  uint64_t checksum() const {
+    uint64_t checksum = CHECKSUM_OFFSET_BASIS;
+    for (size_t i = 0; i < circles.size(); i++) {
+      checksum = addCircleToChecksum(checksum, circles[i]);
+    }
+    return checksum;
+  }
+
+  // Add the current tick to the recording
+  void record() {
+    recorder.beginFrame(tick, circles.size());
+    for (size_t i = 0; i < circles.size(); i++) {
+      recorder.addCircle(circles[i]);
+    }
+    recorder.endFrame();
+  }
+
+  // Split circles into awake and sleeping, and put the sleeping ones into
+  // sleepingQuadtree
+  void rebuildSleepLists() {
+    awakeCircles.clear();
+    sleepingCircles.clear();
+    sleepingQuadtree.clear();
+    for (size_t i = 0; i < circles.size(); i++) {
+      circles[i].index = i;
+      if (circles[i].sleeping) {
+        sleepingCircles.push_back(i);
+        sleepingQuadtree.insert(circles, i);
+      } else {
+        awakeCircles.push_back(i);
+      }
+    }
+    sleepListsDirty = false;
+  }
+
+  // Reinsert awake circles into quadtree where the last tick left them
+  // The solver moves circles after the broadphase, so the tree is a little
+  // out of date until then. Every query does this itself, but it has to be
+  // called before queries run on several threads
+  void refreshQueryIndex() {
+    if (sleepListsDirty) rebuildSleepLists();
+    if (!queryIndexDirty) return;
+    quadtree.clear();
+    for (size_t i = 0; i < awakeCircles.size(); i++) {
+      quadtree.insert(circles, awakeCircles[i]);
+    }
+    queryIndexDirty = false;
+  }
+
+  // Write the indices of the circles overlapping a circle into indices
+  // Returns the number found, which can be more than capacity
+  size_t queryCircle(
+    const Vector2 center, const float radius, uint32_t* indices,
+    const size_t capacity
+  ) {
+    refreshQueryIndex();
+    QueryBuffer buffer(indices, capacity);
+    quadtree.queryCircle(circles, center, radius, buffer);
+    sleepingQuadtree.queryCircle(circles, center, radius, buffer);
+    return buffer.count;
+  }
+
+  // Write the indices of the circles overlapping a box into indices
+  // Returns the number found, which can be more than capacity
+  size_t queryAabb(
+    const Vector2 topLeft, const Vector2 bottomRight, uint32_t* indices,
+    const size_t capacity
+  ) {
+    refreshQueryIndex();
+    QueryBuffer buffer(indices, capacity);
+    quadtree.queryAabb(circles, topLeft, bottomRight, buffer);
+    sleepingQuadtree.queryAabb(circles, topLeft, bottomRight, buffer);
+    return buffer.count;
+  }
+
+  // Write the k circles whose centers are nearest to point into indices and
+  // their squared distances into distancesSqr, nearest first
+  // Returns the number found, at most k
+  size_t queryNearest(
+    const Vector2 point, const size_t k, uint32_t* indices, float* distancesSqr
+  ) {
+    refreshQueryIndex();
+    NearestHeap nearest(indices, distancesSqr, k);
+    quadtree.queryNearest(circles, point, nearest);
+    sleepingQuadtree.queryNearest(circles, point, nearest);
+    nearest.sort();
+    return nearest.count;
+  }
+
+  // First circle hit by a ray from origin towards direction within
+  // maxDistance
+  // Returns false if the ray hits nothing
+  bool raycast(
+    const Vector2 origin, const Vector2 direction, const float maxDistance,
+    RaycastHit* hit
+  ) {
+    refreshQueryIndex();
+    Ray2 ray = {origin, Vector2Normalize(direction), maxDistance};
+    *hit = RaycastHit();
+    quadtree.raycast(circles, ray, hit);
+    sleepingQuadtree.raycast(circles, ray, hit);
+    return hit->hit;
+  }
+
+  // Run every query in batch, in Morton order of the deepest quads and split
+  // across jobPool
+  // Circle and box queries start from the quad the previous query in the
+  // chunk ended up in, instead of walking down from the root
+  void runQueries(QueryBatch& batch) {
+    refreshQueryIndex();
+    Vector2 rootTopLeft =
+      Vector2SubtractValue(quadtree.center, quadtree.halfWidth);
+    float leafWidth = 2.0f * quadtree.halfWidth / (1 << (MAX_DEPTH - 1));
+    batch.sort([&](const Vector2 point, uint32_t* x, uint32_t* y) {
+      *x = static_cast<uint32_t>(fmaxf((point.x - rootTopLeft.x) / leafWidth, 0.0f));
+      *y = static_cast<uint32_t>(fmaxf((point.y - rootTopLeft.y) / leafWidth, 0.0f));
+    });
+    batch.run(
+      jobPool,
+      [&](const uint32_t* ids, size_t count, std::vector<uint32_t>&) {
+        const Quad* awakeStart = nullptr;
+        const Quad* sleepingStart = nullptr;
+        for (size_t i = 0; i < count; i++) {
+          const Query& query = batch.queries[ids[i]];
+          QueryResult& result = batch.results[ids[i]];
+          if (query.type == QueryType::nearest) {
+            NearestHeap nearest = batch.getHeap(ids[i]);
+            quadtree.queryNearest(circles, query.a, nearest);
+            sleepingQuadtree.queryNearest(circles, query.a, nearest);
+            nearest.sort();
+            result.count = nearest.count;
+            continue;
+          }
+          if (query.type == QueryType::raycast) {
+            Ray2 ray = {query.a, query.b, query.radius};
+            quadtree.raycast(circles, ray, &result.hit);
+            sleepingQuadtree.raycast(circles, ray, &result.hit);
+            continue;
+          }
+
+          bool isCircle = query.type == QueryType::circle;
+          Vector2 topLeft =
+            isCircle ? Vector2SubtractValue(query.a, query.radius) : query.a;
+          Vector2 bottomRight =
+            isCircle ? Vector2AddValue(query.a, query.radius) : query.b;
+          QueryBuffer buffer = batch.getBuffer(ids[i]);
+          QueryShape shape = isCircle ? makeQueryCircle(query.a, query.radius)
+                                      : makeQueryBox(query.a, query.b);
+          auto visit = [&](const Circle& circle) {
+            if (bodyOverlapsQuery(circle, shape)) buffer.add(circle.index);
+          };
+          awakeStart =
+            quadtree.findSmallestQuadContaining(topLeft, bottomRight, awakeStart);
+          awakeStart->forEachCircleInAabb(circles, topLeft, bottomRight, visit);
+          awakeStart->forEachAncestorCircleInAabb(
+            circles, topLeft, bottomRight, visit
+          );
+          if (!sleepingCircles.empty()) {
+            sleepingStart = sleepingQuadtree.findSmallestQuadContaining(
+              topLeft, bottomRight, sleepingStart
+            );
+            sleepingStart->forEachCircleInAabb(circles, topLeft, bottomRight, visit);
+            sleepingStart->forEachAncestorCircleInAabb(
+              circles, topLeft, bottomRight, visit
+            );
+          }
+          result.count = buffer.count;
+        }
+      }
+    );
+  }
+
+  // Wake circles that were hit and put resting islands to sleep
+  void updateSleep() {
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    size_t woken = sleepSystem.wakeHitCircles(getCircle);
+    size_t fellAsleep = 0;
+    if (tick % SLEEP_CHECK_INTERVAL == 0) {
+      fellAsleep = sleepSystem.putRestingIslandsToSleep(circles.size(), getCircle);
+    }
+    if (woken > 0 || fellAsleep > 0) rebuildSleepLists();
+
+    collisionStats.wakes = woken;
+    collisionStats.sleepingCircles = sleepingCircles.size();
+  }
+
+  // Advance the physics by one timestep, split into substeps if
+  // adaptiveSubsteps is set
+  void step() {
+    collisionStats.reset();
+    sleepSystem.beginTick();
+    if (reorderInterval > 0 && tick % reorderInterval == 0) reorderCircles();
+    if (sleepListsDirty) rebuildSleepLists();
+
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    int substeps = 1;
+    if (adaptiveSubsteps) {
+      substeps = chooseSubsteps(
+        circles.size(), getCircle, contactSolver, timestep, maxSubsteps
+      );
+    }
+    for (int i = 0; i < substeps; i++) {
+      substep(timestep / substeps);
+    }
+    collisionStats.substeps = substeps;
+    updateSleep();
+    collisionEvents.endTick(circleHandles, getCircle);
+    if (lifetime > 0) {
+      findExpiredCircles(circles.size(), getCircle, despawnScratch);
+      despawnCircles(despawnScratch);
+    }
+
+    if (recorder.shouldRecord(tick)) record();
+    if (inputLog.isRecording()) inputLog.recordChecksum(tick, checksum());
+    tick += 1;
+    queryIndexDirty = true;
+  }
+
+  // Sum the pull of every other circle on each awake circle into
+  // gravityForces
+  // Every circle, awake or asleep, is filed in quadtree by addBody() first,
+  // which leaves its objects alone. The tree is then only read, so the
+  // circles are split between threads
+  void computeGravity() {
+    quadtree.clearBodies();
+    for (size_t i = 0; i < circles.size(); i++) {
+      if (getGravityMass(circles[i]) > 0.0f) quadtree.addBody(circles, i);
+    }
+
+    gravityForces.assign(circles.size(), {0.0f, 0.0f});
+    jobPool.parallelFor(
+      awakeCircles.size(), GRAVITY_CHUNK_SIZE,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          uint32_t index = awakeCircles[i];
+          if (getGravityMass(circles[index]) <= 0.0f) continue;
+          quadtree.addGravity(
+            circles, index, gravity, true, &gravityForces[index]
+          );
+        }
+      }
+    );
+  }
+
+  // Move, collide and solve every awake circle once, over dt
+  // Sleeping circles stay in sleepingQuadtree, where only awake circles test
+  // them
+  void substep(const float dt) {
+    contactSolver.beginTick();
+    sweptHits.beginTick();
+    if (gravity.enabled()) computeGravity();
+
+    quadtree.clear();
+
+    for (size_t i = 0; i < awakeCircles.size(); i++) {
+      Circle* circle = &circles[awakeCircles[i]];
+      circle->update(
+        gravity.enabled() ? gravityForces[awakeCircles[i]] : Vector2{0.0f, 0.0f},
+        dt
+      );
+      circle->handleEdgeCollision();
+      obstacles.collide(*circle, ELASTICITY);
+      quadtree.insert(circles, awakeCircles[i]);
+    }
+
+    quadtree.update(
+      circles, sleepingCircles.empty() ? nullptr : &sleepingQuadtree
+    );
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    collisionStats.sweptHits += sweptHits.resolve(
+      circles.size(), getCircle, contactSolver, ELASTICITY, VELOCITY_THRESHOLD
+    );
+    collisionStats.penetration += contactSolver.totalPenetration();
+    // Before solving, while contacts are still in the order they were found
+    collisionEvents.addContacts(contactSolver.contacts, getCircle);
+    collisionStats.impulses += contactSolver.solve(getCircle);
+    // The next substep replaces these contacts, so wake whoever they pushed now
+    sleepSystem.wakePushedCircles(contactSolver.contacts, getCircle);
+  }
+};
+
+int main(int argc, char** argv) {
+  Options options = parseOptions(argc, argv);
+
+  if (options.playPath) {
+    return runPlayback(
+      options.playPath, WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_NAME,
+      options.tickRate > 0 ? options.tickRate : TARGET_FPS
+    );
+  }
+
+  // A replay has to start from the seed it was recorded with
+  InputLog replayLog;
+  if (options.replayInputPath) {
+    if (!replayLog.load(options.replayInputPath)) return 1;
+    options.seed = replayLog.seed;
+  }
+
+  Simulation simulation;
+  simulation.rng = Rng(options.seed);
+  simulation.jobPool.start(options.threads);
+  if (options.tickRate > 0) simulation.timestep = 1.0f / options.tickRate;
+  simulation.adaptiveSubsteps = options.adaptiveSubsteps;
+  simulation.maxSubsteps = options.maxSubsteps;
+  simulation.lifetime = options.lifetime;
+  simulation.layerCount = options.layers;
+  if (options.events) simulation.collisionEvents.subscribeAll();
+  simulation.reorderInterval = options.reorderInterval;
+  simulation.gravity.strength = options.gravity;
+  simulation.gravity.theta = options.theta;
+  contactSolver.iterations = options.solverIterations;
+  contactSolver.warmStarting = options.warmStarting;
+  contactSolver.positionIterations = options.positionIterations;
+  contactSolver.jobPool = &simulation.jobPool;
+  for (int i = 0; i < options.presses; i++) {
+    simulation.handleSpawnKeyPress();
+  }
+  simulation.populate(options.circles, options.spawn);
+  if (options.walls) addWalls(simulation, WINDOW_WIDTH, WINDOW_HEIGHT);
+  if (options.obstaclesPath &&
+      !simulation.obstacles.load(options.obstaclesPath)) {
+    return 1;
+  }
+  if (options.mazeSpacing > 0) {
+    addMaze(
+      simulation.obstacles, WINDOW_WIDTH, WINDOW_HEIGHT, options.mazeSpacing,
+      simulation.rng
+    );
+  }
+  simulation.obstacles.bake(WINDOW_WIDTH, WINDOW_HEIGHT);
+  if (options.loadPath && !simulation.loadSnapshot(options.loadPath)) {
+    return 1;
+  }
+  if (options.recordPath &&
+      !simulation.recorder.open(options.recordPath, options.recordEvery)) {
+    return 1;
+  }
+
+  if (options.replayInputPath) {
+    return runReplay(simulation, replayLog);
+  }
+  if (options.recordInputPath &&
+      !simulation.inputLog.openForRecording(
+        options.recordInputPath, options.seed, simulation.checksum()
+      )) {
+    return 1;
+  }
+
+  if (options.headless) {
+    runHeadless(
+      simulation, collisionStats, options, "quadtree", "quad"
+    );
+    if (options.savePath) simulation.saveSnapshot(options.savePath);
+    return 0;
+  }
+
   char smallCircleCountBuffer[50];
   int numberOfSmallCirclesPresentFormatted;
   char bigCircleCountBuffer[50];
@@ -499,6 +1526,8 @@ int main() {
 
   bool paused(false);
   bool showTree(false);
+  bool showStats(false);
+  Drag drag;
 
   InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_NAME);
   SetTargetFPS(TARGET_FPS);
@@ -506,6 +1535,7 @@ int main() {
     deltaTime = GetFrameTime();
 
     if (IsKeyPressed(PAUSE_KEY)) {
+      simulation.inputLog.recordEvent(simulation.tick, InputAction::pause);
       paused = !paused;
     }
 
@@ -513,41 +1543,42 @@ int main() {
       showTree = !showTree;
     }
 
+    if (IsKeyPressed(STATS_KEY)) {
+      showStats = !showStats;
+    }
+
+    if (IsKeyPressed(SAVE_KEY)) {
+      simulation.saveSnapshot(
+        options.savePath ? options.savePath : DEFAULT_SNAPSHOT_PATH
+      );
+    }
+    if (IsKeyPressed(LOAD_KEY)) {
+      simulation.loadSnapshot(
+        options.loadPath ? options.loadPath : DEFAULT_SNAPSHOT_PATH
+      );
+    }
+
+    drag.handleMouse(simulation, deltaTime);
+    if (IsMouseButtonDown(DESPAWN_BUTTON)) {
+      simulation.inputLog.recordDespawn(simulation.tick, drag.mouse);
+      simulation.despawnInAabb(
+        Vector2SubtractValue(drag.mouse, DESPAWN_HALF_WIDTH),
+        Vector2AddValue(drag.mouse, DESPAWN_HALF_WIDTH)
+      );
+    }
+
     if (!paused) {
       if (IsKeyPressed(SPAWN_KEY)) {
-        numberOfSpawnKeyPresses += 1;
-        // If user reaches 10 presses, spawn a big boy
-        if (numberOfSpawnKeyPresses % NUMBER_OF_PRESSES_UNTIL_BIG_CIRCLE_SPAWNS == 0) {
-          circles.push_back(new Circle());
-          circles[circles.size() - 1]->spawn(CircleSize::big);
-          numberOfSpawnKeyPresses = 0;
-          numberOfBigCirclesPresent += 1;
-        }
-
-        // Spawn small circles
-        int numberOfSmallCirclesAfterSpawning =
-          numberOfSmallCirclesPresent + SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY;
-        for (size_t i = circles.size(); i < numberOfSmallCirclesAfterSpawning;
-             i++) {
-          circles.push_back(new Circle());
-          circles[i]->spawn();
-        }
-        numberOfSmallCirclesPresent = numberOfSmallCirclesAfterSpawning;
+        simulation.inputLog.recordEvent(simulation.tick, InputAction::spawn);
+        simulation.handleSpawnKeyPress();
       }
 
       // Physics update
       accumulator += deltaTime;
-      while (accumulator >= TIMESTEP) {
-        quadtree.clear();
-
-        for (size_t i = 0; i < circles.size(); i++) {
-          circles[i]->update();
-          quadtree.insert(circles[i]);
-        }
-
-        quadtree.update();
-
-        accumulator -= TIMESTEP;
+      while (accumulator >= simulation.timestep) {
+        drag.steer(simulation);
+        simulation.step();
+        accumulator -= simulation.timestep;
       }
     }
 
@@ -556,21 +1587,25 @@ int main() {
     ClearBackground(WHITE);
 
     if (showTree) {
-      quadtree.draw();
+      simulation.quadtree.draw();
     }
 
-    for (size_t i = 0; i < circles.size(); i++) {
-      circles[i]->draw();
+    simulation.obstacles.draw(GRAY);
+    for (size_t i = 0; i < simulation.circles.size(); i++) {
+      simulation.circles[i].draw();
     }
+    drag.draw(simulation);
 
     // Small Circle Counter
     numberOfSmallCirclesPresentFormatted = sprintf(
-      smallCircleCountBuffer, "%d Small Circles", numberOfSmallCirclesPresent
+      smallCircleCountBuffer, "%d Small Circles",
+      simulation.numberOfSmallCirclesPresent
     );
     DrawText(smallCircleCountBuffer, 10, 10, 20, BLACK);
     // Big Circle Counter
     numberOfBigCirclesPresentFormatted = sprintf(
-      bigCircleCountBuffer, "%d Big Circles", numberOfBigCirclesPresent
+      bigCircleCountBuffer, "%d Big Circles",
+      simulation.numberOfBigCirclesPresent
     );
     DrawText(bigCircleCountBuffer, 10, 30, 20, BLACK);
 
@@ -581,12 +1616,17 @@ int main() {
 		} else {
 			DrawText("Press A to pause.", 10, 70, 20, BLACK);
 		}
+
+    DrawText("Press W to toggle collision stats.", 10, 90, 20, BLACK);
+    DrawText("Press F5 to save and F9 to load a snapshot.", 10, 110, 20, BLACK);
+    DrawText("Drag a circle to throw it, hold right click to despawn.", 10, 130, 20, BLACK);
+    if (showStats) {
+      collisionStats.draw(10, 150, "quad");
+    }
     EndDrawing();
   }
 
-  for (size_t i = 0; i < circles.size(); i++) {
-    delete circles[i];
-  }
+  if (options.savePath) simulation.saveSnapshot(options.savePath);
 
   return 0;
-}
\ No newline at end of file
+}
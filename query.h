@@ -0,0 +1,557 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "jobs.h"
+#include "shape.h"
+
+// Spatial queries shared by main.cpp, unigrid.cpp and quadtree.cpp
+// Every engine answers the same four questions about its circles:
+//   queryCircle   Circles overlapping a circle
+//   queryAabb     Circles overlapping an axis-aligned box
+//   queryNearest  The k circles whose centers are nearest to a point
+//   raycast       The first circle a ray hits
+// Boxes and capsules are tested by their own shape, see bodyOverlapsQuery()
+// and rayHitsShape(), so every engine gives the same answer for them
+// Results are circle indices written into buffers the caller owns, so a
+// query never allocates. Queries only read the engine, so several can run at
+// once as long as nothing steps the simulation meanwhile
+// Many queries at once go into a QueryBatch, which each engine runs sorted by
+// place across its JobPool
+
+// Where queryCircle and queryAabb write the indices they find
+// Circles found after the buffer is full are counted but not stored
+struct QueryBuffer {
+  uint32_t* indices;
+  size_t capacity;
+  size_t count = 0;  // Circles found, can be more than capacity
+
+  QueryBuffer(uint32_t* _indices, const size_t _capacity) {
+    indices = _indices;
+    capacity = _capacity;
+  }
+
+  void add(const uint32_t index) {
+    if (count < capacity) indices[count] = index;
+    count += 1;
+  }
+
+  // Number of indices actually stored
+  size_t stored() const { return count < capacity ? count : capacity; }
+};
+
+// The k nearest circles found so far, as a max-heap on distance so the
+// farthest one is the one replaced
+// The arrays are the caller's and have to hold k entries
+struct NearestHeap {
+  uint32_t* indices;
+  float* distancesSqr;
+  size_t k;
+  size_t count = 0;
+
+  NearestHeap(uint32_t* _indices, float* _distancesSqr, const size_t _k) {
+    indices = _indices;
+    distancesSqr = _distancesSqr;
+    k = _k;
+  }
+
+  bool full() const { return count >= k; }
+
+  // Squared distance a circle has to beat to get in
+  float worstDistanceSqr() const {
+    if (!full()) return INFINITY;
+    return k > 0 ? distancesSqr[0] : -1.0f;
+  }
+
+  void offer(const uint32_t index, const float distanceSqr) {
+    if (distanceSqr >= worstDistanceSqr()) return;
+    size_t slot;
+    if (!full()) {
+      // Sift up from the new leaf
+      slot = count++;
+      while (slot > 0) {
+        size_t parent = (slot - 1) / 2;
+        if (distancesSqr[parent] >= distanceSqr) break;
+        indices[slot] = indices[parent];
+        distancesSqr[slot] = distancesSqr[parent];
+        slot = parent;
+      }
+    } else {
+      // Replace the root and sift down
+      slot = 0;
+      while (true) {
+        size_t child = 2 * slot + 1;
+        if (child >= count) break;
+        if (child + 1 < count && distancesSqr[child + 1] > distancesSqr[child]) {
+          child += 1;
+        }
+        if (distancesSqr[child] <= distanceSqr) break;
+        indices[slot] = indices[child];
+        distancesSqr[slot] = distancesSqr[child];
+        slot = child;
+      }
+    }
+    indices[slot] = index;
+    distancesSqr[slot] = distanceSqr;
+  }
+
+  // Order the results from nearest to farthest, which ends the heap
+  void sort() {
+    for (size_t end = count; end > 1; end--) {
+      // Move the farthest to the back, then restore the heap in front of it
+      uint32_t index = indices[end - 1];
+      float distanceSqr = distancesSqr[end - 1];
+      indices[end - 1] = indices[0];
+      distancesSqr[end - 1] = distancesSqr[0];
+      size_t slot = 0;
+      while (true) {
+        size_t child = 2 * slot + 1;
+        if (child >= end - 1) break;
+        if (child + 1 < end - 1 && distancesSqr[child + 1] > distancesSqr[child]) {
+          child += 1;
+        }
+        if (distancesSqr[child] <= distanceSqr) break;
+        indices[slot] = indices[child];
+        distancesSqr[slot] = distancesSqr[child];
+        slot = child;
+      }
+      indices[slot] = index;
+      distancesSqr[slot] = distanceSqr;
+    }
+  }
+};
+
+struct RaycastHit {
+  uint32_t index = 0;
+  float distance = INFINITY;  // Along the ray, in pixels
+  Vector2 point = {0.0f, 0.0f};
+  Vector2 normal = {0.0f, 0.0f};  // Unit length, out of the circle
+  bool hit = false;
+};
+
+// A ray from origin along direction, which has to be unit length
+struct Ray2 {
+  Vector2 origin;
+  Vector2 direction;
+  float maxDistance;
+};
+
+// A query's circle or box, as a body collideShapes() can test others against
+struct QueryShape {
+  ShapeType shape;
+  Vector2 position;
+  float radius;  // Circle only
+  Vector2 halfExtents;  // Box only
+  Vector2 halfAxis;  // Always zero, queries are never capsules
+  float capsuleRadius;
+};
+
+static QueryShape makeQueryCircle(const Vector2 center, const float radius) {
+  QueryShape query = {};
+  query.shape = ShapeType::circle;
+  query.position = center;
+  query.radius = radius;
+  return query;
+}
+
+static QueryShape makeQueryBox(const Vector2 topLeft, const Vector2 bottomRight) {
+  QueryShape query = {};
+  query.shape = ShapeType::box;
+  query.halfExtents = Vector2Scale(Vector2Subtract(bottomRight, topLeft), 0.5f);
+  query.position = Vector2Add(topLeft, query.halfExtents);
+  return query;
+}
+
+static bool circleOverlapsCircle(
+  const Vector2 a, const float radiusA, const Vector2 b, const float radiusB
+) {
+  float sumOfRadii = radiusA + radiusB;
+  return Vector2DistanceSqr(a, b) <= sumOfRadii * sumOfRadii;
+}
+
+static bool circleOverlapsAabb(
+  const Vector2 center, const float radius, const Vector2 topLeft,
+  const Vector2 bottomRight
+) {
+  Vector2 closest = {
+    Clamp(center.x, topLeft.x, bottomRight.x),
+    Clamp(center.y, topLeft.y, bottomRight.y)};
+  return Vector2DistanceSqr(center, closest) <= radius * radius;
+}
+
+static bool aabbsOverlap(
+  const Vector2 topLeftA, const Vector2 bottomRightA, const Vector2 topLeftB,
+  const Vector2 bottomRightB
+) {
+  return topLeftA.x <= bottomRightB.x && bottomRightA.x >= topLeftB.x &&
+         topLeftA.y <= bottomRightB.y && bottomRightA.y >= topLeftB.y;
+}
+
+// True if body's own shape overlaps the query's circle or box
+// Circles keep their cheap tests, boxes and capsules go through the
+// narrowphase table of shape.h
+// CircleT needs shape, position, radius, halfExtents, halfAxis and
+// capsuleRadius
+template <typename CircleT>
+static bool bodyOverlapsQuery(const CircleT& body, const QueryShape& query) {
+  if (body.shape == ShapeType::circle) {
+    if (query.shape == ShapeType::circle) {
+      return circleOverlapsCircle(
+        body.position, body.radius, query.position, query.radius
+      );
+    }
+    return circleOverlapsAabb(
+      body.position, body.radius,
+      Vector2Subtract(query.position, query.halfExtents),
+      Vector2Add(query.position, query.halfExtents)
+    );
+  }
+  ShapeContact contact;
+  return collideShapes(body, query, &contact);
+}
+
+// Only the grid and the quadtree cull by box, so the two box helpers below are
+// inline rather than static, which lets the brute-force program leave them out
+// without warnings
+
+// Squared distance from point to the nearest point of a box, 0 if inside
+inline float distanceSqrToAabb(
+  const Vector2 point, const Vector2 topLeft, const Vector2 bottomRight
+) {
+  float dx = fmaxf(fmaxf(topLeft.x - point.x, point.x - bottomRight.x), 0.0f);
+  float dy = fmaxf(fmaxf(topLeft.y - point.y, point.y - bottomRight.y), 0.0f);
+  return dx * dx + dy * dy;
+}
+
+// Distances along the ray at which it enters and leaves a box
+// Returns false if it misses the box within [0, ray.maxDistance]
+inline bool rayHitsAabb(
+  const Ray2& ray, const Vector2 topLeft, const Vector2 bottomRight,
+  float* enter, float* exit
+) {
+  float tMin = 0.0f;
+  float tMax = ray.maxDistance;
+  const float origin[2] = {ray.origin.x, ray.origin.y};
+  const float direction[2] = {ray.direction.x, ray.direction.y};
+  const float low[2] = {topLeft.x, topLeft.y};
+  const float high[2] = {bottomRight.x, bottomRight.y};
+  for (int axis = 0; axis < 2; axis++) {
+    if (direction[axis] == 0.0f) {
+      if (origin[axis] < low[axis] || origin[axis] > high[axis]) return false;
+      continue;
+    }
+    float t1 = (low[axis] - origin[axis]) / direction[axis];
+    float t2 = (high[axis] - origin[axis]) / direction[axis];
+    tMin = fmaxf(tMin, fminf(t1, t2));
+    tMax = fminf(tMax, fmaxf(t1, t2));
+    if (tMin > tMax) return false;
+  }
+  *enter = tMin;
+  *exit = tMax;
+  return true;
+}
+
+// Distance along the ray to where it enters a circle
+// A ray starting inside the circle hits it at distance 0
+static bool rayHitsCircle(
+  const Ray2& ray, const Vector2 center, const float radius, float* distance
+) {
+  Vector2 offset = Vector2Subtract(ray.origin, center);
+  float c = Vector2DotProduct(offset, offset) - radius * radius;
+  if (c <= 0.0f) {
+    *distance = 0.0f;
+    return true;
+  }
+  float b = Vector2DotProduct(offset, ray.direction);
+  if (b >= 0.0f) return false;  // Pointing away
+  float discriminant = b * b - c;
+  if (discriminant < 0.0f) return false;
+  float t = -b - sqrtf(discriminant);
+  if (t > ray.maxDistance) return false;
+  *distance = t;
+  return true;
+}
+
+// Distance along the ray to where it enters a box, and the normal of the
+// face it enters through
+// A ray starting inside the box hits it at distance 0, with a normal from the
+// box's center
+static bool rayHitsBox(
+  const Ray2& ray, const Vector2 center, const Vector2 halfExtents,
+  float* distance, Vector2* normal
+) {
+  float enter;
+  float exit;
+  if (!rayHitsAabb(
+        ray, Vector2Subtract(center, halfExtents), Vector2Add(center, halfExtents),
+        &enter, &exit
+      )) {
+    return false;
+  }
+  *distance = enter;
+  if (enter <= 0.0f) {
+    *normal = Vector2Normalize(Vector2Subtract(ray.origin, center));
+    return true;
+  }
+  // The face entered last is the one the ray goes through
+  float enterX = -INFINITY;
+  float enterY = -INFINITY;
+  if (ray.direction.x != 0.0f) {
+    enterX = (center.x - copysignf(halfExtents.x, ray.direction.x) - ray.origin.x) /
+             ray.direction.x;
+  }
+  if (ray.direction.y != 0.0f) {
+    enterY = (center.y - copysignf(halfExtents.y, ray.direction.y) - ray.origin.y) /
+             ray.direction.y;
+  }
+  *normal = (enterX > enterY)
+              ? Vector2{-copysignf(1.0f, ray.direction.x), 0.0f}
+              : Vector2{0.0f, -copysignf(1.0f, ray.direction.y)};
+  return true;
+}
+
+// Distance along the ray to where it enters a capsule, and the capsule's
+// normal there
+// The ray enters through one of the two flat sides or one of the end circles,
+// so the nearest of those hits is where it enters. A ray starting inside the
+// capsule hits it at distance 0, with a normal from its segment
+static bool rayHitsCapsule(
+  const Ray2& ray, const Vector2 center, const Vector2 halfAxis,
+  const float radius, float* distance, Vector2* normal
+) {
+  Vector2 start = Vector2Subtract(center, halfAxis);
+  Vector2 end = Vector2Add(center, halfAxis);
+  Vector2 nearest = closestPointOnSegment(ray.origin, start, end);
+  if (Vector2DistanceSqr(ray.origin, nearest) <= radius * radius) {
+    *distance = 0.0f;
+    *normal = Vector2Normalize(Vector2Subtract(ray.origin, nearest));
+    return true;
+  }
+
+  bool hit = false;
+  *distance = INFINITY;
+  const Vector2 ends[2] = {start, end};
+  for (int i = 0; i < 2; i++) {
+    float t;
+    if (!rayHitsCircle(ray, ends[i], radius, &t) || t >= *distance) continue;
+    hit = true;
+    *distance = t;
+    Vector2 point = Vector2Add(ray.origin, Vector2Scale(ray.direction, t));
+    *normal = Vector2Normalize(Vector2Subtract(point, ends[i]));
+  }
+
+  float length = Vector2Length(halfAxis);
+  if (length <= SHAPE_EPSILON) return hit;
+  Vector2 along = Vector2Scale(halfAxis, 1.0f / length);
+  Vector2 across = {-along.y, along.x};
+  float originAcross = Vector2DotProduct(Vector2Subtract(ray.origin, center), across);
+  float directionAcross = Vector2DotProduct(ray.direction, across);
+  if (fabsf(directionAcross) <= SHAPE_EPSILON) return hit;
+  // Only the side the ray comes from can be entered
+  float side = (directionAcross < 0.0f) ? 1.0f : -1.0f;
+  float t = (side * radius - originAcross) / directionAcross;
+  if (t < 0.0f || t > ray.maxDistance || t >= *distance) return hit;
+  Vector2 point = Vector2Add(ray.origin, Vector2Scale(ray.direction, t));
+  if (fabsf(Vector2DotProduct(Vector2Subtract(point, center), along)) > length) {
+    return hit;
+  }
+  *distance = t;
+  *normal = Vector2Scale(across, side);
+  return true;
+}
+
+// Distance along the ray to where it enters body's own shape, and the
+// shape's normal there
+// CircleT needs shape, position, radius, halfExtents, halfAxis and
+// capsuleRadius
+template <typename CircleT>
+static bool rayHitsShape(
+  const Ray2& ray, const CircleT& body, float* distance, Vector2* normal
+) {
+  switch (body.shape) {
+    case ShapeType::box:
+      return rayHitsBox(ray, body.position, body.halfExtents, distance, normal);
+    case ShapeType::capsule:
+      return rayHitsCapsule(
+        ray, body.position, body.halfAxis, body.capsuleRadius, distance, normal
+      );
+    default: {
+      if (!rayHitsCircle(ray, body.position, body.radius, distance)) return false;
+      Vector2 point =
+        Vector2Add(ray.origin, Vector2Scale(ray.direction, *distance));
+      *normal = Vector2Normalize(Vector2Subtract(point, body.position));
+      return true;
+    }
+  }
+}
+
+// Keep the circle in best if the ray hits it before best's circle
+// CircleT needs index and what rayHitsShape() needs
+template <typename CircleT>
+static void testRaycastHit(const Ray2& ray, const CircleT& circle, RaycastHit* best) {
+  float distance;
+  Vector2 normal;
+  if (!rayHitsShape(ray, circle, &distance, &normal)) return;
+  if (distance >= best->distance) return;
+  best->hit = true;
+  best->index = circle.index;
+  best->distance = distance;
+  best->point =
+    Vector2Add(ray.origin, Vector2Scale(ray.direction, distance));
+  best->normal = normal;
+}
+
+enum class QueryType { circle, aabb, nearest, raycast };
+
+// One query of a QueryBatch
+struct Query {
+  QueryType type;
+  Vector2 a;        // Circle center, box top-left, point or ray origin
+  Vector2 b;        // Box bottom-right or ray direction
+  float radius;     // Circle radius or ray length
+  size_t capacity;  // Most indices kept, k for nearest
+};
+
+struct QueryResult {
+  size_t offset = 0;  // Where its indices start in QueryBatch::indices
+  size_t count = 0;   // Circles found, can be more than capacity
+  RaycastHit hit;
+};
+
+// Queries run per job by QueryBatch::run
+const size_t QUERY_CHUNK_SIZE(256);
+
+// Interleave the bits of x and y, so cells close together in space end up
+// close together in the order
+static uint64_t getMortonCode(const uint32_t x, const uint32_t y) {
+  uint64_t code = 0;
+  for (int bit = 0; bit < 32; bit++) {
+    code |= static_cast<uint64_t>((x >> bit) & 1) << (2 * bit);
+    code |= static_cast<uint64_t>((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return code;
+}
+
+// Queries added over a tick, run together by an engine's runQueries()
+// Results keep the order queries were added in. Queries are run in Morton
+// order of the engine's cells, so neighbouring queries touch the same memory
+// and an engine can reuse the cells or quads one query walked for the next
+struct QueryBatch {
+  std::vector<Query> queries;
+  std::vector<QueryResult> results;
+  // Every query's indices, at results[i].offset
+  std::vector<uint32_t> indices;
+  // Squared distances of nearest queries, next to their indices
+  std::vector<float> distancesSqr;
+  // Query ids sorted by (Morton code << 32 | id)
+  std::vector<uint64_t> order;
+  // Scratch space for each chunk, kept between batches
+  std::vector<std::vector<uint32_t>> chunkScratch;
+
+  void clear() { queries.clear(); }
+  size_t size() const { return queries.size(); }
+
+  // Each add returns the query's id, which indexes results
+  size_t addCircle(const Vector2 center, const float radius, const size_t capacity) {
+    queries.push_back({QueryType::circle, center, {0.0f, 0.0f}, radius, capacity});
+    return queries.size() - 1;
+  }
+
+  size_t addAabb(
+    const Vector2 topLeft, const Vector2 bottomRight, const size_t capacity
+  ) {
+    queries.push_back({QueryType::aabb, topLeft, bottomRight, 0.0f, capacity});
+    return queries.size() - 1;
+  }
+
+  size_t addNearest(const Vector2 point, const size_t k) {
+    queries.push_back({QueryType::nearest, point, {0.0f, 0.0f}, 0.0f, k});
+    return queries.size() - 1;
+  }
+
+  size_t addRaycast(
+    const Vector2 origin, const Vector2 direction, const float maxDistance
+  ) {
+    queries.push_back(
+      {QueryType::raycast, origin, Vector2Normalize(direction), maxDistance, 0}
+    );
+    return queries.size() - 1;
+  }
+
+  // Indices found by query id, results[id].count or capacity of them,
+  // whichever is smaller
+  const uint32_t* getIndices(const size_t id) const {
+    return indices.data() + results[id].offset;
+  }
+
+  size_t getStoredCount(const size_t id) const {
+    size_t capacity = queries[id].capacity;
+    return results[id].count < capacity ? results[id].count : capacity;
+  }
+
+  QueryBuffer getBuffer(const size_t id) {
+    return QueryBuffer(indices.data() + results[id].offset, queries[id].capacity);
+  }
+
+  NearestHeap getHeap(const size_t id) {
+    return NearestHeap(
+      indices.data() + results[id].offset,
+      distancesSqr.data() + results[id].offset, queries[id].capacity
+    );
+  }
+
+  // Lay out the results and sort the queries by where they are
+  // getCell(point, &x, &y) gives the engine's cell coordinates of a point
+  template <typename GetCell>
+  void sort(GetCell getCell) {
+    results.assign(queries.size(), QueryResult());
+    size_t offset = 0;
+    for (size_t i = 0; i < queries.size(); i++) {
+      results[i].offset = offset;
+      offset += queries[i].capacity;
+    }
+    indices.resize(offset);
+    distancesSqr.resize(offset);
+
+    order.resize(queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+      uint32_t x;
+      uint32_t y;
+      getCell(queries[i].a, &x, &y);
+      order[i] = (getMortonCode(x, y) << 32) | i;
+    }
+    std::sort(order.begin(), order.end());
+  }
+
+  // Run runChunk(ids, count, scratch) over the sorted queries, one chunk per
+  // job, where ids are query ids in Morton order
+  template <typename RunChunk>
+  void run(JobPool& jobPool, RunChunk runChunk) {
+    size_t chunkCount = (order.size() + QUERY_CHUNK_SIZE - 1) / QUERY_CHUNK_SIZE;
+    if (chunkScratch.size() < chunkCount) chunkScratch.resize(chunkCount);
+    jobPool.parallelFor(
+      order.size(), QUERY_CHUNK_SIZE,
+      [&](size_t begin, size_t end) {
+        // Without workers the whole batch comes in as one job
+        uint32_t ids[QUERY_CHUNK_SIZE];
+        for (size_t chunk = begin; chunk < end; chunk += QUERY_CHUNK_SIZE) {
+          size_t chunkEnd = std::min(chunk + QUERY_CHUNK_SIZE, end);
+          // The low half of each key is the query id
+          for (size_t i = chunk; i < chunkEnd; i++) {
+            ids[i - chunk] = static_cast<uint32_t>(order[i]);
+          }
+          runChunk(ids, chunkEnd - chunk, chunkScratch[chunk / QUERY_CHUNK_SIZE]);
+        }
+      }
+    );
+  }
+};
+
+#endif
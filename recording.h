@@ -0,0 +1,448 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <math.h>
+#include <raylib.h>
+#include <raymath.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Recording of every Nth tick of a run, for scrubbing through it later
+//
+// PATH holds a RecordingHeader followed by frames. A frame is a
+// RecordingFrameHeader followed by one entry per circle:
+//   - circles that were already in the previous frame store the change in
+//     their quantized position since that frame
+//   - new circles (and every circle in a keyframe) store their radius, color
+//     and quantized position
+// Every number except colors is a zigzag varint, so circles that barely moved
+// take two bytes
+//
+// PATH.idx holds one RecordingIndexEntry per frame, so seeking to any frame
+// is one lookup plus at most RECORDING_KEYFRAME_INTERVAL frames to decode
+const char RECORDING_MAGIC[4] = {'C', 'R', 'E', 'C'};
+const uint32_t RECORDING_VERSION(1);
+
+// Positions are stored in 1/RECORDING_SCALE pixels
+const float RECORDING_SCALE(16.0f);
+const uint32_t RECORDING_KEYFRAME_INTERVAL(60);
+
+struct RecordingHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t recordEvery;
+  uint32_t keyframeInterval;
+};
+
+struct RecordingFrameHeader {
+  uint32_t tick;
+  uint32_t circleCount;
+  uint32_t isKeyframe;
+  uint32_t payloadBytes;
+};
+
+struct RecordingIndexEntry {
+  uint64_t offset;
+  uint32_t tick;
+  uint32_t keyframe;  // Frame to start decoding from
+};
+
+static std::string getRecordingIndexPath(const char* path) {
+  return std::string(path) + ".idx";
+}
+
+static void writeVarint(std::vector<unsigned char>& buffer, const int32_t value) {
+  uint32_t zigzag =
+    (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+  while (zigzag >= 0x80) {
+    buffer.push_back(static_cast<unsigned char>(zigzag | 0x80));
+    zigzag >>= 7;
+  }
+  buffer.push_back(static_cast<unsigned char>(zigzag));
+}
+
+static int32_t readVarint(const unsigned char*& cursor) {
+  uint32_t zigzag = 0;
+  int shift = 0;
+  while (*cursor & 0x80) {
+    zigzag |= static_cast<uint32_t>(*cursor & 0x7f) << shift;
+    shift += 7;
+    cursor++;
+  }
+  zigzag |= static_cast<uint32_t>(*cursor) << shift;
+  cursor++;
+  return static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+}
+
+// Appends frames to a recording
+// Call beginFrame(), addCircle() for every circle, then endFrame()
+struct Recorder {
+  FILE* file = nullptr;
+  FILE* indexFile = nullptr;
+  uint32_t recordEvery = 1;
+
+  uint32_t frameCount = 0;
+  uint32_t lastKeyframe = 0;
+  // Bytes written to file so far, which is where the next frame starts
+  // Counted instead of asking ftell(), whose long is 32 bits on Windows
+  uint64_t bytesWritten = 0;
+
+  // Quantized positions of the previous frame
+  std::vector<int32_t> previousX;
+  std::vector<int32_t> previousY;
+
+  // Set when circles were removed or moved to other slots since the last
+  // frame, so the next one has to be a keyframe
+  bool circlesMoved = false;
+
+  // Frame being built
+  RecordingFrameHeader frameHeader;
+  std::vector<unsigned char> payload;
+  size_t circleIndex = 0;
+
+  ~Recorder() { close(); }
+
+  bool isRecording() const { return file != nullptr; }
+
+  // Record every recordEvery-th tick into path
+  bool open(const char* path, const int _recordEvery) {
+    close();
+    file = fopen(path, "wb");
+    indexFile = fopen(getRecordingIndexPath(path).c_str(), "wb");
+    if (!file || !indexFile) {
+      fprintf(stderr, "Could not open %s for recording\n", path);
+      close();
+      return false;
+    }
+
+    recordEvery = (_recordEvery > 0) ? _recordEvery : 1;
+    RecordingHeader header;
+    memcpy(header.magic, RECORDING_MAGIC, sizeof(RECORDING_MAGIC));
+    header.version = RECORDING_VERSION;
+    header.recordEvery = recordEvery;
+    header.keyframeInterval = RECORDING_KEYFRAME_INTERVAL;
+    fwrite(&header, sizeof(header), 1, file);
+    bytesWritten = sizeof(header);
+
+    frameCount = 0;
+    previousX.clear();
+    previousY.clear();
+    return true;
+  }
+
+  void close() {
+    if (file) fclose(file);
+    if (indexFile) fclose(indexFile);
+    file = nullptr;
+    indexFile = nullptr;
+  }
+
+  // Whether this tick should be recorded
+  bool shouldRecord(const uint32_t tick) const {
+    return isRecording() && tick % recordEvery == 0;
+  }
+
+  void beginFrame(const uint32_t tick, const size_t circleCount) {
+    frameHeader.tick = tick;
+    frameHeader.circleCount = static_cast<uint32_t>(circleCount);
+    // Circles can't be matched with the previous frame if some were removed
+    frameHeader.isKeyframe =
+      frameCount % RECORDING_KEYFRAME_INTERVAL == 0 ||
+      circleCount < previousX.size() || circlesMoved;
+    circlesMoved = false;
+    if (frameHeader.isKeyframe) {
+      previousX.clear();
+      previousY.clear();
+    }
+    payload.clear();
+    circleIndex = 0;
+  }
+
+  // CircleT needs position, radius and color
+  template <typename CircleT>
+  void addCircle(const CircleT& circle) {
+    int32_t x = static_cast<int32_t>(lroundf(circle.position.x * RECORDING_SCALE));
+    int32_t y = static_cast<int32_t>(lroundf(circle.position.y * RECORDING_SCALE));
+
+    if (circleIndex < previousX.size()) {
+      writeVarint(payload, x - previousX[circleIndex]);
+      writeVarint(payload, y - previousY[circleIndex]);
+      previousX[circleIndex] = x;
+      previousY[circleIndex] = y;
+    } else {
+      writeVarint(payload, circle.radius);
+      payload.push_back(circle.color.r);
+      payload.push_back(circle.color.g);
+      payload.push_back(circle.color.b);
+      payload.push_back(circle.color.a);
+      writeVarint(payload, x);
+      writeVarint(payload, y);
+      previousX.push_back(x);
+      previousY.push_back(y);
+    }
+    circleIndex += 1;
+  }
+
+  void endFrame() {
+    RecordingIndexEntry entry;
+    entry.offset = bytesWritten;
+    entry.tick = frameHeader.tick;
+    if (frameHeader.isKeyframe) lastKeyframe = frameCount;
+    entry.keyframe = lastKeyframe;
+
+    frameHeader.payloadBytes = static_cast<uint32_t>(payload.size());
+    fwrite(&frameHeader, sizeof(frameHeader), 1, file);
+    fwrite(payload.data(), 1, payload.size(), file);
+    bytesWritten += sizeof(frameHeader) + payload.size();
+    fwrite(&entry, sizeof(entry), 1, indexFile);
+    frameCount += 1;
+  }
+};
+
+// Read-only view of a whole file, memory-mapped where possible
+struct MappedFile {
+  const unsigned char* data = nullptr;
+  size_t size = 0;
+
+#ifdef _WIN32
+  // windows.h clashes with raylib.h, so read the file in one go instead
+  std::vector<unsigned char> bytes;
+#endif
+
+  ~MappedFile() { close(); }
+
+  bool open(const char* path) {
+    close();
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    // Recordings can pass 2 GiB, which a 32-bit ftell() can't report
+    _fseeki64(file, 0, SEEK_END);
+    bytes.resize(_ftelli64(file));
+    _fseeki64(file, 0, SEEK_SET);
+    bool read = fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    fclose(file);
+    if (!read) return false;
+    data = bytes.data();
+    size = bytes.size();
+    return true;
+#else
+    int descriptor = ::open(path, O_RDONLY);
+    if (descriptor < 0) return false;
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+      ::close(descriptor);
+      return false;
+    }
+    void* mapping =
+      mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    ::close(descriptor);
+    if (mapping == MAP_FAILED) return false;
+    data = static_cast<const unsigned char*>(mapping);
+    size = status.st_size;
+    return true;
+#endif
+  }
+
+  void close() {
+#ifdef _WIN32
+    bytes.clear();
+#else
+    if (data) munmap(const_cast<unsigned char*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+  }
+};
+
+// Decodes frames of a recording
+struct Recording {
+  MappedFile file;
+  MappedFile index;
+
+  const RecordingHeader* header = nullptr;
+  const RecordingIndexEntry* entries = nullptr;
+  size_t frameCount = 0;
+
+  // State of currentFrame
+  int currentFrame = -1;
+  std::vector<int32_t> x;
+  std::vector<int32_t> y;
+  std::vector<int> radius;
+  std::vector<Color> color;
+
+  bool open(const char* path) {
+    if (!file.open(path) || !index.open(getRecordingIndexPath(path).c_str())) {
+      fprintf(stderr, "Could not open recording %s\n", path);
+      return false;
+    }
+    header = reinterpret_cast<const RecordingHeader*>(file.data);
+    if (file.size < sizeof(RecordingHeader) ||
+        memcmp(header->magic, RECORDING_MAGIC, sizeof(RECORDING_MAGIC)) != 0 ||
+        header->version != RECORDING_VERSION) {
+      fprintf(stderr, "%s is not a recording\n", path);
+      return false;
+    }
+
+    entries = reinterpret_cast<const RecordingIndexEntry*>(index.data);
+    frameCount = index.size / sizeof(RecordingIndexEntry);
+    // Drop frames that didn't make it to disk, whole or in part
+    while (frameCount > 0 && !isFrameOnDisk(frameCount - 1)) {
+      frameCount -= 1;
+    }
+    currentFrame = -1;
+    return frameCount > 0;
+  }
+
+  // Whether frame's header and payload both fit in the file
+  bool isFrameOnDisk(const size_t frame) const {
+    uint64_t offset = entries[frame].offset;
+    if (offset + sizeof(RecordingFrameHeader) > file.size) return false;
+    RecordingFrameHeader frameHeader;
+    memcpy(&frameHeader, file.data + offset, sizeof(frameHeader));
+    return offset + sizeof(RecordingFrameHeader) + frameHeader.payloadBytes <=
+           file.size;
+  }
+
+  uint32_t getTick(const size_t frame) const { return entries[frame].tick; }
+
+  // Decode frame on top of the state of the frame before it
+  void decode(const size_t frame) {
+    const unsigned char* cursor = file.data + entries[frame].offset;
+    RecordingFrameHeader frameHeader;
+    memcpy(&frameHeader, cursor, sizeof(frameHeader));
+    cursor += sizeof(frameHeader);
+
+    if (frameHeader.isKeyframe) {
+      x.clear();
+      y.clear();
+      radius.clear();
+      color.clear();
+    }
+
+    size_t knownCircles = x.size();
+    for (size_t i = 0; i < knownCircles; i++) {
+      x[i] += readVarint(cursor);
+      y[i] += readVarint(cursor);
+    }
+    for (size_t i = knownCircles; i < frameHeader.circleCount; i++) {
+      radius.push_back(readVarint(cursor));
+      color.push_back({cursor[0], cursor[1], cursor[2], cursor[3]});
+      cursor += 4;
+      x.push_back(readVarint(cursor));
+      y.push_back(readVarint(cursor));
+    }
+    currentFrame = static_cast<int>(frame);
+  }
+
+  // Decode any frame, starting from its keyframe unless it directly follows
+  // the current one
+  void seek(size_t frame) {
+    if (frameCount == 0) return;
+    if (frame >= frameCount) frame = frameCount - 1;
+    if (static_cast<int>(frame) == currentFrame) return;
+
+    size_t start = entries[frame].keyframe;
+    if (currentFrame >= static_cast<int>(start) &&
+        currentFrame < static_cast<int>(frame)) {
+      start = currentFrame + 1;
+    }
+    for (size_t i = start; i <= frame; i++) {
+      decode(i);
+    }
+  }
+
+  void draw() const {
+    for (size_t i = 0; i < x.size(); i++) {
+      DrawCircle(
+        x[i] / RECORDING_SCALE, y[i] / RECORDING_SCALE, radius[i], color[i]
+      );
+    }
+  }
+};
+
+// Show a recording in a window instead of running physics
+// Space plays/pauses, left/right step one frame, and clicking the bar at the
+// bottom seeks
+static int runPlayback(
+  const char* path, const int windowWidth, const int windowHeight,
+  const char* windowName, const int targetFps
+) {
+  Recording recording;
+  if (!recording.open(path)) return 1;
+  recording.seek(0);
+
+  const int barHeight = 10;
+  bool playing(true);
+  // Count display frames so playback runs at the recorded speed
+  uint32_t framesShown = 0;
+  char buffer[100];
+
+  InitWindow(windowWidth, windowHeight, windowName);
+  SetTargetFPS(targetFps);
+  while (!WindowShouldClose()) {
+    size_t frame = recording.currentFrame;
+    if (IsKeyPressed(KEY_SPACE)) playing = !playing;
+    if (IsKeyPressed(KEY_RIGHT) && frame + 1 < recording.frameCount) frame += 1;
+    if (IsKeyPressed(KEY_LEFT) && frame > 0) frame -= 1;
+    if (IsKeyPressed(KEY_HOME)) frame = 0;
+    if (IsKeyPressed(KEY_END)) frame = recording.frameCount - 1;
+
+    Vector2 mouse = GetMousePosition();
+    if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) &&
+        mouse.y >= windowHeight - barHeight * 2) {
+      frame = static_cast<size_t>(
+        Clamp(mouse.x / windowWidth, 0.0f, 1.0f) * (recording.frameCount - 1)
+      );
+    }
+
+    if (playing) {
+      framesShown += 1;
+      if (framesShown >= recording.header->recordEvery) {
+        framesShown = 0;
+        if (frame + 1 < recording.frameCount) frame += 1;
+      }
+    }
+    recording.seek(frame);
+
+    BeginDrawing();
+    ClearBackground(WHITE);
+    recording.draw();
+
+    sprintf(
+      buffer, "Frame %d/%zu (tick %u), %zu circles", recording.currentFrame + 1,
+      recording.frameCount, recording.getTick(recording.currentFrame),
+      recording.x.size()
+    );
+    DrawText(buffer, 10, 10, 20, BLACK);
+    DrawText(
+      "Space: play/pause, Left/Right: step, click the bar to seek.", 10, 30, 20,
+      BLACK
+    );
+
+    float progress =
+      (recording.frameCount > 1)
+        ? static_cast<float>(recording.currentFrame) / (recording.frameCount - 1)
+        : 1.0f;
+    DrawRectangle(0, windowHeight - barHeight, windowWidth, barHeight, LIGHTGRAY);
+    DrawRectangle(
+      0, windowHeight - barHeight, progress * windowWidth, barHeight, ORANGE
+    );
+    EndDrawing();
+  }
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <raylib.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "query.h"
+
+// Spatial reordering of circle storage, shared by unigrid.cpp and quadtree.cpp
+// Circles are stored in the order they spawned, so after a while circles that
+// touch sit far apart in memory and every pair test misses the cache. Every
+// reorder interval the circles are sorted by the Morton code of the cell they
+// are in, which puts circles in the same and neighbouring cells next to each
+// other. CollisionStats::pairDistance shows how far apart touching circles are
+const int DEFAULT_REORDER_INTERVAL(120);
+
+struct CircleReorder {
+  // (Morton code << 32 | index) of every circle, sorted
+  std::vector<uint64_t> order;
+  // Index each slot takes its circle from
+  std::vector<uint32_t> sources;
+
+  // Sort circles by the Morton code of getCell(position), which writes the
+  // cell's column and row to x and y
+  // Circles in the same cell keep their order
+  // Returns false if the circles were already in order and nothing moved
+  template <typename CircleT, typename GetCell>
+  bool sort(std::vector<CircleT>& circles, GetCell getCell) {
+    order.resize(circles.size());
+    for (size_t i = 0; i < circles.size(); i++) {
+      uint32_t x;
+      uint32_t y;
+      getCell(circles[i].position, &x, &y);
+      order[i] = (getMortonCode(x, y) << 32) | i;
+    }
+    std::sort(order.begin(), order.end());
+
+    size_t moved = 0;
+    sources.resize(circles.size());
+    for (size_t i = 0; i < circles.size(); i++) {
+      sources[i] = static_cast<uint32_t>(order[i]);
+      if (sources[i] != i) moved += 1;
+    }
+    if (moved == 0) return false;
+
+    // Follow each cycle of the permutation, so only one circle is held
+    // outside the vector at a time
+    for (size_t i = 0; i < circles.size(); i++) {
+      if (sources[i] == i) continue;
+      CircleT held = std::move(circles[i]);
+      size_t slot = i;
+      while (sources[slot] != i) {
+        size_t source = sources[slot];
+        circles[slot] = std::move(circles[source]);
+        sources[slot] = static_cast<uint32_t>(slot);
+        slot = source;
+      }
+      circles[slot] = std::move(held);
+      sources[slot] = static_cast<uint32_t>(slot);
+    }
+    return true;
+  }
+
+  size_t memoryUsage() const {
+    return order.capacity() * sizeof(uint64_t) +
+           sources.capacity() * sizeof(uint32_t);
+  }
+};
+
+#endif
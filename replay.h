@@ -0,0 +1,297 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "despawn.h"
+#include "picking.h"
+
+// Input log: which tick each input landed on, plus a checksum of every circle
+// after every tick
+// Replaying the inputs headlessly has to reproduce every checksum, so
+// comparing logs catches both behavior changes and nondeterminism
+//
+// Text format, one entry per line:
+//   input-log 1
+//   seed <seed>
+//   start <checksum of the scene before the first tick>
+//   spawn <tick>             Spawn key pressed before <tick> ran
+//   pause <tick>             Pause key pressed before <tick> ran
+//   despawn <tick> <x> <y>   Circles around the mouse at x, y despawned
+//                            before <tick> ran
+//   grab <tick> <x> <y>      Pick button pressed with the mouse at x, y
+//   mouse <tick> <x> <y>     Mouse moved to x, y while dragging a circle
+//   release <tick> <x> <y>   Dragged circle thrown with velocity x, y
+//   tick <tick> <checksum>   Checksum after <tick> ran
+// Inputs before the same tick are replayed in the order they were logged
+// Version 1 logs only have spawn and pause, and still replay
+const int INPUT_LOG_VERSION(2);
+
+enum class InputAction { spawn, pause, despawn, grab, mouse, release };
+const int INPUT_ACTION_COUNT(6);
+const char* const INPUT_ACTION_NAMES[INPUT_ACTION_COUNT] = {
+  "spawn", "pause", "despawn", "grab", "mouse", "release"};
+
+// Whether an action is logged with a point or velocity
+static bool hasInputPoint(const InputAction action) {
+  return action != InputAction::spawn && action != InputAction::pause;
+}
+
+struct InputEvent {
+  uint32_t tick;
+  InputAction action;
+  // Mouse position, or the throw velocity for release
+  float x = 0.0f;
+  float y = 0.0f;
+};
+
+struct TickChecksum {
+  uint32_t tick;
+  uint64_t checksum;
+};
+
+const uint64_t CHECKSUM_OFFSET_BASIS(14695981039346656037ULL);
+const uint64_t CHECKSUM_PRIME(1099511628211ULL);
+
+// FNV-1a over the bytes of value
+template <typename T>
+static uint64_t addToChecksum(uint64_t checksum, const T& value) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+  for (size_t i = 0; i < sizeof(T); i++) {
+    checksum = (checksum ^ bytes[i]) * CHECKSUM_PRIME;
+  }
+  return checksum;
+}
+
+// CircleT needs position, velocity, radius, mass, shape, category and mask
+template <typename CircleT>
+static uint64_t addCircleToChecksum(uint64_t checksum, const CircleT& circle) {
+  checksum = addToChecksum(checksum, circle.position.x);
+  checksum = addToChecksum(checksum, circle.position.y);
+  checksum = addToChecksum(checksum, circle.velocity.x);
+  checksum = addToChecksum(checksum, circle.velocity.y);
+  checksum = addToChecksum(checksum, circle.radius);
+  checksum = addToChecksum(checksum, circle.mass);
+  checksum = addToChecksum(checksum, circle.shape);
+  checksum = addToChecksum(checksum, circle.category);
+  checksum = addToChecksum(checksum, circle.mask);
+  return checksum;
+}
+
+struct InputLog {
+  // Set while recording
+  FILE* file = nullptr;
+
+  // Set by load()
+  uint64_t seed = 0;
+  uint64_t startChecksum = 0;
+  std::vector<InputEvent> events;
+  std::vector<TickChecksum> checksums;
+
+  ~InputLog() { close(); }
+
+  bool isRecording() const { return file != nullptr; }
+
+  bool openForRecording(
+    const char* path, const uint64_t _seed, const uint64_t _startChecksum
+  ) {
+    close();
+    file = fopen(path, "w");
+    if (!file) {
+      fprintf(stderr, "Could not open %s\n", path);
+      return false;
+    }
+    fprintf(file, "input-log %d\n", INPUT_LOG_VERSION);
+    fprintf(file, "seed %" PRIu64 "\n", _seed);
+    fprintf(file, "start %016" PRIx64 "\n", _startChecksum);
+    return true;
+  }
+
+  void close() {
+    if (file) fclose(file);
+    file = nullptr;
+  }
+
+  void recordEvent(
+    const uint32_t tick, const InputAction action, const float x = 0.0f,
+    const float y = 0.0f
+  ) {
+    if (!file) return;
+    const char* name = INPUT_ACTION_NAMES[static_cast<int>(action)];
+    if (hasInputPoint(action)) {
+      // 9 significant digits bring back the same float
+      fprintf(file, "%s %u %.9g %.9g\n", name, tick, x, y);
+    } else {
+      fprintf(file, "%s %u\n", name, tick);
+    }
+  }
+
+  void recordDespawn(const uint32_t tick, const Vector2 mouse) {
+    recordEvent(tick, InputAction::despawn, mouse.x, mouse.y);
+  }
+
+  void recordGrab(const uint32_t tick, const Vector2 mouse) {
+    recordEvent(tick, InputAction::grab, mouse.x, mouse.y);
+  }
+
+  void recordMouse(const uint32_t tick, const Vector2 mouse) {
+    recordEvent(tick, InputAction::mouse, mouse.x, mouse.y);
+  }
+
+  void recordRelease(const uint32_t tick, const Vector2 throwVelocity) {
+    recordEvent(tick, InputAction::release, throwVelocity.x, throwVelocity.y);
+  }
+
+  void recordChecksum(const uint32_t tick, const uint64_t checksum) {
+    if (!file) return;
+    fprintf(file, "tick %u %016" PRIx64 "\n", tick, checksum);
+  }
+
+  bool load(const char* path) {
+    FILE* logFile = fopen(path, "r");
+    if (!logFile) {
+      fprintf(stderr, "Could not open %s\n", path);
+      return false;
+    }
+
+    int version = 0;
+    bool loaded =
+      fscanf(logFile, "input-log %d seed %" SCNu64 " start %" SCNx64, &version,
+             &seed, &startChecksum) == 3 &&
+      version >= 1 && version <= INPUT_LOG_VERSION;
+
+    char entry[16];
+    while (loaded && fscanf(logFile, "%15s", entry) == 1) {
+      uint32_t tick;
+      int action = 0;
+      while (action < INPUT_ACTION_COUNT &&
+             strcmp(entry, INPUT_ACTION_NAMES[action]) != 0) {
+        action += 1;
+      }
+      if (fscanf(logFile, "%u", &tick) != 1) {
+        loaded = false;
+      } else if (action < INPUT_ACTION_COUNT) {
+        InputEvent event;
+        event.tick = tick;
+        event.action = static_cast<InputAction>(action);
+        if (hasInputPoint(event.action)) {
+          loaded = fscanf(logFile, "%f %f", &event.x, &event.y) == 2;
+        }
+        events.push_back(event);
+      } else if (strcmp(entry, "tick") == 0) {
+        TickChecksum checksum;
+        checksum.tick = tick;
+        loaded = fscanf(logFile, "%" SCNx64, &checksum.checksum) == 1;
+        checksums.push_back(checksum);
+      } else {
+        loaded = false;
+      }
+    }
+    fclose(logFile);
+
+    if (!loaded) fprintf(stderr, "%s is not an input log\n", path);
+    return loaded;
+  }
+
+  // Number of ticks a replay has to run
+  uint32_t getTickCount() const {
+    uint32_t tickCount = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+      if (events[i].tick + 1 > tickCount) tickCount = events[i].tick + 1;
+    }
+    for (size_t i = 0; i < checksums.size(); i++) {
+      if (checksums[i].tick + 1 > tickCount) tickCount = checksums[i].tick + 1;
+    }
+    return tickCount;
+  }
+};
+
+// Feed a loaded log's inputs to a freshly set up simulation and check every
+// checksum
+// Simulation needs tick, handleSpawnKeyPress(), despawnInAabb(), step(),
+// checksum() and what Drag needs, see picking.h
+// Returns the exit code: 0 if every checksum matched
+template <typename Simulation>
+static int runReplay(Simulation& simulation, const InputLog& log) {
+  if (simulation.checksum() != log.startChecksum) {
+    fprintf(
+      stderr,
+      "The scene doesn't match the log before the first tick; pass the same "
+      "--presses, --circles and --load options used when recording\n"
+    );
+    return 1;
+  }
+
+  uint32_t tickCount = log.getTickCount();
+  size_t nextEvent = 0;
+  size_t nextChecksum = 0;
+  Drag drag;
+  while (simulation.tick < tickCount) {
+    while (nextEvent < log.events.size() &&
+           log.events[nextEvent].tick <= simulation.tick) {
+      const InputEvent& event = log.events[nextEvent];
+      Vector2 point = {event.x, event.y};
+      switch (event.action) {
+        case InputAction::spawn:
+          simulation.handleSpawnKeyPress();
+          break;
+        case InputAction::despawn:
+          simulation.despawnInAabb(
+            Vector2SubtractValue(point, DESPAWN_HALF_WIDTH),
+            Vector2AddValue(point, DESPAWN_HALF_WIDTH)
+          );
+          break;
+        case InputAction::grab:
+          drag.mouse = point;
+          drag.pick(simulation, point);
+          break;
+        case InputAction::mouse:
+          drag.mouse = point;
+          break;
+        case InputAction::release:
+          drag.throwVelocity = point;
+          drag.release(simulation);
+          break;
+        default:
+          // Pausing only stops ticks from running, which the log already
+          // reflects
+          break;
+      }
+      nextEvent += 1;
+    }
+
+    drag.steer(simulation);
+    simulation.step();
+
+    uint32_t tick = simulation.tick - 1;
+    while (nextChecksum < log.checksums.size() &&
+           log.checksums[nextChecksum].tick <= tick) {
+      const TickChecksum& expected = log.checksums[nextChecksum];
+      uint64_t checksum = simulation.checksum();
+      if (expected.tick == tick && expected.checksum != checksum) {
+        printf(
+          "Checksum mismatch after tick %u: expected %016" PRIx64
+          ", got %016" PRIx64 "\n",
+          tick, expected.checksum, checksum
+        );
+        return 1;
+      }
+      nextChecksum += 1;
+    }
+  }
+
+  printf(
+    "Replayed %u ticks, %zu inputs, all %zu checksums match\n", tickCount,
+    log.events.size(), log.checksums.size()
+  );
+  return 0;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+const uint64_t DEFAULT_SEED(42);
+
+// PCG32 random number generator
+// https://www.pcg-random.org/download.html
+// Generators with the same seed but different streams give independent
+// sequences, so each parallel job can own one without locking
+struct Rng {
+  uint64_t state = 0;
+  uint64_t increment = 1;
+
+  Rng(const uint64_t seed = DEFAULT_SEED, const uint64_t stream = 0) {
+    increment = (stream << 1u) | 1u;
+    next();
+    state += seed;
+    next();
+  }
+
+  // Returns a random number within [0, 2^32)
+  uint32_t next() {
+    uint64_t oldState = state;
+    state = oldState * 6364136223846793005ULL + increment;
+    uint32_t xorShifted = static_cast<uint32_t>(((oldState >> 18u) ^ oldState) >> 27u);
+    uint32_t rotation = static_cast<uint32_t>(oldState >> 59u);
+    return (xorShifted >> rotation) | (xorShifted << ((-rotation) & 31));
+  }
+
+  // Returns a random int within [0, bound)
+  int nextInt(const int bound) {
+    return static_cast<int>((static_cast<uint64_t>(next()) * bound) >> 32);
+  }
+
+  // Returns a random float within [0, 1]
+  float nextFloat() { return next() * (1.0f / 4294967295.0f); }
+};
+
+#endif
@@ -0,0 +1,518 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+#include <stdint.h>
+
+// Boxes and capsules shared by main.cpp, unigrid.cpp and quadtree.cpp
+// Every body is still a Circle, and its radius is that of a circle around the
+// whole shape, so whatever only needs a bound (recordings) treats a box or
+// capsule as that circle. Queries and picking test the shape itself, see
+// query.h. The broadphases file bodies by getShapeHalfSize(), the shape's own
+// AABB, and the narrowphase looks up the test for a pair in a table indexed by
+// both shape types. Pairs of circles never reach the table, they keep the
+// inline distance test and the swept test of ccd.h, so a scene of only
+// circles runs the same code it always did
+// Boxes are axis aligned, capsules are a segment with rounded ends and can
+// point any way. Neither rotates
+enum class ShapeType : uint8_t { circle, box, capsule };
+const int SHAPE_TYPE_COUNT(3);
+
+// Walls and paddles weigh this much, so contacts push whatever hits them and
+// leave them moving as they were
+const int IMMOVABLE_MASS(1 << 30);
+
+// Below this, a length is treated as zero
+const float SHAPE_EPSILON(1e-6f);
+
+struct ShapeContact {
+  Vector2 normal;  // Unit length, from a to b
+  float penetration;
+};
+
+// True if neither body is a box or capsule
+// CircleT needs shape
+template <typename CircleT>
+static bool isCirclePair(const CircleT& a, const CircleT& b) {
+  return (static_cast<uint8_t>(a.shape) | static_cast<uint8_t>(b.shape)) == 0;
+}
+
+// Half the width and height of the body's AABB
+// CircleT needs shape, radius, halfExtents, halfAxis and capsuleRadius
+template <typename CircleT>
+static Vector2 getShapeHalfSize(const CircleT& body) {
+  switch (body.shape) {
+    case ShapeType::box:
+      return body.halfExtents;
+    case ShapeType::capsule:
+      return {
+        fabsf(body.halfAxis.x) + body.capsuleRadius,
+        fabsf(body.halfAxis.y) + body.capsuleRadius};
+    default:
+      return {static_cast<float>(body.radius), static_cast<float>(body.radius)};
+  }
+}
+
+// Point of the segment from start to end nearest to point
+static Vector2 closestPointOnSegment(
+  const Vector2 point, const Vector2 start, const Vector2 end
+) {
+  Vector2 direction = Vector2Subtract(end, start);
+  float lengthSqr = Vector2DotProduct(direction, direction);
+  if (lengthSqr <= SHAPE_EPSILON) return start;
+  float t = Vector2DotProduct(Vector2Subtract(point, start), direction) /
+            lengthSqr;
+  return Vector2Add(start, Vector2Scale(direction, Clamp(t, 0.0f, 1.0f)));
+}
+
+// Nearest points of two segments, from Real-Time Collision Detection 5.1.9
+static void closestPointsOnSegments(
+  const Vector2 startA, const Vector2 endA, const Vector2 startB,
+  const Vector2 endB, Vector2* onA, Vector2* onB
+) {
+  Vector2 directionA = Vector2Subtract(endA, startA);
+  Vector2 directionB = Vector2Subtract(endB, startB);
+  Vector2 offset = Vector2Subtract(startA, startB);
+  float lengthSqrA = Vector2DotProduct(directionA, directionA);
+  float lengthSqrB = Vector2DotProduct(directionB, directionB);
+  float f = Vector2DotProduct(directionB, offset);
+
+  float s = 0.0f;
+  float t = 0.0f;
+  if (lengthSqrA <= SHAPE_EPSILON && lengthSqrB > SHAPE_EPSILON) {
+    t = Clamp(f / lengthSqrB, 0.0f, 1.0f);
+  } else if (lengthSqrA > SHAPE_EPSILON) {
+    float c = Vector2DotProduct(directionA, offset);
+    if (lengthSqrB <= SHAPE_EPSILON) {
+      s = Clamp(-c / lengthSqrA, 0.0f, 1.0f);
+    } else {
+      float b = Vector2DotProduct(directionA, directionB);
+      float denominator = lengthSqrA * lengthSqrB - b * b;
+      // Parallel segments take any pair of nearest points, starting from a's
+      // start
+      if (denominator > SHAPE_EPSILON) {
+        s = Clamp((b * f - c * lengthSqrB) / denominator, 0.0f, 1.0f);
+      }
+      t = (b * s + f) / lengthSqrB;
+      if (t < 0.0f) {
+        t = 0.0f;
+        s = Clamp(-c / lengthSqrA, 0.0f, 1.0f);
+      } else if (t > 1.0f) {
+        t = 1.0f;
+        s = Clamp((b - c) / lengthSqrA, 0.0f, 1.0f);
+      }
+    }
+  }
+  *onA = Vector2Add(startA, Vector2Scale(directionA, s));
+  *onB = Vector2Add(startB, Vector2Scale(directionB, t));
+}
+
+// Point of the box nearest to point, which is point itself if it is inside
+static Vector2 clampToBox(
+  const Vector2 point, const Vector2 center, const Vector2 halfExtents
+) {
+  return {
+    Clamp(point.x, center.x - halfExtents.x, center.x + halfExtents.x),
+    Clamp(point.y, center.y - halfExtents.y, center.y + halfExtents.y)};
+}
+
+// Part of the segment from start to end inside the box, as fractions of the
+// segment (Liang-Barsky)
+// Returns false if the segment misses the box
+static bool clipSegmentToBox(
+  const Vector2 start, const Vector2 end, const Vector2 center,
+  const Vector2 halfExtents, float* enter, float* exit
+) {
+  float starts[2] = {start.x - center.x, start.y - center.y};
+  float directions[2] = {end.x - start.x, end.y - start.y};
+  float extents[2] = {halfExtents.x, halfExtents.y};
+  *enter = 0.0f;
+  *exit = 1.0f;
+  for (int axis = 0; axis < 2; axis++) {
+    if (fabsf(directions[axis]) <= SHAPE_EPSILON) {
+      if (fabsf(starts[axis]) > extents[axis]) return false;
+      continue;
+    }
+    float low = (-extents[axis] - starts[axis]) / directions[axis];
+    float high = (extents[axis] - starts[axis]) / directions[axis];
+    if (low > high) {
+      float swap = low;
+      low = high;
+      high = swap;
+    }
+    *enter = fmaxf(*enter, low);
+    *exit = fminf(*exit, high);
+    if (*enter > *exit) return false;
+  }
+  return true;
+}
+
+// Point of the segment from start to end nearest to a box it misses
+// Two convex polygons come nearest at a corner of one of them, so only the
+// segment's ends and the points nearest to the box's corners are tried
+static Vector2 closestSegmentPointToBox(
+  const Vector2 start, const Vector2 end, const Vector2 center,
+  const Vector2 halfExtents
+) {
+  Vector2 candidates[6] = {start, end};
+  for (int i = 0; i < 4; i++) {
+    Vector2 corner = {
+      center.x + ((i & 1) ? halfExtents.x : -halfExtents.x),
+      center.y + ((i & 2) ? halfExtents.y : -halfExtents.y)};
+    candidates[2 + i] = closestPointOnSegment(corner, start, end);
+  }
+  Vector2 best = start;
+  float bestDistanceSqr = INFINITY;
+  for (int i = 0; i < 6; i++) {
+    float distanceSqr = Vector2DistanceSqr(
+      candidates[i], clampToBox(candidates[i], center, halfExtents)
+    );
+    if (distanceSqr < bestDistanceSqr) {
+      best = candidates[i];
+      bestDistanceSqr = distanceSqr;
+    }
+  }
+  return best;
+}
+
+// Half the length of a box grown along a segment, projected on axis
+static float getProjectedExtent(
+  const Vector2 halfExtents, const Vector2 halfAxis, const Vector2 axis
+) {
+  return fabsf(axis.x) * halfExtents.x + fabsf(axis.y) * halfExtents.y +
+         fabsf(Vector2DotProduct(halfAxis, axis));
+}
+
+// Push apart two overlapping shapes, each a box grown along a segment and
+// then by part of radius, along the axis they overlap least on
+// offset goes from a's center to b's. Boxes have a zero halfAxis and capsules
+// zero halfExtents
+// Used when a capsule's segment crosses the other shape, where nearest
+// points say nothing about which way is out. The box's sides and the
+// segments' normals are the only axes two such shapes can be separated on
+static void separateAlongLeastOverlap(
+  const Vector2 offset, const Vector2 halfExtentsA, const Vector2 halfAxisA,
+  const Vector2 halfExtentsB, const Vector2 halfAxisB, const float radius,
+  ShapeContact* contact
+) {
+  Vector2 axes[4] = {{1.0f, 0.0f}, {0.0f, 1.0f}};
+  int axisCount = 2;
+  const Vector2 halfAxes[2] = {halfAxisA, halfAxisB};
+  for (int i = 0; i < 2; i++) {
+    float length = Vector2Length(halfAxes[i]);
+    if (length <= SHAPE_EPSILON) continue;
+    axes[axisCount++] = {-halfAxes[i].y / length, halfAxes[i].x / length};
+  }
+
+  contact->penetration = INFINITY;
+  for (int i = 0; i < axisCount; i++) {
+    float distance = Vector2DotProduct(offset, axes[i]);
+    float overlap = getProjectedExtent(halfExtentsA, halfAxisA, axes[i]) +
+                    getProjectedExtent(halfExtentsB, halfAxisB, axes[i]) +
+                    radius - fabsf(distance);
+    if (overlap < contact->penetration) {
+      contact->penetration = overlap;
+      contact->normal = (distance < 0.0f) ? Vector2Negate(axes[i]) : axes[i];
+    }
+  }
+}
+
+// Two circles given by center and radius
+// Circles on top of each other get pushed along x
+static bool collideCircleWithCircle(
+  const Vector2 centerA, const float radiusA, const Vector2 centerB,
+  const float radiusB, ShapeContact* contact
+) {
+  Vector2 offset = Vector2Subtract(centerB, centerA);
+  float distanceSqr = Vector2DotProduct(offset, offset);
+  float sumOfRadii = radiusA + radiusB;
+  if (distanceSqr > sumOfRadii * sumOfRadii) return false;
+  float distance = sqrtf(distanceSqr);
+  contact->normal = (distance > SHAPE_EPSILON)
+                      ? Vector2Scale(offset, 1.0f / distance)
+                      : Vector2{1.0f, 0.0f};
+  contact->penetration = sumOfRadii - distance;
+  return true;
+}
+
+// A circle and a box, with the normal from the circle to the box
+// A circle whose center is inside the box is pushed out of the nearest face
+static bool collideCircleWithBox(
+  const Vector2 circleCenter, const float radius, const Vector2 boxCenter,
+  const Vector2 halfExtents, ShapeContact* contact
+) {
+  Vector2 closest = clampToBox(circleCenter, boxCenter, halfExtents);
+  Vector2 outward = Vector2Subtract(circleCenter, closest);
+  float distanceSqr = Vector2DotProduct(outward, outward);
+  if (distanceSqr > SHAPE_EPSILON) {
+    if (distanceSqr > radius * radius) return false;
+    float distance = sqrtf(distanceSqr);
+    contact->normal = Vector2Scale(outward, -1.0f / distance);
+    contact->penetration = radius - distance;
+    return true;
+  }
+
+  Vector2 local = Vector2Subtract(circleCenter, boxCenter);
+  float toFaceX = halfExtents.x - fabsf(local.x);
+  float toFaceY = halfExtents.y - fabsf(local.y);
+  if (toFaceX < toFaceY) {
+    contact->normal = {(local.x < 0.0f) ? 1.0f : -1.0f, 0.0f};
+    contact->penetration = toFaceX + radius;
+  } else {
+    contact->normal = {0.0f, (local.y < 0.0f) ? 1.0f : -1.0f};
+    contact->penetration = toFaceY + radius;
+  }
+  return true;
+}
+
+// Two boxes, pushed apart along the axis they overlap least on
+static bool collideBoxWithBox(
+  const Vector2 centerA, const Vector2 halfExtentsA, const Vector2 centerB,
+  const Vector2 halfExtentsB, ShapeContact* contact
+) {
+  Vector2 offset = Vector2Subtract(centerB, centerA);
+  float overlapX = halfExtentsA.x + halfExtentsB.x - fabsf(offset.x);
+  if (overlapX < 0.0f) return false;
+  float overlapY = halfExtentsA.y + halfExtentsB.y - fabsf(offset.y);
+  if (overlapY < 0.0f) return false;
+  if (overlapX < overlapY) {
+    contact->normal = {(offset.x < 0.0f) ? -1.0f : 1.0f, 0.0f};
+    contact->penetration = overlapX;
+  } else {
+    contact->normal = {0.0f, (offset.y < 0.0f) ? -1.0f : 1.0f};
+    contact->penetration = overlapY;
+  }
+  return true;
+}
+
+// Ends of a capsule's segment
+// CircleT needs position and halfAxis
+template <typename CircleT>
+static void getCapsuleSegment(const CircleT& body, Vector2* start, Vector2* end) {
+  *start = Vector2Subtract(body.position, body.halfAxis);
+  *end = Vector2Add(body.position, body.halfAxis);
+}
+
+// Narrowphase tests for each pair of shapes, lower ShapeType first
+// Bodies need shape, position, radius, halfExtents, halfAxis and
+// capsuleRadius
+
+template <typename BodyA, typename BodyB>
+static bool collideCircleCircle(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  return collideCircleWithCircle(
+    a.position, a.radius, b.position, b.radius, contact
+  );
+}
+
+template <typename BodyA, typename BodyB>
+static bool collideCircleBox(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  return collideCircleWithBox(
+    a.position, a.radius, b.position, b.halfExtents, contact
+  );
+}
+
+template <typename BodyA, typename BodyB>
+static bool collideCircleCapsule(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  Vector2 start;
+  Vector2 end;
+  getCapsuleSegment(b, &start, &end);
+  return collideCircleWithCircle(
+    a.position, a.radius, closestPointOnSegment(a.position, start, end),
+    b.capsuleRadius, contact
+  );
+}
+
+template <typename BodyA, typename BodyB>
+static bool collideBoxBox(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  return collideBoxWithBox(
+    a.position, a.halfExtents, b.position, b.halfExtents, contact
+  );
+}
+
+// The capsule is the circle of its radius at the segment point nearest to
+// the box
+template <typename BodyA, typename BodyB>
+static bool collideBoxCapsule(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  Vector2 start;
+  Vector2 end;
+  getCapsuleSegment(b, &start, &end);
+  float enter;
+  float exit;
+  if (clipSegmentToBox(start, end, a.position, a.halfExtents, &enter, &exit)) {
+    separateAlongLeastOverlap(
+      Vector2Subtract(b.position, a.position), a.halfExtents, {0.0f, 0.0f},
+      {0.0f, 0.0f}, b.halfAxis, b.capsuleRadius, contact
+    );
+    return true;
+  }
+  Vector2 nearest =
+    closestSegmentPointToBox(start, end, a.position, a.halfExtents);
+  if (!collideCircleWithBox(
+        nearest, b.capsuleRadius, a.position, a.halfExtents, contact
+      )) {
+    return false;
+  }
+  contact->normal = Vector2Negate(contact->normal);
+  return true;
+}
+
+template <typename BodyA, typename BodyB>
+static bool collideCapsuleCapsule(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  Vector2 startA;
+  Vector2 endA;
+  Vector2 startB;
+  Vector2 endB;
+  getCapsuleSegment(a, &startA, &endA);
+  getCapsuleSegment(b, &startB, &endB);
+  Vector2 onA;
+  Vector2 onB;
+  closestPointsOnSegments(startA, endA, startB, endB, &onA, &onB);
+  if (Vector2DistanceSqr(onA, onB) <= SHAPE_EPSILON) {
+    // The segments cross
+    separateAlongLeastOverlap(
+      Vector2Subtract(b.position, a.position), {0.0f, 0.0f}, a.halfAxis,
+      {0.0f, 0.0f}, b.halfAxis, a.capsuleRadius + b.capsuleRadius, contact
+    );
+    return true;
+  }
+  return collideCircleWithCircle(
+    onA, a.capsuleRadius, onB, b.capsuleRadius, contact
+  );
+}
+
+// The test of (b, a), with the normal turned around so it goes from a to b
+template <
+  typename BodyA, typename BodyB,
+  bool (*Collide)(const BodyB&, const BodyA&, ShapeContact*)>
+static bool collideSwapped(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  if (!Collide(b, a, contact)) return false;
+  contact->normal = Vector2Negate(contact->normal);
+  return true;
+}
+
+template <typename BodyA, typename BodyB>
+struct ShapeDispatch {
+  typedef bool (*Collide)(const BodyA&, const BodyB&, ShapeContact*);
+  // [a.shape][b.shape]
+  static const Collide table[SHAPE_TYPE_COUNT][SHAPE_TYPE_COUNT];
+};
+
+template <typename BodyA, typename BodyB>
+const typename ShapeDispatch<BodyA, BodyB>::Collide
+  ShapeDispatch<BodyA, BodyB>::table[SHAPE_TYPE_COUNT][SHAPE_TYPE_COUNT] = {
+    {collideCircleCircle<BodyA, BodyB>, collideCircleBox<BodyA, BodyB>,
+     collideCircleCapsule<BodyA, BodyB>},
+    {collideSwapped<BodyA, BodyB, collideCircleBox<BodyB, BodyA>>,
+     collideBoxBox<BodyA, BodyB>, collideBoxCapsule<BodyA, BodyB>},
+    {collideSwapped<BodyA, BodyB, collideCircleCapsule<BodyB, BodyA>>,
+     collideSwapped<BodyA, BodyB, collideBoxCapsule<BodyB, BodyA>>,
+     collideCapsuleCapsule<BodyA, BodyB>},
+};
+
+// Returns true, and fills in contact, if a and b overlap
+// a and b can be different types, like a circle and a static obstacle
+template <typename BodyA, typename BodyB>
+static bool collideShapes(
+  const BodyA& a, const BodyB& b, ShapeContact* contact
+) {
+  return ShapeDispatch<BodyA, BodyB>::table[static_cast<int>(a.shape)]
+                                           [static_cast<int>(b.shape)](
+    a, b, contact
+  );
+}
+
+// How far a and b overlap, negative if they are apart
+// Only pairs of circles say how far apart they are, for the rest it is 0
+template <typename CircleT>
+static float getShapePenetration(const CircleT& a, const CircleT& b) {
+  if (isCirclePair(a, b)) {
+    return a.radius + b.radius - Vector2Distance(a.position, b.position);
+  }
+  ShapeContact contact;
+  return collideShapes(a, b, &contact) ? contact.penetration : 0.0f;
+}
+
+// Turn body into a box or capsule centered at center
+// Its radius becomes that of a circle around the whole shape
+template <typename CircleT>
+static void makeBox(CircleT& body, const Vector2 center, const Vector2 halfExtents) {
+  body.shape = ShapeType::box;
+  body.halfExtents = halfExtents;
+  body.radius = static_cast<int>(ceilf(Vector2Length(halfExtents)));
+  body.setPosition(center);
+}
+
+template <typename CircleT>
+static void makeCapsule(
+  CircleT& body, const Vector2 center, const Vector2 halfAxis,
+  const float radius
+) {
+  body.shape = ShapeType::capsule;
+  body.halfAxis = halfAxis;
+  body.capsuleRadius = radius;
+  body.radius = static_cast<int>(ceilf(Vector2Length(halfAxis) + radius));
+  body.setPosition(center);
+}
+
+template <typename CircleT>
+static void drawShape(const CircleT& body, const Color color) {
+  switch (body.shape) {
+    case ShapeType::box:
+      DrawRectangleV(
+        Vector2Subtract(body.position, body.halfExtents),
+        Vector2Scale(body.halfExtents, 2.0f), color
+      );
+      break;
+    case ShapeType::capsule: {
+      Vector2 start;
+      Vector2 end;
+      getCapsuleSegment(body, &start, &end);
+      // Segments without thickness still show as a hairline
+      DrawLineEx(start, end, fmaxf(body.capsuleRadius * 2.0f, 1.0f), color);
+      DrawCircleV(start, body.capsuleRadius, color);
+      DrawCircleV(end, body.capsuleRadius, color);
+      break;
+    }
+    default:
+      DrawCircle(body.position.x, body.position.y, body.radius, color);
+  }
+}
+
+// Walls and a paddle for --walls: two slanted capsules, a pillar, and a
+// paddle sliding along the bottom of a width by height screen
+// SimulationT needs addBox() and addCapsule()
+template <typename SimulationT>
+static void addWalls(SimulationT& simulation, const float width, const float height) {
+  simulation.addCapsule(
+    {width * 0.25f, height * 0.45f}, {width * 0.1f, height * 0.06f}, 8.0f,
+    {0.0f, 0.0f}
+  );
+  simulation.addCapsule(
+    {width * 0.75f, height * 0.45f}, {width * 0.1f, -height * 0.06f}, 8.0f,
+    {0.0f, 0.0f}
+  );
+  simulation.addBox(
+    {width * 0.5f, height * 0.25f}, {20.0f, height * 0.1f}, {0.0f, 0.0f}
+  );
+  simulation.addBox(
+    {width * 0.5f, height * 0.85f}, {width * 0.08f, 10.0f}, {150.0f, 0.0f}
+  );
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef SLEEP_H
+#define SLEEP_H
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+// Circles that stayed still for TICKS_UNTIL_SLEEP ticks can fall asleep
+// Sleeping circles are not moved, not reinserted into the grid/quadtree and
+// not collision-tested against each other until an awake circle hits them
+const int TICKS_UNTIL_SLEEP(30);
+// How often touching resting circles are grouped into islands
+const int SLEEP_CHECK_INTERVAL(15);
+
+// Decides which circles sleep
+// Touching circles form an island (union-find), and an island only falls
+// asleep once every circle in it has rested long enough
+struct SleepSystem {
+  // Indices of circles that touched this tick
+  std::vector<std::pair<uint32_t, uint32_t>> touchingPairs;
+  // Indices of sleeping circles that were hit this tick
+  std::vector<uint32_t> wokenCircles;
+
+  std::vector<uint32_t> parent;
+  std::vector<char> islandCanSleep;
+
+  void beginTick() {
+    touchingPairs.clear();
+    wokenCircles.clear();
+  }
+
+  void addTouchingPair(const uint32_t a, const uint32_t b) {
+    touchingPairs.push_back(std::make_pair(a, b));
+  }
+
+  void wake(const uint32_t circle) { wokenCircles.push_back(circle); }
+
+  uint32_t findIsland(uint32_t circle) {
+    while (parent[circle] != circle) {
+      parent[circle] = parent[parent[circle]];
+      circle = parent[circle];
+    }
+    return circle;
+  }
+
+  // Wake sleeping circles in contacts that pushed or bounced them this tick
+  // ContactT needs a, b, impulse and bounceImpulse
+  template <typename ContactT, typename GetCircle>
+  void wakePushedCircles(
+    const std::vector<ContactT>& contacts, GetCircle getCircle
+  ) {
+    for (size_t i = 0; i < contacts.size(); i++) {
+      if (contacts[i].impulse <= 0.0f && contacts[i].bounceImpulse <= 0.0f) {
+        continue;
+      }
+      if (getCircle(contacts[i].a).sleeping) wake(contacts[i].a);
+      if (getCircle(contacts[i].b).sleeping) wake(contacts[i].b);
+    }
+  }
+
+  // Wake every circle that was hit this tick
+  // getCircle(i) returns the circle with index i
+  // Returns the number of circles that woke up
+  template <typename GetCircle>
+  size_t wakeHitCircles(GetCircle getCircle) {
+    size_t woken = 0;
+    for (size_t i = 0; i < wokenCircles.size(); i++) {
+      auto& circle = getCircle(wokenCircles[i]);
+      if (!circle.sleeping) continue;
+      circle.sleeping = false;
+      circle.restingTicks = 0;
+      woken += 1;
+    }
+    return woken;
+  }
+
+  // Put every island whose circles have all rested long enough to sleep
+  // Returns the number of circles that fell asleep
+  template <typename GetCircle>
+  size_t putRestingIslandsToSleep(const size_t circleCount, GetCircle getCircle) {
+    parent.resize(circleCount);
+    for (size_t i = 0; i < circleCount; i++) {
+      parent[i] = static_cast<uint32_t>(i);
+    }
+    for (size_t i = 0; i < touchingPairs.size(); i++) {
+      uint32_t a = findIsland(touchingPairs[i].first);
+      uint32_t b = findIsland(touchingPairs[i].second);
+      if (a != b) parent[a] = b;
+    }
+
+    islandCanSleep.assign(circleCount, 1);
+    for (size_t i = 0; i < circleCount; i++) {
+      auto& circle = getCircle(i);
+      if (!circle.sleeping && circle.restingTicks < TICKS_UNTIL_SLEEP) {
+        islandCanSleep[findIsland(i)] = 0;
+      }
+    }
+
+    size_t fellAsleep = 0;
+    for (size_t i = 0; i < circleCount; i++) {
+      auto& circle = getCircle(i);
+      if (!circle.sleeping && islandCanSleep[findIsland(i)]) {
+        circle.sleeping = true;
+        fellAsleep += 1;
+      }
+    }
+    return fellAsleep;
+  }
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <raylib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "rng.h"
+#include "shape.h"
+
+// Binary snapshot of a simulation, loadable by main.cpp, unigrid.cpp and
+// quadtree.cpp
+// Layout (native byte order): SnapshotHeader, then one packed array per circle
+// field, each circleCount long, then one per cached contact field, each
+// contactCount long, in the order of the pointers in Snapshot
+const char SNAPSHOT_MAGIC[4] = {'C', 'S', 'N', 'P'};
+const uint32_t SNAPSHOT_VERSION(4);
+const char* const DEFAULT_SNAPSHOT_PATH("snapshot.bin");
+
+struct SnapshotHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t circleCount;
+  uint32_t numberOfSpawnKeyPresses;
+  uint32_t tick;
+  uint32_t contactCount;
+  uint64_t rngState;
+  uint64_t rngIncrement;
+};
+
+// Bytes taken by one circle across all arrays
+const size_t SNAPSHOT_BYTES_PER_CIRCLE(
+  9 * sizeof(float) + 4 * sizeof(int32_t) + 4 * sizeof(uint32_t)
+);
+// Bytes taken by one cached contact across all arrays
+const size_t SNAPSHOT_BYTES_PER_CONTACT(2 * sizeof(uint32_t) + sizeof(float));
+
+struct Snapshot {
+  // The whole file
+  std::vector<unsigned char> bytes;
+
+  // Point into bytes
+  SnapshotHeader* header = nullptr;
+  float* positionX = nullptr;
+  float* positionY = nullptr;
+  float* velocityX = nullptr;
+  float* velocityY = nullptr;
+  int32_t* radius = nullptr;
+  int32_t* mass = nullptr;
+  uint32_t* color = nullptr;  // RGBA, one byte each
+  int32_t* restingTicks = nullptr;
+  int32_t* sleeping = nullptr;  // 0 or 1
+  uint32_t* shape = nullptr;  // ShapeType
+  uint32_t* category = nullptr;
+  uint32_t* mask = nullptr;
+  float* halfExtentsX = nullptr;
+  float* halfExtentsY = nullptr;
+  float* halfAxisX = nullptr;
+  float* halfAxisY = nullptr;
+  float* capsuleRadius = nullptr;
+  uint32_t* contactA = nullptr;
+  uint32_t* contactB = nullptr;
+  float* contactImpulse = nullptr;
+
+  size_t circleCount() const { return header ? header->circleCount : 0; }
+  size_t contactCount() const { return header ? header->contactCount : 0; }
+
+  // Make room for circleCount circles and contactCount cached contacts, and
+  // fill in the header
+  void allocate(
+    const size_t circleCount, const size_t contactCount,
+    const int numberOfSpawnKeyPresses, const uint32_t tick, const Rng& rng
+  ) {
+    bytes.assign(
+      sizeof(SnapshotHeader) + circleCount * SNAPSHOT_BYTES_PER_CIRCLE +
+        contactCount * SNAPSHOT_BYTES_PER_CONTACT,
+      0
+    );
+    pointIntoBytes(circleCount, contactCount);
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header->version = SNAPSHOT_VERSION;
+    header->circleCount = static_cast<uint32_t>(circleCount);
+    header->contactCount = static_cast<uint32_t>(contactCount);
+    header->numberOfSpawnKeyPresses = numberOfSpawnKeyPresses;
+    header->tick = tick;
+    header->rngState = rng.state;
+    header->rngIncrement = rng.increment;
+  }
+
+  void pointIntoBytes(const size_t circleCount, const size_t contactCount) {
+    header = reinterpret_cast<SnapshotHeader*>(bytes.data());
+    unsigned char* array = bytes.data() + sizeof(SnapshotHeader);
+    positionX = reinterpret_cast<float*>(array);
+    positionY = positionX + circleCount;
+    velocityX = positionY + circleCount;
+    velocityY = velocityX + circleCount;
+    radius = reinterpret_cast<int32_t*>(velocityY + circleCount);
+    mass = radius + circleCount;
+    color = reinterpret_cast<uint32_t*>(mass + circleCount);
+    restingTicks = reinterpret_cast<int32_t*>(color + circleCount);
+    sleeping = restingTicks + circleCount;
+    shape = reinterpret_cast<uint32_t*>(sleeping + circleCount);
+    category = shape + circleCount;
+    mask = category + circleCount;
+    halfExtentsX = reinterpret_cast<float*>(mask + circleCount);
+    halfExtentsY = halfExtentsX + circleCount;
+    halfAxisX = halfExtentsY + circleCount;
+    halfAxisY = halfAxisX + circleCount;
+    capsuleRadius = halfAxisY + circleCount;
+    contactA = reinterpret_cast<uint32_t*>(capsuleRadius + circleCount);
+    contactB = contactA + contactCount;
+    contactImpulse = reinterpret_cast<float*>(contactB + contactCount);
+  }
+
+  Rng getRng() const {
+    Rng rng;
+    rng.state = header->rngState;
+    rng.increment = header->rngIncrement;
+    return rng;
+  }
+
+  // Write the snapshot with a single fwrite
+  bool save(const char* path) const {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+      fprintf(stderr, "Could not open %s\n", path);
+      return false;
+    }
+    bool saved = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    fclose(file);
+    if (!saved) fprintf(stderr, "Could not write %s\n", path);
+    return saved;
+  }
+
+  // Read the snapshot with a single fread
+  // Returns false and leaves the snapshot empty if the file is not a snapshot
+  bool load(const char* path) {
+    header = nullptr;
+    bytes.clear();
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+      fprintf(stderr, "Could not open %s\n", path);
+      return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < static_cast<long>(sizeof(SnapshotHeader))) {
+      fprintf(stderr, "%s is not a snapshot\n", path);
+      fclose(file);
+      return false;
+    }
+    bytes.resize(size);
+    bool read = fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    fclose(file);
+
+    SnapshotHeader* fileHeader = reinterpret_cast<SnapshotHeader*>(bytes.data());
+    if (!read || memcmp(fileHeader->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+      fprintf(stderr, "%s is not a snapshot\n", path);
+      bytes.clear();
+      return false;
+    }
+    if (fileHeader->version != SNAPSHOT_VERSION) {
+      fprintf(
+        stderr, "%s is snapshot version %u, expected %u\n", path,
+        fileHeader->version, SNAPSHOT_VERSION
+      );
+      bytes.clear();
+      return false;
+    }
+    size_t expectedSize =
+      sizeof(SnapshotHeader) +
+      fileHeader->circleCount * SNAPSHOT_BYTES_PER_CIRCLE +
+      fileHeader->contactCount * SNAPSHOT_BYTES_PER_CONTACT;
+    if (bytes.size() != expectedSize) {
+      fprintf(stderr, "%s is truncated\n", path);
+      bytes.clear();
+      return false;
+    }
+
+    pointIntoBytes(fileHeader->circleCount, fileHeader->contactCount);
+    return true;
+  }
+
+  // CircleT needs radius, mass, color, velocity, position, restingTicks,
+  // sleeping, shape, category, mask, halfExtents, halfAxis and capsuleRadius
+  template <typename CircleT>
+  void storeCircle(const size_t i, const CircleT& circle) {
+    positionX[i] = circle.position.x;
+    positionY[i] = circle.position.y;
+    velocityX[i] = circle.velocity.x;
+    velocityY[i] = circle.velocity.y;
+    radius[i] = circle.radius;
+    mass[i] = circle.mass;
+    color[i] = static_cast<uint32_t>(circle.color.r) |
+               (static_cast<uint32_t>(circle.color.g) << 8) |
+               (static_cast<uint32_t>(circle.color.b) << 16) |
+               (static_cast<uint32_t>(circle.color.a) << 24);
+    restingTicks[i] = circle.restingTicks;
+    sleeping[i] = circle.sleeping ? 1 : 0;
+    shape[i] = static_cast<uint32_t>(circle.shape);
+    category[i] = circle.category;
+    mask[i] = circle.mask;
+    halfExtentsX[i] = circle.halfExtents.x;
+    halfExtentsY[i] = circle.halfExtents.y;
+    halfAxisX[i] = circle.halfAxis.x;
+    halfAxisY[i] = circle.halfAxis.y;
+    capsuleRadius[i] = circle.capsuleRadius;
+  }
+
+  // CircleT needs radius, mass, color, velocity, setPosition(), oldPosition,
+  // fast, restingTicks, sleeping, shape, category, mask, halfExtents, halfAxis
+  // and capsuleRadius
+  template <typename CircleT>
+  void loadCircle(const size_t i, CircleT& circle) const {
+    // The shape comes first, setPosition() files the body by it
+    circle.shape = static_cast<ShapeType>(shape[i]);
+    circle.halfExtents = {halfExtentsX[i], halfExtentsY[i]};
+    circle.halfAxis = {halfAxisX[i], halfAxisY[i]};
+    circle.capsuleRadius = capsuleRadius[i];
+    circle.category = category[i];
+    circle.mask = mask[i];
+    circle.radius = radius[i];
+    circle.mass = mass[i];
+    circle.color = {
+      static_cast<unsigned char>(color[i] & 0xff),
+      static_cast<unsigned char>((color[i] >> 8) & 0xff),
+      static_cast<unsigned char>((color[i] >> 16) & 0xff),
+      static_cast<unsigned char>((color[i] >> 24) & 0xff)};
+    circle.velocity = {velocityX[i], velocityY[i]};
+    // The last tick's sweep is not saved, so start from standing still
+    circle.oldPosition = {positionX[i], positionY[i]};
+    circle.fast = false;
+    circle.setPosition({positionX[i], positionY[i]});
+    circle.restingTicks = restingTicks[i];
+    circle.sleeping = sleeping[i] != 0;
+  }
+
+  void storeContact(
+    const size_t i, const uint32_t a, const uint32_t b, const float impulse
+  ) {
+    contactA[i] = a;
+    contactB[i] = b;
+    contactImpulse[i] = impulse;
+  }
+};
+
+#endif
@@ -0,0 +1,402 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "jobs.h"
+#include "shape.h"
+
+// Collision response shared by main.cpp, unigrid.cpp and quadtree.cpp
+// Every overlapping pair found during a tick becomes a Contact, and all of
+// them are solved together, iterations times over.
+// A pair approaching faster than its bounce threshold bounces like two lone
+// circles would. Slower pairs are resting: their impulse only stops the
+// circles from moving into each other, accumulates over the passes, and is
+// cached by pair id so the same pair starts from it next tick (warm starting).
+// Resting piles then settle in a few passes instead of jittering
+// Before solving, contacts are colored so that no two contacts of the same
+// color share a circle. Each color is then a batch that can be solved in
+// parallel without locks, and the result does not depend on the thread count
+// Impulses only fix velocities, so circles that already overlap stay
+// overlapped. After the impulses, a separate pass moves overlapping circles
+// apart without touching their velocities (split impulse), so the correction
+// never turns into a bounce
+const int DEFAULT_SOLVER_ITERATIONS(4);
+const int DEFAULT_POSITION_ITERATIONS(2);
+// Overlap left alone, in pixels, so resting circles keep touching and keep
+// their contact (and warm-started impulse) from tick to tick
+const float POSITION_SLOP(0.5f);
+// Fraction of the overlap beyond the slop removed per pass
+const float POSITION_CORRECTION_FACTOR(0.2f);
+// Most a pair is moved apart per pass, in pixels
+const float MAX_POSITION_CORRECTION(4.0f);
+// Contacts that find no free color go into one extra batch solved serially
+const int MAX_CONTACT_COLORS(64);
+// Contacts per job when a batch is split across threads
+const size_t SOLVER_CHUNK_SIZE(1024);
+
+struct Contact {
+  uint32_t a;
+  uint32_t b;
+  Vector2 normal;  // Unit length, from a to b
+  float penetration;
+  float normalMass;  // 1 / (1 / a.mass + 1 / b.mass)
+  float elasticity;
+  float bounceThreshold;
+  float impulse;        // Resting impulse accumulated along normal, never
+                        // negative
+  float bounceImpulse;  // Sum of the bounces, never cached
+};
+
+// Impulse a resting pair ended the previous tick with
+struct CachedContact {
+  uint32_t a;
+  uint32_t b;
+  float impulse;
+};
+
+// The same for (a, b) and (b, a)
+static uint64_t getPairId(const uint32_t a, const uint32_t b) {
+  uint64_t low = (a < b) ? a : b;
+  uint64_t high = (a < b) ? b : a;
+  return (high << 32) | low;
+}
+
+// Pair id to impulse, with open addressing so rebuilding it every tick does
+// not allocate once it has grown
+struct PairImpulseTable {
+  std::vector<uint64_t> pairIds;  // 0 marks an empty slot, no pair has id 0
+  std::vector<float> impulses;
+  uint64_t mask = 0;
+
+  // Empty the table and make room for count pairs
+  void reset(const size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+    pairIds.assign(capacity, 0);
+    impulses.resize(capacity);
+    mask = capacity - 1;
+  }
+
+  size_t getSlot(const uint64_t pairId) const {
+    uint64_t slot = (pairId * 0x9E3779B97F4A7C15ull) >> 32;
+    while (pairIds[slot & mask] != 0 && pairIds[slot & mask] != pairId) slot++;
+    return slot & mask;
+  }
+
+  void insert(const uint64_t pairId, const float impulse) {
+    size_t slot = getSlot(pairId);
+    pairIds[slot] = pairId;
+    impulses[slot] = impulse;
+  }
+
+  // Returns false if the pair is not in the table
+  bool find(const uint64_t pairId, float* impulse) const {
+    if (pairIds.empty()) return false;
+    size_t slot = getSlot(pairId);
+    if (pairIds[slot] != pairId) return false;
+    *impulse = impulses[slot];
+    return true;
+  }
+};
+
+struct ContactSolver {
+  int iterations = DEFAULT_SOLVER_ITERATIONS;
+  bool warmStarting = true;
+  int positionIterations = DEFAULT_POSITION_ITERATIONS;
+
+  std::vector<Contact> contacts;
+  // Batches run on this pool when set
+  JobPool* jobPool = nullptr;
+
+  // Contacts are sorted by color, and batch c is
+  // contacts[batchStarts[c], batchStarts[c + 1])
+  std::vector<size_t> batchStarts;
+  size_t batchCount = 0;  // Colors used, plus the serial batch
+  // Bit c is set if a contact of color c touches the circle
+  std::vector<uint64_t> usedColors;
+  std::vector<uint8_t> contactColors;
+  std::vector<Contact> sortedContacts;
+
+  // Kept in the order they were solved so snapshots come out the same
+  std::vector<CachedContact> cachedContacts;
+  PairImpulseTable cachedImpulses;
+
+  void beginTick() { contacts.clear(); }
+
+  // Call when circle indices stop meaning the same circles
+  void clearCache() {
+    cachedContacts.clear();
+    cachedImpulses.reset(0);
+  }
+
+  void addCachedContact(const uint32_t a, const uint32_t b, const float impulse) {
+    cachedContacts.push_back({a, b, impulse});
+  }
+
+  // Renumber the circles of every cached contact
+  // map(index, &newIndex) returns false for circles that are gone, and their
+  // contacts are dropped
+  template <typename Map>
+  void remapCachedContacts(Map map) {
+    size_t kept = 0;
+    for (size_t i = 0; i < cachedContacts.size(); i++) {
+      CachedContact cached = cachedContacts[i];
+      if (map(cached.a, &cached.a) && map(cached.b, &cached.b)) {
+        cachedContacts[kept] = cached;
+        kept += 1;
+      }
+    }
+    cachedContacts.resize(kept);
+    indexCachedContacts();
+  }
+
+  // Call once every cached contact has been added
+  void indexCachedContacts() {
+    cachedImpulses.reset(cachedContacts.size());
+    for (size_t i = 0; i < cachedContacts.size(); i++) {
+      const CachedContact& cached = cachedContacts[i];
+      cachedImpulses.insert(getPairId(cached.a, cached.b), cached.impulse);
+    }
+  }
+
+  // CircleT needs index, radius, mass, position and velocity
+  // Pairs approaching slower than bounceThreshold rest against each other
+  // instead of bouncing
+  // Each pair must only be added once per tick
+  template <typename CircleT>
+  void addContact(
+    const CircleT& a, const CircleT& b, const float elasticity,
+    const float bounceThreshold
+  ) {
+    Vector2 offset = Vector2Subtract(b.position, a.position);
+    ShapeContact shapeContact;
+    shapeContact.normal = Vector2Normalize(offset);
+    shapeContact.penetration = a.radius + b.radius - Vector2Length(offset);
+    addContact(a, b, shapeContact, elasticity, bounceThreshold);
+  }
+
+  // The same for a pair with a box or capsule, whose normal and overlap come
+  // from collideShapes()
+  template <typename CircleT>
+  void addContact(
+    const CircleT& a, const CircleT& b, const ShapeContact& shapeContact,
+    const float elasticity, const float bounceThreshold
+  ) {
+    Contact contact;
+    contact.a = a.index;
+    contact.b = b.index;
+    contact.normal = shapeContact.normal;
+    contact.penetration = shapeContact.penetration;
+    contact.normalMass = 1.0f / ((1.0f / a.mass) + (1.0f / b.mass));
+    contact.elasticity = elasticity;
+    contact.bounceThreshold = bounceThreshold;
+    contact.impulse = 0.0f;
+    contact.bounceImpulse = 0.0f;
+    contacts.push_back(contact);
+  }
+
+  // Give every contact the lowest color neither of its circles has yet
+  // (greedy coloring), then sort contacts by color
+  void colorContacts() {
+    uint32_t circleCount = 0;
+    for (size_t i = 0; i < contacts.size(); i++) {
+      if (contacts[i].a + 1 > circleCount) circleCount = contacts[i].a + 1;
+      if (contacts[i].b + 1 > circleCount) circleCount = contacts[i].b + 1;
+    }
+    usedColors.assign(circleCount, 0);
+    contactColors.resize(contacts.size());
+
+    size_t colorCounts[MAX_CONTACT_COLORS + 1] = {};
+    for (size_t i = 0; i < contacts.size(); i++) {
+      uint64_t& usedByA = usedColors[contacts[i].a];
+      uint64_t& usedByB = usedColors[contacts[i].b];
+      uint64_t used = usedByA | usedByB;
+      int color = 0;
+      while (color < MAX_CONTACT_COLORS && ((used >> color) & 1)) color++;
+      if (color < MAX_CONTACT_COLORS) {
+        usedByA |= 1ull << color;
+        usedByB |= 1ull << color;
+      }
+      contactColors[i] = color;
+      colorCounts[color] += 1;
+    }
+
+    batchStarts.assign(MAX_CONTACT_COLORS + 2, 0);
+    batchCount = 0;
+    for (int color = 0; color <= MAX_CONTACT_COLORS; color++) {
+      batchStarts[color + 1] = batchStarts[color] + colorCounts[color];
+      if (colorCounts[color] > 0) batchCount = color + 1;
+    }
+
+    // Stable, so the order within a batch is the order contacts were found
+    std::vector<size_t> nextSlot(batchStarts.begin(), batchStarts.end() - 1);
+    sortedContacts.resize(contacts.size());
+    for (size_t i = 0; i < contacts.size(); i++) {
+      sortedContacts[nextSlot[contactColors[i]]++] = contacts[i];
+    }
+    contacts.swap(sortedContacts);
+  }
+
+  // Run solveContact(contact) over every contact, one batch at a time
+  // Batches other than the serial one are split across jobPool
+  template <typename SolveContact>
+  void forEachContactInBatches(SolveContact solveContact) {
+    for (size_t color = 0; color < batchCount; color++) {
+      size_t begin = batchStarts[color];
+      size_t count = batchStarts[color + 1] - begin;
+      if (count == 0) continue;
+      if (!jobPool || color == MAX_CONTACT_COLORS) {
+        for (size_t i = begin; i < begin + count; i++) {
+          solveContact(contacts[i]);
+        }
+        continue;
+      }
+      jobPool->parallelFor(
+        count, SOLVER_CHUNK_SIZE,
+        [&](size_t chunkBegin, size_t chunkEnd) {
+          for (size_t i = begin + chunkBegin; i < begin + chunkEnd; i++) {
+            solveContact(contacts[i]);
+          }
+        }
+      );
+    }
+  }
+
+  // Sum of the overlaps of every contact added this tick, before correction
+  float totalPenetration() const {
+    float total = 0.0f;
+    for (size_t i = 0; i < contacts.size(); i++) {
+      if (contacts[i].penetration > 0.0f) total += contacts[i].penetration;
+    }
+    return total;
+  }
+
+  // Solve every contact added this tick, then move overlapping circles apart
+  // getCircle(i) returns the circle with index i, and has to be safe to call
+  // from several threads at once
+  // Returns the number of contacts that pushed their circles apart
+  template <typename GetCircle>
+  size_t solve(GetCircle getCircle) {
+    colorContacts();
+
+    if (warmStarting) {
+      forEachContactInBatches([&](Contact& contact) {
+        uint64_t pairId = getPairId(contact.a, contact.b);
+        if (cachedImpulses.find(pairId, &contact.impulse)) {
+          applyImpulse(contact, contact.impulse, getCircle);
+        }
+      });
+    }
+
+    for (int iteration = 0; iteration < iterations; iteration++) {
+      forEachContactInBatches([&](Contact& contact) {
+        solveContact(contact, getCircle);
+      });
+    }
+
+    cachedContacts.clear();
+    size_t pushedContacts = 0;
+    for (size_t i = 0; i < contacts.size(); i++) {
+      if (contacts[i].impulse > 0.0f) {
+        addCachedContact(contacts[i].a, contacts[i].b, contacts[i].impulse);
+      }
+      if (contacts[i].impulse > 0.0f || contacts[i].bounceImpulse > 0.0f) {
+        pushedContacts += 1;
+      }
+    }
+    indexCachedContacts();
+
+    for (int iteration = 0; iteration < positionIterations; iteration++) {
+      forEachContactInBatches([&](Contact& contact) {
+        correctPosition(contact, getCircle);
+      });
+    }
+    return pushedContacts;
+  }
+
+  template <typename GetCircle>
+  static void solveContact(Contact& contact, GetCircle getCircle) {
+    auto& a = getCircle(contact.a);
+    auto& b = getCircle(contact.b);
+    float normalVelocity =
+      Vector2DotProduct(Vector2Subtract(b.velocity, a.velocity), contact.normal);
+
+    if (normalVelocity < -contact.bounceThreshold) {
+      float impulse =
+        -(1.0f + contact.elasticity) * contact.normalMass * normalVelocity;
+      contact.bounceImpulse += impulse;
+      applyImpulse(contact, impulse, getCircle);
+      return;
+    }
+
+    // Resting circles can only be pushed apart, never pulled together
+    float oldImpulse = contact.impulse;
+    contact.impulse =
+      fmaxf(oldImpulse - contact.normalMass * normalVelocity, 0.0f);
+    applyImpulse(contact, contact.impulse - oldImpulse, getCircle);
+  }
+
+  // Move a and b apart along the line between them, by part of how much they
+  // still overlap, splitting the move by inverse mass
+  // Pairs with a box or capsule are moved apart along the normal
+  // collideShapes() gives for where they are now
+  // Sleeping circles stay where they are, since their place in the sleeping
+  // grid/quadtree is only rebuilt when one wakes up
+  template <typename GetCircle>
+  static void correctPosition(const Contact& contact, GetCircle getCircle) {
+    auto& a = getCircle(contact.a);
+    auto& b = getCircle(contact.b);
+    Vector2 normal;
+    float penetration;
+    if (isCirclePair(a, b)) {
+      Vector2 offset = Vector2Subtract(b.position, a.position);
+      float distance = Vector2Length(offset);
+      penetration = a.radius + b.radius - distance;
+      // Circles on top of each other get pushed along the contact's normal
+      normal = (distance > 0.0f) ? Vector2Scale(offset, 1.0f / distance)
+                                 : contact.normal;
+    } else {
+      ShapeContact shapeContact;
+      if (!collideShapes(a, b, &shapeContact)) return;
+      normal = shapeContact.normal;
+      penetration = shapeContact.penetration;
+    }
+    if (penetration <= POSITION_SLOP) return;
+
+    float inverseMassA = a.sleeping ? 0.0f : 1.0f / a.mass;
+    float inverseMassB = b.sleeping ? 0.0f : 1.0f / b.mass;
+    float inverseMassSum = inverseMassA + inverseMassB;
+    if (inverseMassSum == 0.0f) return;
+
+    float correction = fminf(
+      POSITION_CORRECTION_FACTOR * (penetration - POSITION_SLOP),
+      MAX_POSITION_CORRECTION
+    );
+    Vector2 push = Vector2Scale(normal, correction / inverseMassSum);
+    if (inverseMassA > 0.0f) {
+      a.setPosition(Vector2Subtract(a.position, Vector2Scale(push, inverseMassA)));
+    }
+    if (inverseMassB > 0.0f) {
+      b.setPosition(Vector2Add(b.position, Vector2Scale(push, inverseMassB)));
+    }
+  }
+
+  template <typename GetCircle>
+  static void applyImpulse(
+    const Contact& contact, const float impulse, GetCircle getCircle
+  ) {
+    auto& a = getCircle(contact.a);
+    auto& b = getCircle(contact.b);
+    Vector2 push = Vector2Scale(contact.normal, impulse);
+    a.velocity = Vector2Subtract(a.velocity, Vector2Scale(push, 1.0f / a.mass));
+    b.velocity = Vector2Add(b.velocity, Vector2Scale(push, 1.0f / b.mass));
+  }
+};
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <raylib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "jobs.h"
+#include "rng.h"
+
+// How --circles lays out a pre-populated scene
+//   center     Where Circle::spawn puts them (small in the middle, big at the
+//              bottom middle of the screen)
+//   uniform    Anywhere on screen
+//   clustered  Around a handful of random points
+//   bigHeavy   Anywhere on screen, half of them big
+enum class SpawnDistribution { center, uniform, clustered, bigHeavy };
+
+const int SPAWN_CLUSTER_COUNT(8);
+const float SPAWN_CLUSTER_RADIUS(80.0f);
+
+// Circles initialized per job by spawnCircles
+// Each chunk has its own Rng stream, so the result doesn't depend on the
+// number of threads
+const size_t SPAWN_CHUNK_SIZE(4096);
+
+// What spawnCircles creates
+// Zeroes are filled in from the program's own constants by withDefaults()
+struct SpawnParams {
+  SpawnDistribution distribution = SpawnDistribution::center;
+
+  // Small circles get a radius within [radiusMin, radiusMax) and mass
+  int radiusMin = 0;
+  int radiusMax = 0;
+  int mass = 0;
+
+  int bigRadius = 0;
+  int bigMass = 0;
+  // Outside of bigHeavy, one in every smallCirclesPerBigCircle + 1 is big
+  int smallCirclesPerBigCircle = 0;
+
+  float velocityMin = 0.0f;
+  float velocityMax = 0.0f;
+
+  int screenWidth = 0;
+  int screenHeight = 0;
+
+  // Return a copy where every zero is replaced by the value in defaults
+  SpawnParams withDefaults(const SpawnParams& defaults) const {
+    SpawnParams params = *this;
+    if (params.radiusMin == 0) params.radiusMin = defaults.radiusMin;
+    if (params.radiusMax == 0) params.radiusMax = defaults.radiusMax;
+    if (params.mass == 0) params.mass = defaults.mass;
+    if (params.bigRadius == 0) params.bigRadius = defaults.bigRadius;
+    if (params.bigMass == 0) params.bigMass = defaults.bigMass;
+    if (params.smallCirclesPerBigCircle == 0) {
+      params.smallCirclesPerBigCircle = defaults.smallCirclesPerBigCircle;
+    }
+    if (params.velocityMin == 0.0f) params.velocityMin = defaults.velocityMin;
+    if (params.velocityMax == 0.0f) params.velocityMax = defaults.velocityMax;
+    if (params.screenWidth == 0) params.screenWidth = defaults.screenWidth;
+    if (params.screenHeight == 0) params.screenHeight = defaults.screenHeight;
+    return params;
+  }
+};
+
+static const char* getSpawnDistributionName(const SpawnDistribution distribution) {
+  switch (distribution) {
+    case SpawnDistribution::center:
+      return "center";
+    case SpawnDistribution::uniform:
+      return "uniform";
+    case SpawnDistribution::clustered:
+      return "clustered";
+    case SpawnDistribution::bigHeavy:
+      return "big-heavy";
+  }
+  return "";
+}
+
+// Return false if name is not a distribution
+static bool parseSpawnDistribution(
+  const char* name, SpawnDistribution* distribution
+) {
+  const SpawnDistribution distributions[] = {
+    SpawnDistribution::center, SpawnDistribution::uniform,
+    SpawnDistribution::clustered, SpawnDistribution::bigHeavy};
+  for (size_t i = 0; i < 4; i++) {
+    if (strcmp(name, getSpawnDistributionName(distributions[i])) == 0) {
+      *distribution = distributions[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the index-th pre-populated circle should be big
+// Outside of bigHeavy, keep the spawn key's ratio of one big circle per
+// smallCirclesPerBigCircle small ones (never if it is negative)
+static bool shouldSpawnBig(
+  const SpawnDistribution distribution, const size_t index,
+  const int smallCirclesPerBigCircle
+) {
+  if (distribution == SpawnDistribution::bigHeavy) return index % 2 == 1;
+  if (smallCirclesPerBigCircle < 0) return false;
+  size_t ratio = static_cast<size_t>(smallCirclesPerBigCircle);
+  return index % (ratio + 1) == ratio;
+}
+
+// Pick the cluster centers used by SpawnDistribution::clustered
+static void getSpawnClusterCenters(
+  Rng& rng, Vector2* clusterCenters, const int screenWidth,
+  const int screenHeight
+) {
+  for (int i = 0; i < SPAWN_CLUSTER_COUNT; i++) {
+    clusterCenters[i] = {
+      SPAWN_CLUSTER_RADIUS +
+        rng.nextFloat() *
+          (screenWidth - 2 * SPAWN_CLUSTER_RADIUS),
+      SPAWN_CLUSTER_RADIUS +
+        rng.nextFloat() *
+          (screenHeight - 2 * SPAWN_CLUSTER_RADIUS)};
+  }
+}
+
+// Return where a pre-populated circle should go
+// spawnPosition is the position Circle::spawn already picked
+static Vector2 getSpawnPosition(
+  Rng& rng, const SpawnDistribution distribution, const Vector2 spawnPosition,
+  const int radius, const int screenWidth, const int screenHeight,
+  const Vector2* clusterCenters
+) {
+  // Keep circles one pixel away from the edges so they don't start out of
+  // bounds
+  float margin = radius + 1.0f;
+  float u = rng.nextFloat();
+  float v = rng.nextFloat();
+
+  Vector2 position = spawnPosition;
+  switch (distribution) {
+    case SpawnDistribution::center:
+      return spawnPosition;
+
+    case SpawnDistribution::uniform:
+    case SpawnDistribution::bigHeavy:
+      position = {
+        margin + u * (screenWidth - 2 * margin),
+        margin + v * (screenHeight - 2 * margin)};
+      break;
+
+    case SpawnDistribution::clustered: {
+      Vector2 clusterCenter = clusterCenters[rng.nextInt(SPAWN_CLUSTER_COUNT)];
+      position = {
+        clusterCenter.x + (u * 2.0f - 1.0f) * SPAWN_CLUSTER_RADIUS,
+        clusterCenter.y + (v * 2.0f - 1.0f) * SPAWN_CLUSTER_RADIUS};
+      break;
+    }
+  }
+
+  // Clamp into the screen
+  if (position.x < margin) position.x = margin;
+  if (position.y < margin) position.y = margin;
+  if (position.x > screenWidth - margin) position.x = screenWidth - margin;
+  if (position.y > screenHeight - margin) position.y = screenHeight - margin;
+  return position;
+}
+
+// Append count circles to circles, reserving storage once and initializing
+// them in parallel on jobPool
+// CircleT needs radius, mass, color, velocity and setPosition()
+template <typename CircleT>
+static void spawnCircles(
+  std::vector<CircleT>& circles, const size_t count, const SpawnParams& params,
+  Rng& rng, JobPool& jobPool
+) {
+  // Draw everything shared by the jobs from rng so successive calls differ
+  uint64_t seed = (static_cast<uint64_t>(rng.next()) << 32) | rng.next();
+  Vector2 clusterCenters[SPAWN_CLUSTER_COUNT];
+  getSpawnClusterCenters(
+    rng, clusterCenters, params.screenWidth, params.screenHeight
+  );
+
+  size_t first = circles.size();
+  circles.resize(first + count);
+
+  jobPool.parallelFor(count, SPAWN_CHUNK_SIZE, [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; chunk += SPAWN_CHUNK_SIZE) {
+      Rng chunkRng(seed, chunk / SPAWN_CHUNK_SIZE + 1);
+      size_t chunkEnd =
+        (chunk + SPAWN_CHUNK_SIZE < end) ? chunk + SPAWN_CHUNK_SIZE : end;
+
+      for (size_t i = chunk; i < chunkEnd; i++) {
+        CircleT& circle = circles[first + i];
+        bool isBig = shouldSpawnBig(
+          params.distribution, i, params.smallCirclesPerBigCircle
+        );
+
+        circle.color = {
+          static_cast<unsigned char>(chunkRng.nextInt(256)),
+          static_cast<unsigned char>(chunkRng.nextInt(256)),
+          static_cast<unsigned char>(chunkRng.nextInt(256)), 255};
+
+        float speedRange = params.velocityMax - params.velocityMin;
+        circle.velocity.x =
+          (params.velocityMin + chunkRng.nextFloat() * speedRange) *
+          (chunkRng.nextInt(2) ? 1.0f : -1.0f);
+        circle.velocity.y =
+          (params.velocityMin + chunkRng.nextFloat() * speedRange) *
+          (chunkRng.nextInt(2) ? 1.0f : -1.0f);
+
+        Vector2 spawnPosition;
+        if (isBig) {
+          // Big circles start at the bottom middle of the screen, like
+          // Circle::spawn
+          circle.radius = params.bigRadius;
+          circle.mass = params.bigMass;
+          spawnPosition = {
+            params.screenWidth / 2.0f,
+            params.screenHeight - static_cast<float>(circle.radius + 1)};
+        } else {
+          int radiusRange = params.radiusMax - params.radiusMin;
+          circle.radius =
+            params.radiusMin +
+            (radiusRange > 0 ? chunkRng.nextInt(radiusRange) : 0);
+          circle.mass = params.mass;
+          spawnPosition = {params.screenWidth / 2.0f, params.screenHeight / 2.0f};
+        }
+
+        circle.setPosition(getSpawnPosition(
+          chunkRng, params.distribution, spawnPosition, circle.radius,
+          params.screenWidth, params.screenHeight, clusterCenters
+        ));
+      }
+    }
+  });
+}
+
+#endif
+
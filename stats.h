@@ -0,0 +1,130 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <raylib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Per-tick collision counters shared by main.cpp, unigrid.cpp and quadtree.cpp
+// The ratio of candidate pairs to overlaps shows how well the broadphase
+// (GRID_SIZE, MAX_DEPTH) fits the current scene
+struct CollisionStats {
+  long long candidatePairs = 0;  // Pairs that reached the distance test
+  long long overlaps = 0;        // Pairs whose circles actually touch
+  // Slots between the two circles of every overlap, added up
+  long long pairDistance = 0;
+  long long impulses = 0;        // Collision responses applied
+  long long sweptHits = 0;       // Fast pairs moved back to where they touched
+  long long nodesVisited = 0;    // Grid cells or quad nodes walked
+  long long occupiedNodes = 0;   // Cells or quads holding at least one circle
+  long long objectsInOccupiedNodes = 0;
+  long long sleepingCircles = 0;  // Circles asleep at the end of the tick
+  long long wakes = 0;            // Sleeping circles woken by a hit
+  long long substeps = 0;         // Steps the tick was split into
+  double penetration = 0.0;       // Overlap of every contact, in pixels
+
+  void reset() { *this = CollisionStats(); }
+
+  // Count an overlap between the circles at indices a and b
+  void addOverlap(const uint32_t a, const uint32_t b) {
+    overlaps += 1;
+    pairDistance += a > b ? a - b : b - a;
+  }
+
+  void add(const CollisionStats& other) {
+    candidatePairs += other.candidatePairs;
+    overlaps += other.overlaps;
+    pairDistance += other.pairDistance;
+    impulses += other.impulses;
+    sweptHits += other.sweptHits;
+    nodesVisited += other.nodesVisited;
+    occupiedNodes += other.occupiedNodes;
+    objectsInOccupiedNodes += other.objectsInOccupiedNodes;
+    sleepingCircles += other.sleepingCircles;
+    wakes += other.wakes;
+    substeps += other.substeps;
+    penetration += other.penetration;
+  }
+
+  // Used to turn a run's totals into per-tick averages
+  void divide(const long long ticks) {
+    if (ticks == 0) return;
+    candidatePairs /= ticks;
+    overlaps /= ticks;
+    pairDistance /= ticks;
+    impulses /= ticks;
+    sweptHits /= ticks;
+    nodesVisited /= ticks;
+    occupiedNodes /= ticks;
+    objectsInOccupiedNodes /= ticks;
+    sleepingCircles /= ticks;
+    wakes /= ticks;
+    substeps /= ticks;
+    penetration /= ticks;
+  }
+
+  // Candidate pairs needed to find one real overlap
+  float candidatesPerOverlap() const {
+    if (overlaps == 0) return static_cast<float>(candidatePairs);
+    return static_cast<float>(candidatePairs) / overlaps;
+  }
+
+  // How far apart touching circles are stored, in circles
+  // Low when circles that are close in space are also close in memory
+  float averagePairDistance() const {
+    if (overlaps == 0) return 0.0f;
+    return static_cast<float>(pairDistance) / overlaps;
+  }
+
+  float averageObjectsPerOccupiedNode() const {
+    if (occupiedNodes == 0) return 0.0f;
+    return static_cast<float>(objectsInOccupiedNodes) / occupiedNodes;
+  }
+
+  // nodeLabel is what the engine calls its nodes ("cell", "quad")
+  // or nullptr if the engine has none
+  void print(FILE* file, const char* label, const char* nodeLabel) const {
+    fprintf(
+      file,
+      "%s: %lld candidates, %lld overlaps (%.1f candidates/overlap), "
+      "%lld impulses (%lld swept), %.1f px overlap, %lld asleep, %lld wakes, "
+      "%lld substeps, %.0f slots between touching circles",
+      label, candidatePairs, overlaps, candidatesPerOverlap(), impulses,
+      sweptHits, penetration, sleepingCircles, wakes, substeps,
+      averagePairDistance()
+    );
+    if (nodeLabel) {
+      fprintf(
+        file, ", %lld %ss visited, %.2f objects per occupied %s",
+        nodesVisited, nodeLabel, averageObjectsPerOccupiedNode(), nodeLabel
+      );
+    }
+    fprintf(file, "\n");
+  }
+
+  void draw(const int x, const int y, const char* nodeLabel) const {
+    char buffer[160];
+    sprintf(
+      buffer, "%lld candidates, %lld overlaps (%.1f per overlap, %.1f px)",
+      candidatePairs, overlaps, candidatesPerOverlap(), penetration
+    );
+    DrawText(buffer, x, y, 20, DARKGRAY);
+    sprintf(
+      buffer,
+      "%lld impulses (%lld swept), %lld asleep, %lld wakes, %lld substeps, "
+      "%.0f slots apart",
+      impulses, sweptHits, sleepingCircles, wakes, substeps,
+      averagePairDistance()
+    );
+    DrawText(buffer, x, y + 20, 20, DARKGRAY);
+    if (nodeLabel) {
+      sprintf(
+        buffer, "%lld %ss visited, %.2f objects per occupied %s", nodesVisited,
+        nodeLabel, averageObjectsPerOccupiedNode(), nodeLabel
+      );
+      DrawText(buffer, x, y + 40, 20, DARKGRAY);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SUBSTEP_H
+#define SUBSTEP_H
+
+#include <raylib.h>
+#include <raymath.h>
+#include <math.h>
+
+#include <vector>
+
+#include "solver.h"
+
+// Adaptive substepping shared by main.cpp, unigrid.cpp and quadtree.cpp
+// Calm ticks run as one step. A tick where the fastest circle would move
+// further than the smallest radius, or where resting contacts overlap deeply,
+// is split into substeps of equal length instead
+const int DEFAULT_MAX_SUBSTEPS(8);
+// Deepest overlap allowed, as a fraction of the smallest radius, before the
+// tick is split further
+const float SUBSTEP_MAX_PENETRATION(0.5f);
+
+// Substeps the next tick should be split into, from 1 to maxSubsteps
+// Overlaps are measured on the contacts cached by contactSolver, so the
+// result only depends on what a snapshot stores
+// getCircle(i) returns the circle with index i, which needs velocity, radius,
+// position, sleeping and the shape of shape.h
+template <typename GetCircle>
+static int chooseSubsteps(
+  const size_t circleCount, GetCircle getCircle,
+  const ContactSolver& contactSolver, const float timestep,
+  const int maxSubsteps
+) {
+  float maxSpeedSqr = 0.0f;
+  float minRadius = INFINITY;
+  for (size_t i = 0; i < circleCount; i++) {
+    const auto& circle = getCircle(i);
+    if (circle.sleeping) continue;
+    float speedSqr = Vector2LengthSqr(circle.velocity);
+    if (speedSqr > maxSpeedSqr) maxSpeedSqr = speedSqr;
+    if (circle.radius < minRadius) minRadius = circle.radius;
+  }
+  if (minRadius == INFINITY || minRadius <= 0.0f) return 1;
+
+  float worstPenetration = 0.0f;
+  const std::vector<CachedContact>& contacts = contactSolver.cachedContacts;
+  for (size_t i = 0; i < contacts.size(); i++) {
+    const auto& a = getCircle(contacts[i].a);
+    const auto& b = getCircle(contacts[i].b);
+    float penetration = getShapePenetration(a, b);
+    if (penetration > worstPenetration) worstPenetration = penetration;
+  }
+
+  float travel = sqrtf(maxSpeedSqr) * timestep / minRadius;
+  float depth = worstPenetration / (SUBSTEP_MAX_PENETRATION * minRadius);
+  float substeps = ceilf(fmaxf(travel, depth));
+  if (substeps < 1.0f) return 1;
+  if (substeps > maxSubsteps) return maxSubsteps;
+  return static_cast<int>(substeps);
+}
+
+#endif
@@ -7,6 +7,28 @@
 #include <set>
 #include <vector>
 
+#include "ccd.h"
+#include "despawn.h"
+#include "events.h"
+#include "fluid.h"
+#include "headless.h"
+#include "jobs.h"
+#include "layers.h"
+#include "obstacles.h"
+#include "picking.h"
+#include "query.h"
+#include "recording.h"
+#include "reorder.h"
+#include "replay.h"
+#include "rng.h"
+#include "shape.h"
+#include "sleep.h"
+#include "snapshot.h"
+#include "solver.h"
+#include "spawn.h"
+#include "stats.h"
+#include "substep.h"
+
 const int WINDOW_WIDTH(1280);
 const int WINDOW_HEIGHT(720);
 const char* WINDOW_NAME("Spatial Data Structures - Uniform Grid");
@@ -17,6 +39,9 @@ const float TIMESTEP(1.0f / TARGET_FPS);
 const KeyboardKey SPAWN_KEY(KEY_SPACE);
 const KeyboardKey PAUSE_KEY(KEY_A);
 const KeyboardKey DETAILS_KEY(KEY_Q);
+const KeyboardKey STATS_KEY(KEY_W);
+const KeyboardKey SAVE_KEY(KEY_F5);
+const KeyboardKey LOAD_KEY(KEY_F9);
 
 enum CircleSize { small = 0, big = 1 };
 
@@ -38,17 +63,25 @@ const float ELASTICITY(1.0f);
 
 const int GRID_SIZE(60);
 
+// Counters for the current tick
+static CollisionStats collisionStats;
+// Touching and woken circles for the current tick
+static SleepSystem sleepSystem;
+// Contacts found this tick and impulses cached from the last one
+static ContactSolver contactSolver;
+// Fast circles that touched between the start and the end of the tick
+static SweptHits sweptHits;
+
 // https://cplusplus.com/forum/beginner/81180/
 // Returns a random float within min and max
-static float randf(const float min, const float max) {
-  float result =
-    (rand() / static_cast<float>(RAND_MAX) * (max - min + 1)) + min;
+static float randf(Rng& rng, const float min, const float max) {
+  float result = (rng.nextFloat() * (max - min + 1)) + min;
   return result;
 }
 
 // Returns 1 or -1
-static int directionMultiplier() {
-  int randomNumber = rand() % 100;  // 0 to 99
+static int directionMultiplier(Rng& rng) {
+  int randomNumber = rng.nextInt(100);  // 0 to 99
   if (randomNumber < 50) {
     return -1.0f;
   }
@@ -56,14 +89,35 @@ static int directionMultiplier() {
 }
 
 struct Circle {
-  int radius;
-  int mass;
-  Color color;
-
-  Vector2 acceleration;
-  Vector2 velocity;
-  Vector2 position;
-	Vector2 oldPosition;
+  int radius = 0;
+  int mass = 0;
+  Color color = {0, 0, 0, 0};
+
+  Vector2 acceleration = {0.0f, 0.0f};
+  Vector2 velocity = {0.0f, 0.0f};
+  Vector2 position = {0.0f, 0.0f};
+	Vector2 oldPosition = {0.0f, 0.0f};
+
+  // Index in the simulation's circle storage
+  uint32_t index = 0;
+  bool sleeping = false;
+  // Ticks in a row this circle has not moved
+  int restingTicks = 0;
+  // Moved further than its radius this tick, see ccd.h
+  bool fast = false;
+  // Finds this circle again after it moves to another index, see despawn.h
+  CircleHandle handle;
+  // Ticks until it despawns, 0 for never
+  int ticksToLive = 0;
+  // Layers this circle is in and layers it collides with, see layers.h
+  uint32_t category = DEFAULT_CATEGORY;
+  uint32_t mask = ALL_LAYERS;
+  // Boxes and capsules are circles with another shape, whose radius bounds
+  // the whole shape, see shape.h
+  ShapeType shape = ShapeType::circle;
+  Vector2 halfExtents = {0.0f, 0.0f};  // Box only
+  Vector2 halfAxis = {0.0f, 0.0f};  // Capsule only, from its middle to one end
+  float capsuleRadius = 0.0f;  // Capsule only
 
   std::vector<Vector2> gridPositions;
 
@@ -71,107 +125,106 @@ struct Circle {
 
   // If big, spawn at bottom middle of screen
   // Else, spawn at middle
-  void spawn(const CircleSize size = small) {
+  void spawn(Rng& rng, const CircleSize size = small) {
     color = {
-      static_cast<unsigned char>(rand() % 256),
-      static_cast<unsigned char>(rand() % 256),
-      static_cast<unsigned char>(rand() % 256), 255};
-    velocity.x =
-      randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) * directionMultiplier();
+      static_cast<unsigned char>(rng.nextInt(256)),
+      static_cast<unsigned char>(rng.nextInt(256)),
+      static_cast<unsigned char>(rng.nextInt(256)), 255};
+    velocity.x = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) *
+                 directionMultiplier(rng);
 
     if (size == CircleSize::small) {
-      radius = rand() % (SMALL_CIRCLE_RADIUS_MAX - SMALL_CIRCLE_RADIUS_MIN) +
+      radius = rng.nextInt(SMALL_CIRCLE_RADIUS_MAX - SMALL_CIRCLE_RADIUS_MIN) +
                SMALL_CIRCLE_RADIUS_MIN;
       mass = SMALL_CIRCLE_MASS;
       setPosition({WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2});
-      velocity.y =
-        randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) * directionMultiplier();
+      velocity.y = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX) *
+                   directionMultiplier(rng);
     } else {
       radius = BIG_CIRCLE_RADIUS;
       mass = BIG_CIRCLE_MASS;
       setPosition({WINDOW_WIDTH / 2, WINDOW_HEIGHT - static_cast<float>(radius + 1)});
-      velocity.y = randf(CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX);
+      velocity.y = randf(rng, CIRCLE_VELOCITY_MIN, CIRCLE_VELOCITY_MAX);
     }
   }
 
-  void draw() { DrawCircle(position.x, position.y, radius, color); }
+  void draw() { drawShape(*this, color); }
 
   // Update physics and gridPosition
   void update(
     const Vector2 force = {0.0f, 0.0f}, const float timestep = TIMESTEP
   ) {
-    acceleration = Vector2Scale(force, 1 / mass);  // No friction
-    velocity = Vector2Add(velocity, Vector2Scale(acceleration, TIMESTEP));
+    acceleration = Vector2Scale(force, 1.0f / mass);  // No friction
+    velocity = Vector2Add(velocity, Vector2Scale(acceleration, timestep));
     velocity.x = (abs(velocity.x) < VELOCITY_THRESHOLD) ? 0.0f : velocity.x;
     velocity.y = (abs(velocity.y) < VELOCITY_THRESHOLD) ? 0.0f : velocity.y;
+    restingTicks =
+      (velocity.x == 0.0f && velocity.y == 0.0f) ? restingTicks + 1 : 0;
+    fast = Vector2Length(velocity) * timestep > radius;
 		oldPosition = position;
-    setPosition(Vector2Add(position, Vector2Scale(velocity, TIMESTEP)));
+    setPosition(Vector2Add(position, Vector2Scale(velocity, timestep)));
   }
 
+  // Collide with every circle in others, which are indices into circles
   // If idx is -1, double-checking collision will happen
+  // If cell is given, a pair is only handled in the cell returned by
+  // getPairCell(), so pairs that share several cells are handled once
   void handleCircleCollision(
-    const std::vector<Circle*> circles, const size_t idx = -1
+    std::vector<Circle>& circles, const std::vector<uint32_t>& others,
+    const size_t idx = -1, const Vector2 cell = {-1.0f, -1.0f}
   ) {
     // Choose if the loop should start at 0 or at idx
     size_t iterator = (idx == -1) ? 0 : idx;
-    for (size_t i = iterator; i < circles.size(); i++) {
+    for (size_t i = iterator; i < others.size(); i++) {
       Circle* a = this;
-      Circle* b = circles[i];
+      Circle* b = &circles[others[i]];
 
       if (a == b) continue;
+      if (!shouldCollide(*a, *b)) continue;
+      if (cell.x >= 0 && !Vector2Equals(getPairCell(*a, *b), cell)) continue;
+
+      collisionStats.candidatePairs += 1;
+
+      if (!isCirclePair(*a, *b)) {
+        handleShapeCollision(*a, *b);
+        continue;
+      }
 
       float sumOfRadii(pow(a->radius + b->radius, 2));
       float distanceBetweenCenters(Vector2DistanceSqr(a->position, b->position));
 
       // Collision detected
       if (sumOfRadii >= distanceBetweenCenters) {
-        Vector2 collisionNormalAB(
-          {b->position.x - a->position.x, b->position.y - a->position.y}
-        );
-        Vector2 relativeVelocityAB(Vector2Subtract(a->velocity, b->velocity));
-        Vector2 collisionNormalABNormalized(Vector2Normalize(collisionNormalAB)
-        );
-        Vector2 relativeVelocityABNormalized(Vector2Normalize(relativeVelocityAB
-        ));
-
-        // Collision response
-        // Check dot product between collision normal and relative velocity
-        if (Vector2DotProduct(relativeVelocityABNormalized, collisionNormalABNormalized) > 0) {
-          float impulse =
-            Circle::getImpulse(*a, *b, relativeVelocityAB, collisionNormalAB);
-          a->velocity = Vector2Add(
-            a->velocity,
-            Vector2Scale(
-              Vector2Scale(collisionNormalAB, 1.0f / a->mass), impulse
-            )
-          );
-          b->velocity = Vector2Subtract(
-            b->velocity,
-            Vector2Scale(
-              Vector2Scale(collisionNormalAB, 1.0f / b->mass), impulse
-            )
-          );
-        }
+        collisionStats.addOverlap(a->index, b->index);
+        sleepSystem.addTouchingPair(a->index, b->index);
+        // Response happens once every contact of the tick is known
+        contactSolver.addContact(*a, *b, ELASTICITY, VELOCITY_THRESHOLD);
+      } else if (a->fast || b->fast) {
+        sweptHits.test(*a, *b);
       }
     }
   }
 
+  // Collide a pair with a box or capsule through the table in shape.h
+  // These pairs are never swept, see ccd.h
+  static void handleShapeCollision(const Circle& a, const Circle& b) {
+    ShapeContact shapeContact;
+    if (!collideShapes(a, b, &shapeContact)) return;
+    collisionStats.addOverlap(a.index, b.index);
+    sleepSystem.addTouchingPair(a.index, b.index);
+    contactSolver.addContact(
+      a, b, shapeContact, ELASTICITY, VELOCITY_THRESHOLD
+    );
+  }
+
+  // Mirror the circle back in if it went past a screen edge, so it ends up
+  // where it would be had it bounced off the edge itself
   void handleEdgeCollision(
     const int screenWidth = WINDOW_WIDTH, const int screenHeight = WINDOW_HEIGHT
   ) {
-    // Check if the circle should bounce off of the screen edge
-    bool circleIsOutOfBoundsX =
-      position.x >= (screenWidth - radius) || position.x <= radius;
-    bool circleIsOutOfBoundsY =
-      position.y >= (screenHeight - radius) || position.y <= radius;
-    if (circleIsOutOfBoundsX) {
-			setPosition(oldPosition);
-      velocity.x *= -1.0f;
-    }
-    if (circleIsOutOfBoundsY) {
-			setPosition(oldPosition);
-      velocity.y *= -1.0f;
-    }
+    setPosition(reflectOffEdges(
+      position, &velocity, getShapeHalfSize(*this), screenWidth, screenHeight
+    ));
   }
 
   void setPosition(const Vector2 newPosition) {
@@ -181,9 +234,16 @@ struct Circle {
 
   void refreshGridPositions() {
     // Get the min(bottom-left) and max(top-right) extents of the Circle (just
-    // like an AABB)
-    Vector2 min = {position.x - radius, position.y + radius};
-    Vector2 max = {position.x + radius, position.y - radius};
+    // like an AABB), or of its box or capsule
+    // A fast circle covers every cell it swept through this tick
+    Vector2 from = fast ? oldPosition : position;
+    Vector2 halfSize = getShapeHalfSize(*this);
+    Vector2 min = {
+      fminf(from.x, position.x) - halfSize.x,
+      fmaxf(from.y, position.y) + halfSize.y};
+    Vector2 max = {
+      fmaxf(from.x, position.x) + halfSize.x,
+      fminf(from.y, position.y) - halfSize.y};
 
     Vector2 minGridPosition = convertToGridPosition(min);
     Vector2 maxGridPosition = convertToGridPosition(max);
@@ -205,17 +265,13 @@ struct Circle {
 		}
   }
 
-  static float getImpulse(
-    Circle a, Circle b, Vector2 relativeVelocity, Vector2 collisionNormal
-  ) {
-    float impulse(-(
-      ((1.0f + ELASTICITY) *
-       (Vector2DotProduct(relativeVelocity, collisionNormal)) /
-       (Vector2DotProduct(collisionNormal, collisionNormal) *
-        ((1.0f / a.mass) + (1.0f / b.mass))))
-    ));
-
-    return impulse;
+  // Top-left cell of the cells a and b are both filed in, which is the
+  // leftmost column and topmost row of their gridPositions
+  // Both circles are always in it, unless it is off the screen
+  static Vector2 getPairCell(const Circle& a, const Circle& b) {
+    return {
+      fmaxf(fmaxf(a.gridPositions.front().x, b.gridPositions.front().x), 0.0f),
+      fmaxf(fmaxf(a.gridPositions.back().y, b.gridPositions.back().y), 0.0f)};
   }
 
   static Vector2 convertToGridPosition(const Vector2 position) {
@@ -228,7 +284,11 @@ struct Circle {
 struct Cell {
   Vector2 topLeft;
   int size = GRID_SIZE;
-  std::vector<Circle*> objects;
+  // Indices into the circles the grid was filled from, so they stay valid
+  // when the circles are reallocated
+  std::vector<uint32_t> objects;
+  // Layers of the objects, see layers.h
+  LayerSummary layers;
 
   Cell() {}
 
@@ -277,43 +337,940 @@ struct UniformGrid {
     for (size_t i = 0; i < cells.size(); i++) {
       for (size_t j = 0; j < cells[i].size(); j++) {
         cells[i][j].objects.clear();
+        cells[i][j].layers.clear();
+      }
+    }
+  }
+
+  int columnCount() const { return static_cast<int>(cells[0].size()); }
+  int rowCount() const { return static_cast<int>(cells.size()); }
+
+  // Cells a box covers, as {minX, minY, maxX, maxY}
+  // Circles poking off the screen are filed in the edge cells, so the range
+  // is clamped to the grid
+  void getCellRange(
+    const Vector2 topLeft, const Vector2 bottomRight, int range[4]
+  ) const {
+    Vector2 minGridPosition = Circle::convertToGridPosition(topLeft);
+    Vector2 maxGridPosition = Circle::convertToGridPosition(bottomRight);
+    range[0] = Clamp(minGridPosition.x, 0.0f, columnCount() - 1.0f);
+    range[1] = Clamp(minGridPosition.y, 0.0f, rowCount() - 1.0f);
+    range[2] = Clamp(maxGridPosition.x, 0.0f, columnCount() - 1.0f);
+    range[3] = Clamp(maxGridPosition.y, 0.0f, rowCount() - 1.0f);
+  }
+
+  // Run visit(circle) for every circle whose AABB overlaps the box
+  // A circle filed in several cells is only visited from the cell holding the
+  // top-left corner of where its AABB and the box overlap
+  template <typename Visit>
+  void forEachCircleInAabb(
+    const std::vector<Circle>& circles, const Vector2 topLeft,
+    const Vector2 bottomRight, Visit visit
+  ) const {
+    int range[4];
+    getCellRange(topLeft, bottomRight, range);
+    int minX = range[0];
+    int minY = range[1];
+    int maxX = range[2];
+    int maxY = range[3];
+
+    for (int y = minY; y <= maxY; y++) {
+      for (int x = minX; x <= maxX; x++) {
+        const std::vector<uint32_t>& objects = cells[y][x].objects;
+        for (size_t i = 0; i < objects.size(); i++) {
+          const Circle& circle = circles[objects[i]];
+          Vector2 halfSize = getShapeHalfSize(circle);
+          Vector2 circleTopLeft = Vector2Subtract(circle.position, halfSize);
+          Vector2 circleBottomRight = Vector2Add(circle.position, halfSize);
+          if (!aabbsOverlap(circleTopLeft, circleBottomRight, topLeft, bottomRight)) {
+            continue;
+          }
+          Vector2 corner = Circle::convertToGridPosition({
+            fmaxf(circleTopLeft.x, topLeft.x), fmaxf(circleTopLeft.y, topLeft.y)});
+          int cornerX = Clamp(corner.x, 0.0f, columnCount() - 1.0f);
+          int cornerY = Clamp(corner.y, 0.0f, rowCount() - 1.0f);
+          if (cornerX != x || cornerY != y) continue;
+          visit(circle);
+        }
+      }
+    }
+  }
+
+  void queryCircle(
+    const std::vector<Circle>& circles, const Vector2 center, const float radius,
+    QueryBuffer& buffer
+  ) const {
+    QueryShape query = makeQueryCircle(center, radius);
+    forEachCircleInAabb(
+      circles, Vector2SubtractValue(center, radius), Vector2AddValue(center, radius),
+      [&](const Circle& circle) {
+        if (bodyOverlapsQuery(circle, query)) buffer.add(circle.index);
+      }
+    );
+  }
+
+  void queryAabb(
+    const std::vector<Circle>& circles, const Vector2 topLeft,
+    const Vector2 bottomRight, QueryBuffer& buffer
+  ) const {
+    QueryShape query = makeQueryBox(topLeft, bottomRight);
+    forEachCircleInAabb(circles, topLeft, bottomRight, [&](const Circle& circle) {
+      if (bodyOverlapsQuery(circle, query)) buffer.add(circle.index);
+    });
+  }
+
+  // Add the index of every circle filed in the cell range to candidates,
+  // once each: from the first cell of the range it is filed in
+  void gatherCandidates(
+    const std::vector<Circle>& circles, const int range[4],
+    std::vector<uint32_t>& candidates
+  ) const {
+    Vector2 rangeTopLeft = {
+      static_cast<float>(range[0] * GRID_SIZE),
+      static_cast<float>(range[1] * GRID_SIZE)};
+    for (int y = range[1]; y <= range[3]; y++) {
+      for (int x = range[0]; x <= range[2]; x++) {
+        const std::vector<uint32_t>& objects = cells[y][x].objects;
+        for (size_t i = 0; i < objects.size(); i++) {
+          const Circle& circle = circles[objects[i]];
+          Vector2 circleTopLeft =
+            Vector2Subtract(circle.position, getShapeHalfSize(circle));
+          Vector2 corner = Circle::convertToGridPosition({
+            fmaxf(circleTopLeft.x, rangeTopLeft.x),
+            fmaxf(circleTopLeft.y, rangeTopLeft.y)});
+          int cornerX = Clamp(corner.x, 0.0f, columnCount() - 1.0f);
+          int cornerY = Clamp(corner.y, 0.0f, rowCount() - 1.0f);
+          if (cornerX != x || cornerY != y) continue;
+          candidates.push_back(objects[i]);
+        }
+      }
+    }
+  }
+
+  // Offer nearest every circle whose center is in cell (x, y)
+  void offerCellToNearest(
+    const std::vector<Circle>& circles, const int x, const int y,
+    const Vector2 point, NearestHeap& nearest
+  ) const {
+    const std::vector<uint32_t>& objects = cells[y][x].objects;
+    for (size_t i = 0; i < objects.size(); i++) {
+      const Circle& circle = circles[objects[i]];
+      // Circles spanning several cells are only counted in their center's
+      Vector2 cell = Circle::convertToGridPosition(circle.position);
+      int cellX = Clamp(cell.x, 0.0f, columnCount() - 1.0f);
+      int cellY = Clamp(cell.y, 0.0f, rowCount() - 1.0f);
+      if (cellX != x || cellY != y) continue;
+      nearest.offer(circle.index, Vector2DistanceSqr(point, circle.position));
+    }
+  }
+
+  // Search rings of cells around point, nearest ring first, until no circle
+  // outside the rings searched so far can beat the ones found
+  void queryNearest(
+    const std::vector<Circle>& circles, const Vector2 point, NearestHeap& nearest
+  ) const {
+    if (nearest.k == 0) return;
+    Vector2 start = Circle::convertToGridPosition(point);
+    int startX = Clamp(start.x, 0.0f, columnCount() - 1.0f);
+    int startY = Clamp(start.y, 0.0f, rowCount() - 1.0f);
+
+    for (int ring = 0;; ring++) {
+      int minX = startX - ring;
+      int minY = startY - ring;
+      int maxX = startX + ring;
+      int maxY = startY + ring;
+
+      for (int y = minY; y <= maxY; y++) {
+        if (y < 0 || y >= rowCount()) continue;
+        bool isEdgeRow = y == minY || y == maxY;
+        for (int x = minX; x <= maxX; x += isEdgeRow ? 1 : maxX - minX) {
+          if (x >= 0 && x < columnCount()) {
+            offerCellToNearest(circles, x, y, point, nearest);
+          }
+          if (minX == maxX) break;
+        }
+      }
+
+      // Closest any circle centered outside the rings can be
+      float bound = INFINITY;
+      if (minX > 0) bound = fminf(bound, point.x - minX * GRID_SIZE);
+      if (minY > 0) bound = fminf(bound, point.y - minY * GRID_SIZE);
+      if (maxX < columnCount() - 1) {
+        bound = fminf(bound, (maxX + 1) * GRID_SIZE - point.x);
+      }
+      if (maxY < rowCount() - 1) {
+        bound = fminf(bound, (maxY + 1) * GRID_SIZE - point.y);
       }
+      if (bound == INFINITY) return;  // The rings cover the whole grid
+      if (bound > 0.0f && bound * bound >= nearest.worstDistanceSqr()) return;
+    }
+  }
+
+  // Walk the cells along the ray in order (Amanatides & Woo), and stop once
+  // the nearest hit so far is inside the cells already walked
+  void raycast(
+    const std::vector<Circle>& circles, const Ray2& ray, RaycastHit* best
+  ) const {
+    Vector2 gridBottomRight = {
+      static_cast<float>(columnCount() * GRID_SIZE),
+      static_cast<float>(rowCount() * GRID_SIZE)};
+    float enter;
+    float exit;
+    if (!rayHitsAabb(ray, {0.0f, 0.0f}, gridBottomRight, &enter, &exit)) return;
+
+    Vector2 start = Vector2Add(ray.origin, Vector2Scale(ray.direction, enter));
+    Vector2 startCell = Circle::convertToGridPosition(start);
+    int x = Clamp(startCell.x, 0.0f, columnCount() - 1.0f);
+    int y = Clamp(startCell.y, 0.0f, rowCount() - 1.0f);
+
+    int stepX = (ray.direction.x > 0.0f) ? 1 : -1;
+    int stepY = (ray.direction.y > 0.0f) ? 1 : -1;
+    // Distance along the ray to the next column and row boundary
+    float nextX = INFINITY;
+    float nextY = INFINITY;
+    float deltaX = INFINITY;
+    float deltaY = INFINITY;
+    if (ray.direction.x != 0.0f) {
+      float boundary = (x + (stepX > 0 ? 1 : 0)) * GRID_SIZE;
+      nextX = (boundary - ray.origin.x) / ray.direction.x;
+      deltaX = GRID_SIZE / fabsf(ray.direction.x);
+    }
+    if (ray.direction.y != 0.0f) {
+      float boundary = (y + (stepY > 0 ? 1 : 0)) * GRID_SIZE;
+      nextY = (boundary - ray.origin.y) / ray.direction.y;
+      deltaY = GRID_SIZE / fabsf(ray.direction.y);
+    }
+
+    while (true) {
+      const std::vector<uint32_t>& objects = cells[y][x].objects;
+      for (size_t i = 0; i < objects.size(); i++) {
+        testRaycastHit(ray, circles[objects[i]], best);
+      }
+
+      float cellExit = fminf(nextX, nextY);
+      if (best->hit && best->distance <= cellExit) return;
+      if (cellExit > exit) return;
+
+      if (nextX < nextY) {
+        x += stepX;
+        nextX += deltaX;
+      } else {
+        y += stepY;
+        nextY += deltaY;
+      }
+      if (x < 0 || y < 0 || x >= columnCount() || y >= rowCount()) return;
     }
   }
 };
 
-// Add objects to cells
+// Add the objects listed in indices to cells
 static void refreshCellObjects(
-  UniformGrid* uniformGrid, std::vector<Circle*> objects
+  UniformGrid* uniformGrid, std::vector<Circle>& objects,
+  const std::vector<uint32_t>& indices
 ) {
   uniformGrid->clearCells();
-  for (size_t i = 0; i < objects.size(); i++) {
-    for (size_t j = 0; j < objects[i]->gridPositions.size(); j++) {
-      int gridX = objects[i]->gridPositions[j].x;
-      int gridY = objects[i]->gridPositions[j].y;
+  for (size_t k = 0; k < indices.size(); k++) {
+    size_t i = indices[k];
+    for (size_t j = 0; j < objects[i].gridPositions.size(); j++) {
+      int gridX = objects[i].gridPositions[j].x;
+      int gridY = objects[i].gridPositions[j].y;
       // Only add if object is inside cells within screen borders
       bool isInsideValidCell = gridY < uniformGrid->cells.size() &&
                                gridX < uniformGrid->cells[0].size();
       if (isInsideValidCell) {
-        uniformGrid->cells[gridY][gridX].objects.push_back(objects[i]);
+        Cell& cell = uniformGrid->cells[gridY][gridX];
+        cell.objects.push_back(i);
+        cell.layers.add(objects[i].category, objects[i].mask);
       }
     }
   }
 }
 
-int main() {
-  srand(GetTime());
-
-  // Counts the number of times the user has spawned a batch of small circles
-  int numberOfSpawnKeyPresses = 0;
+// What --circles spawns unless told otherwise
+static SpawnParams getDefaultSpawnParams() {
+  SpawnParams params;
+  params.radiusMin = SMALL_CIRCLE_RADIUS_MIN;
+  params.radiusMax = SMALL_CIRCLE_RADIUS_MAX;
+  params.mass = SMALL_CIRCLE_MASS;
+  params.bigRadius = BIG_CIRCLE_RADIUS;
+  params.bigMass = BIG_CIRCLE_MASS;
+  params.smallCirclesPerBigCircle =
+    SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY *
+    NUMBER_OF_PRESSES_UNTIL_BIG_CIRCLE_SPAWNS;
+  params.velocityMin = CIRCLE_VELOCITY_MIN;
+  params.velocityMax = CIRCLE_VELOCITY_MAX;
+  params.screenWidth = WINDOW_WIDTH;
+  params.screenHeight = WINDOW_HEIGHT;
+  return params;
+}
 
+struct Simulation {
   UniformGrid uniformGrid = UniformGrid();
+  // Only rebuilt when a circle falls asleep or wakes up
+  UniformGrid sleepingGrid = UniformGrid();
+
+  std::vector<Circle> circles;
+  std::vector<uint32_t> awakeCircles;
+  std::vector<uint32_t> sleepingCircles;
+  // Set whenever circles are added or change between awake and asleep
+  bool sleepListsDirty = true;
+  // Set whenever circles may have moved since uniformGrid was filled
+  bool queryIndexDirty = true;
+
+  // Used for everything spawned into this simulation
+  Rng rng;
+  JobPool jobPool;
+
+  // Ticks run so far
+  uint32_t tick = 0;
+  // Seconds simulated per tick
+  float timestep = TIMESTEP;
+  // Split ticks into substeps when circles move fast or overlap deeply
+  bool adaptiveSubsteps = false;
+  int maxSubsteps = DEFAULT_MAX_SUBSTEPS;
+  Recorder recorder;
+  InputLog inputLog;
+
+  // Finds circles by handle after despawns move them to other indices
+  CircleHandles circleHandles;
+  // Pairs that began, kept or stopped touching last tick, see events.h
+  CollisionEvents collisionEvents;
+  // Ticks every circle spawned from now on lives, 0 for forever
+  int lifetime = 0;
+  std::vector<uint32_t> despawnScratch;
+  // Layers new circles are split between, see layers.h
+  int layerCount = 1;
+  // Walls that never move, baked once at startup, see obstacles.h
+  StaticObstacles obstacles;
+  // Pressure and viscosity between circles, off unless enabled, see fluid.h
+  FluidSolver fluid;
+
+  // Ticks between sorting circles by cell, 0 for never, see reorder.h
+  int reorderInterval = DEFAULT_REORDER_INTERVAL;
+  CircleReorder reorder;
 
-  std::vector<Circle*> circles;
+  // Counts the number of times the user has spawned a batch of small circles
+  int numberOfSpawnKeyPresses = 0;
 
   int numberOfSmallCirclesPresent = 0;
   int numberOfBigCirclesPresent = 0;
 
+  size_t circleCount() const { return circles.size(); }
+
+  Circle& getCircle(const size_t index) { return circles[index]; }
+
+  // Wake a circle from outside the tick, like when the mouse grabs it
+  void wakeCircle(const size_t index) {
+    Circle& circle = circles[index];
+    circle.restingTicks = 0;
+    if (!circle.sleeping) return;
+    circle.sleeping = false;
+    sleepListsDirty = true;
+  }
+
+  // Give new circles handles, see despawn.h
+  void assignHandles() {
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    assignCircleLayers(circles.size(), getCircle, layerCount);
+    assignCircleHandles(circleHandles, circles.size(), getCircle, lifetime);
+  }
+
+  // Remove the circles at indices, given in any order, and empty indices
+  // Each one's slot takes the last circle, so the rest stay where they are
+  void despawnCircles(std::vector<uint32_t>& indices) {
+    if (indices.empty()) return;
+    // Indices change below, so the contact cache goes through handle slots
+    remapContactsToSlots(contactSolver, [&](uint32_t index) -> Circle& {
+      return circles[index];
+    });
+
+    sortForDespawn(indices);
+    for (size_t i = 0; i < indices.size(); i++) {
+      uint32_t index = indices[i];
+      // Walls are not counted
+      if (circles[index].shape == ShapeType::circle) {
+        if (circles[index].radius >= BIG_CIRCLE_RADIUS) {
+          numberOfBigCirclesPresent -= 1;
+        } else {
+          numberOfSmallCirclesPresent -= 1;
+        }
+      }
+      circleHandles.remove(circles[index].handle);
+      if (index != circles.size() - 1) {
+        circles[index] = std::move(circles.back());
+        circles[index].index = index;
+        circleHandles.move(circles[index].handle, index);
+      }
+      circles.pop_back();
+    }
+    indices.clear();
+
+    remapContactsToIndices(contactSolver, circleHandles);
+    sleepListsDirty = true;
+    queryIndexDirty = true;
+    recorder.circlesMoved = true;
+  }
+
+  // Despawn the circle with handle
+  // Returns false if it was already gone
+  bool despawn(const CircleHandle handle) {
+    uint32_t index = circleHandles.find(handle);
+    if (index == INVALID_CIRCLE) return false;
+    despawnScratch.assign(1, index);
+    despawnCircles(despawnScratch);
+    return true;
+  }
+
+  // Despawn every circle overlapping a box
+  // Returns the number despawned
+  size_t despawnInAabb(const Vector2 topLeft, const Vector2 bottomRight) {
+    despawnScratch.resize(circles.size());
+    size_t found = queryAabb(
+      topLeft, bottomRight, despawnScratch.data(), despawnScratch.size()
+    );
+    despawnScratch.resize(found);
+    despawnCircles(despawnScratch);
+    return found;
+  }
+
+  // Sort circles by the Morton code of their cell, so circles that are close
+  // in space are close in memory too
+  void reorderCircles() {
+    // Indices change below, so the contact cache goes through handle slots
+    remapContactsToSlots(contactSolver, [&](uint32_t index) -> Circle& {
+      return circles[index];
+    });
+    bool moved = reorder.sort(
+      circles, [](const Vector2 position, uint32_t* x, uint32_t* y) {
+        Vector2 cell = Circle::convertToGridPosition(position);
+        *x = static_cast<uint32_t>(fmaxf(cell.x, 0.0f));
+        *y = static_cast<uint32_t>(fmaxf(cell.y, 0.0f));
+      }
+    );
+    if (moved) {
+      assignHandles();
+      sleepListsDirty = true;
+      queryIndexDirty = true;
+      recorder.circlesMoved = true;
+    }
+    remapContactsToIndices(contactSolver, circleHandles);
+  }
+
+  // Bytes held by the circles and the grid
+  size_t memoryUsage() const {
+    size_t bytes = sizeof(Simulation) + circles.capacity() * sizeof(Circle);
+    for (size_t i = 0; i < circles.size(); i++) {
+      bytes += circles[i].gridPositions.capacity() * sizeof(Vector2);
+    }
+    bytes += (awakeCircles.capacity() + sleepingCircles.capacity()) *
+               sizeof(uint32_t) +
+             circleHandles.memoryUsage() + reorder.memoryUsage() +
+             collisionEvents.memoryUsage() + obstacles.memoryUsage() +
+             fluid.memoryUsage();
+    const UniformGrid* grids[] = {&uniformGrid, &sleepingGrid};
+    for (const UniformGrid* grid : grids) {
+      for (size_t i = 0; i < grid->cells.size(); i++) {
+        bytes += grid->cells[i].capacity() * sizeof(Cell);
+        for (size_t j = 0; j < grid->cells[i].size(); j++) {
+          bytes += grid->cells[i][j].objects.capacity() * sizeof(uint32_t);
+        }
+      }
+    }
+    return bytes;
+  }
+
+  void handleSpawnKeyPress() {
+    numberOfSpawnKeyPresses += 1;
+    sleepListsDirty = true;
+    // If user reaches 10 presses, spawn a big boy
+    if (numberOfSpawnKeyPresses % NUMBER_OF_PRESSES_UNTIL_BIG_CIRCLE_SPAWNS == 0) {
+      circles.push_back(Circle());
+      circles[circles.size() - 1].spawn(rng, CircleSize::big);
+      numberOfSpawnKeyPresses = 0;
+      numberOfBigCirclesPresent += 1;
+    }
+
+    // Spawn small circles
+    for (int i = 0; i < SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY; i++) {
+      circles.push_back(Circle());
+      circles[circles.size() - 1].spawn(rng);
+    }
+    numberOfSmallCirclesPresent += SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY;
+    assignHandles();
+  }
+
+  // Add body as a wall or paddle, see shape.h: as heavy as IMMOVABLE_MASS,
+  // in every layer and never despawning, so whatever hits it bounces off and
+  // it keeps moving at velocity
+  // Returns its handle
+  CircleHandle addWall(Circle body, const Vector2 velocity) {
+    body.mass = IMMOVABLE_MASS;
+    body.color = DARKGRAY;
+    body.velocity = velocity;
+    body.oldPosition = body.position;
+    circles.push_back(body);
+    sleepListsDirty = true;
+    assignHandles();
+    Circle& wall = circles.back();
+    wall.category = ALL_LAYERS;
+    wall.mask = ALL_LAYERS;
+    wall.ticksToLive = 0;
+    return wall.handle;
+  }
+
+  CircleHandle addBox(
+    const Vector2 center, const Vector2 halfExtents, const Vector2 velocity
+  ) {
+    Circle box;
+    makeBox(box, center, halfExtents);
+    return addWall(box, velocity);
+  }
+
+  CircleHandle addCapsule(
+    const Vector2 center, const Vector2 halfAxis, const float radius,
+    const Vector2 velocity
+  ) {
+    Circle capsule;
+    makeCapsule(capsule, center, halfAxis, radius);
+    return addWall(capsule, velocity);
+  }
+
+  // Spawn count circles in bulk
+  // Anything params leaves at zero comes from this program's constants
+  void populate(const size_t count, const SpawnParams& requestedParams) {
+    SpawnParams params = requestedParams.withDefaults(getDefaultSpawnParams());
+    spawnCircles(circles, count, params, rng, jobPool);
+    sleepListsDirty = true;
+
+    for (size_t i = 0; i < count; i++) {
+      if (shouldSpawnBig(params.distribution, i, params.smallCirclesPerBigCircle)) {
+        numberOfBigCirclesPresent += 1;
+      } else {
+        numberOfSmallCirclesPresent += 1;
+      }
+    }
+    assignHandles();
+  }
+
+  // Write every circle to a snapshot file
+  bool saveSnapshot(const char* path) const {
+    Snapshot snapshot;
+    const std::vector<CachedContact>& contacts = contactSolver.cachedContacts;
+    snapshot.allocate(
+      circles.size(), contacts.size(), numberOfSpawnKeyPresses, tick, rng
+    );
+    for (size_t i = 0; i < circles.size(); i++) {
+      snapshot.storeCircle(i, circles[i]);
+    }
+    for (size_t i = 0; i < contacts.size(); i++) {
+      snapshot.storeContact(i, contacts[i].a, contacts[i].b, contacts[i].impulse);
+    }
+    return snapshot.save(path);
+  }
+
+  // Replace every circle with the ones in a snapshot file
+  bool loadSnapshot(const char* path) {
+    Snapshot snapshot;
+    if (!snapshot.load(path)) return false;
+
+    circles.clear();
+    circles.resize(snapshot.circleCount());
+    jobPool.parallelFor(
+      circles.size(), SPAWN_CHUNK_SIZE,
+      [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          snapshot.loadCircle(i, circles[i]);
+        }
+      }
+    );
+
+    numberOfSpawnKeyPresses = snapshot.header->numberOfSpawnKeyPresses;
+    tick = snapshot.header->tick;
+    rng = snapshot.getRng();
+    sleepListsDirty = true;
+    recorder.circlesMoved = true;
+    contactSolver.clearCache();
+    for (size_t i = 0; i < snapshot.contactCount(); i++) {
+      contactSolver.addCachedContact(
+        snapshot.contactA[i], snapshot.contactB[i], snapshot.contactImpulse[i]
+      );
+    }
+    contactSolver.indexCachedContacts();
+    numberOfSmallCirclesPresent = 0;
+    numberOfBigCirclesPresent = 0;
+    for (size_t i = 0; i < circles.size(); i++) {
+      if (circles[i].radius >= BIG_CIRCLE_RADIUS) {
+        numberOfBigCirclesPresent += 1;
+      } else {
+        numberOfSmallCirclesPresent += 1;
+      }
+    }
+    circleHandles.removeAll();
+    // Layers come from the snapshot, so only handles are handed out
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    assignCircleHandles(circleHandles, circles.size(), getCircle, lifetime);
+    return true;
+  }
+
+  // Checksum of every circle
+  uint64_t checksum() const {
+    uint64_t checksum = CHECKSUM_OFFSET_BASIS;
+    for (size_t i = 0; i < circles.size(); i++) {
+      checksum = addCircleToChecksum(checksum, circles[i]);
+    }
+    return checksum;
+  }
+
+  // Add the current tick to the recording
+  void record() {
+    recorder.beginFrame(tick, circles.size());
+    for (size_t i = 0; i < circles.size(); i++) {
+      recorder.addCircle(circles[i]);
+    }
+    recorder.endFrame();
+  }
+
+  // Split circles into awake and sleeping, and put the sleeping ones into
+  // sleepingGrid
+  void rebuildSleepLists() {
+    awakeCircles.clear();
+    sleepingCircles.clear();
+    for (size_t i = 0; i < circles.size(); i++) {
+      circles[i].index = i;
+      if (circles[i].sleeping) {
+        sleepingCircles.push_back(i);
+      } else {
+        awakeCircles.push_back(i);
+      }
+    }
+    refreshCellObjects(&sleepingGrid, circles, sleepingCircles);
+    sleepListsDirty = false;
+  }
+
+  // Refile awake circles in uniformGrid where the last tick left them
+  // The solver moves circles after the broadphase, so the grid is a little
+  // out of date until then. Every query does this itself, but it has to be
+  // called before queries run on several threads
+  void refreshQueryIndex() {
+    if (sleepListsDirty) rebuildSleepLists();
+    if (!queryIndexDirty) return;
+    refreshCellObjects(&uniformGrid, circles, awakeCircles);
+    queryIndexDirty = false;
+  }
+
+  // Write the indices of the circles overlapping a circle into indices
+  // Returns the number found, which can be more than capacity
+  size_t queryCircle(
+    const Vector2 center, const float radius, uint32_t* indices,
+    const size_t capacity
+  ) {
+    refreshQueryIndex();
+    QueryBuffer buffer(indices, capacity);
+    uniformGrid.queryCircle(circles, center, radius, buffer);
+    sleepingGrid.queryCircle(circles, center, radius, buffer);
+    return buffer.count;
+  }
+
+  // Write the indices of the circles overlapping a box into indices
+  // Returns the number found, which can be more than capacity
+  size_t queryAabb(
+    const Vector2 topLeft, const Vector2 bottomRight, uint32_t* indices,
+    const size_t capacity
+  ) {
+    refreshQueryIndex();
+    QueryBuffer buffer(indices, capacity);
+    uniformGrid.queryAabb(circles, topLeft, bottomRight, buffer);
+    sleepingGrid.queryAabb(circles, topLeft, bottomRight, buffer);
+    return buffer.count;
+  }
+
+  // Write the k circles whose centers are nearest to point into indices and
+  // their squared distances into distancesSqr, nearest first
+  // Returns the number found, at most k
+  size_t queryNearest(
+    const Vector2 point, const size_t k, uint32_t* indices, float* distancesSqr
+  ) {
+    refreshQueryIndex();
+    NearestHeap nearest(indices, distancesSqr, k);
+    uniformGrid.queryNearest(circles, point, nearest);
+    sleepingGrid.queryNearest(circles, point, nearest);
+    nearest.sort();
+    return nearest.count;
+  }
+
+  // First circle hit by a ray from origin towards direction within
+  // maxDistance
+  // Returns false if the ray hits nothing
+  bool raycast(
+    const Vector2 origin, const Vector2 direction, const float maxDistance,
+    RaycastHit* hit
+  ) {
+    refreshQueryIndex();
+    Ray2 ray = {origin, Vector2Normalize(direction), maxDistance};
+    *hit = RaycastHit();
+    uniformGrid.raycast(circles, ray, hit);
+    sleepingGrid.raycast(circles, ray, hit);
+    return hit->hit;
+  }
+
+  // Run every query in batch, in Morton order of their grid cells and split
+  // across jobPool
+  // Circle and box queries in a row that cover the same cells share one list
+  // of the circles filed there
+  void runQueries(QueryBatch& batch) {
+    refreshQueryIndex();
+    batch.sort([](const Vector2 point, uint32_t* x, uint32_t* y) {
+      Vector2 cell = Circle::convertToGridPosition(point);
+      *x = static_cast<uint32_t>(fmaxf(cell.x, 0.0f));
+      *y = static_cast<uint32_t>(fmaxf(cell.y, 0.0f));
+    });
+    batch.run(
+      jobPool,
+      [&](const uint32_t* ids, size_t count, std::vector<uint32_t>& candidates) {
+        int gatheredRange[4] = {-1, -1, -1, -1};
+        candidates.clear();
+        for (size_t i = 0; i < count; i++) {
+          const Query& query = batch.queries[ids[i]];
+          QueryResult& result = batch.results[ids[i]];
+          if (query.type == QueryType::nearest) {
+            NearestHeap nearest = batch.getHeap(ids[i]);
+            uniformGrid.queryNearest(circles, query.a, nearest);
+            sleepingGrid.queryNearest(circles, query.a, nearest);
+            nearest.sort();
+            result.count = nearest.count;
+            continue;
+          }
+          if (query.type == QueryType::raycast) {
+            Ray2 ray = {query.a, query.b, query.radius};
+            uniformGrid.raycast(circles, ray, &result.hit);
+            sleepingGrid.raycast(circles, ray, &result.hit);
+            continue;
+          }
+
+          bool isCircle = query.type == QueryType::circle;
+          Vector2 topLeft =
+            isCircle ? Vector2SubtractValue(query.a, query.radius) : query.a;
+          Vector2 bottomRight =
+            isCircle ? Vector2AddValue(query.a, query.radius) : query.b;
+          int range[4];
+          uniformGrid.getCellRange(topLeft, bottomRight, range);
+          if (memcmp(range, gatheredRange, sizeof(range)) != 0) {
+            candidates.clear();
+            uniformGrid.gatherCandidates(circles, range, candidates);
+            sleepingGrid.gatherCandidates(circles, range, candidates);
+            memcpy(gatheredRange, range, sizeof(range));
+          }
+
+          QueryBuffer buffer = batch.getBuffer(ids[i]);
+          QueryShape shape = isCircle ? makeQueryCircle(query.a, query.radius)
+                                      : makeQueryBox(query.a, query.b);
+          for (size_t j = 0; j < candidates.size(); j++) {
+            const Circle& circle = circles[candidates[j]];
+            if (bodyOverlapsQuery(circle, shape)) buffer.add(circle.index);
+          }
+          result.count = buffer.count;
+        }
+      }
+    );
+  }
+
+  // Wake circles that were hit and put resting islands to sleep
+  void updateSleep() {
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    size_t woken = sleepSystem.wakeHitCircles(getCircle);
+    size_t fellAsleep = 0;
+    if (tick % SLEEP_CHECK_INTERVAL == 0) {
+      fellAsleep = sleepSystem.putRestingIslandsToSleep(circles.size(), getCircle);
+    }
+    if (woken > 0 || fellAsleep > 0) rebuildSleepLists();
+
+    collisionStats.wakes = woken;
+    collisionStats.sleepingCircles = sleepingCircles.size();
+  }
+
+  // Advance the physics by one timestep, split into substeps if
+  // adaptiveSubsteps is set
+  void step() {
+    collisionStats.reset();
+    sleepSystem.beginTick();
+    if (reorderInterval > 0 && tick % reorderInterval == 0) reorderCircles();
+    if (sleepListsDirty) rebuildSleepLists();
+
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    int substeps = 1;
+    if (adaptiveSubsteps) {
+      substeps = chooseSubsteps(
+        circles.size(), getCircle, contactSolver, timestep, maxSubsteps
+      );
+    }
+    for (int i = 0; i < substeps; i++) {
+      substep(timestep / substeps);
+    }
+    collisionStats.substeps = substeps;
+    updateSleep();
+    collisionEvents.endTick(circleHandles, getCircle);
+    if (lifetime > 0) {
+      findExpiredCircles(circles.size(), getCircle, despawnScratch);
+      despawnCircles(despawnScratch);
+    }
+
+    if (recorder.shouldRecord(tick)) record();
+    if (inputLog.isRecording()) inputLog.recordChecksum(tick, checksum());
+    tick += 1;
+    queryIndexDirty = true;
+  }
+
+  // Move, collide and solve every awake circle once, over dt
+  // Sleeping circles stay in sleepingGrid, where only awake circles test them
+  void substep(const float dt) {
+    contactSolver.beginTick();
+    sweptHits.beginTick();
+
+    // Fluid forces come from where every circle, awake or asleep, is now
+    // Sleeping circles add to the density but are not pushed until something
+    // wakes them
+    bool fluidEnabled = fluid.settings.enabled;
+    if (fluidEnabled) {
+      auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+      fluid.computeForces(
+        circles.size(), getCircle, WINDOW_WIDTH, WINDOW_HEIGHT, jobPool
+      );
+    }
+
+    // Move objects first!
+    for (size_t i = 0; i < awakeCircles.size(); i++) {
+      circles[awakeCircles[i]].update(
+        fluidEnabled ? fluid.forces[awakeCircles[i]] : Vector2{0.0f, 0.0f}, dt
+      );
+      circles[awakeCircles[i]].handleEdgeCollision();
+      obstacles.collide(circles[awakeCircles[i]], ELASTICITY);
+    }
+
+    // Re-add objects into cells
+    refreshCellObjects(&uniformGrid, circles, awakeCircles);
+
+    // Go through every cell and do collision handling
+    for (size_t i = 0; i < uniformGrid.cells.size(); i++) {
+      for (size_t j = 0; j < uniformGrid.cells[i].size(); j++) {
+        collisionStats.nodesVisited += 1;
+        bool shouldHandleCircleCollision(true);
+        const Cell& awakeCell = uniformGrid.cells[i][j];
+        const std::vector<uint32_t>& objects = awakeCell.objects;
+        if (objects.empty()) continue;
+
+        collisionStats.occupiedNodes += 1;
+        collisionStats.objectsInOccupiedNodes += objects.size();
+
+        const Cell& sleepingCell = sleepingGrid.cells[i][j];
+        const std::vector<uint32_t>& sleepers = sleepingCell.objects;
+
+        // If there are less than 2 objects, or none of them collide with
+        // each other, don't handle Circle collision
+        if (objects.size() < 2 || !awakeCell.layers.mayCollideWithin()) {
+          shouldHandleCircleCollision = false;
+        }
+        Vector2 cell = {static_cast<float>(j), static_cast<float>(i)};
+        for (size_t i = 0; i < objects.size(); i++) {
+          Circle& circle = circles[objects[i]];
+          if (shouldHandleCircleCollision) {
+            circle.handleCircleCollision(circles, objects, i + 1, cell);
+          }
+          if (!sleepers.empty() &&
+              sleepingCell.layers.mayCollide(circle.category, circle.mask)) {
+            circle.handleCircleCollision(circles, sleepers, 0, cell);
+          }
+        }
+      }
+    }
+
+    auto getCircle = [this](size_t index) -> Circle& { return circles[index]; };
+    collisionStats.sweptHits += sweptHits.resolve(
+      circles.size(), getCircle, contactSolver, ELASTICITY, VELOCITY_THRESHOLD
+    );
+    collisionStats.penetration += contactSolver.totalPenetration();
+    // Before solving, while contacts are still in the order they were found
+    collisionEvents.addContacts(contactSolver.contacts, getCircle);
+    collisionStats.impulses += contactSolver.solve(getCircle);
+    // The next substep replaces these contacts, so wake whoever they pushed now
+    sleepSystem.wakePushedCircles(contactSolver.contacts, getCircle);
+  }
+};
+
+int main(int argc, char** argv) {
+  Options options = parseOptions(argc, argv);
+
+  if (options.playPath) {
+    return runPlayback(
+      options.playPath, WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_NAME,
+      options.tickRate > 0 ? options.tickRate : TARGET_FPS
+    );
+  }
+
+  // A replay has to start from the seed it was recorded with
+  InputLog replayLog;
+  if (options.replayInputPath) {
+    if (!replayLog.load(options.replayInputPath)) return 1;
+    options.seed = replayLog.seed;
+  }
+
+  Simulation simulation;
+  simulation.rng = Rng(options.seed);
+  simulation.jobPool.start(options.threads);
+  if (options.tickRate > 0) simulation.timestep = 1.0f / options.tickRate;
+  simulation.adaptiveSubsteps = options.adaptiveSubsteps;
+  simulation.maxSubsteps = options.maxSubsteps;
+  simulation.lifetime = options.lifetime;
+  simulation.layerCount = options.layers;
+  if (options.events) simulation.collisionEvents.subscribeAll();
+  simulation.reorderInterval = options.reorderInterval;
+  simulation.fluid.settings.enabled = options.fluid;
+  simulation.fluid.settings.kernelRadius = options.fluidRadius;
+  contactSolver.iterations = options.solverIterations;
+  contactSolver.warmStarting = options.warmStarting;
+  contactSolver.positionIterations = options.positionIterations;
+  contactSolver.jobPool = &simulation.jobPool;
+  for (int i = 0; i < options.presses; i++) {
+    simulation.handleSpawnKeyPress();
+  }
+  simulation.populate(options.circles, options.spawn);
+  if (options.walls) addWalls(simulation, WINDOW_WIDTH, WINDOW_HEIGHT);
+  if (options.obstaclesPath &&
+      !simulation.obstacles.load(options.obstaclesPath)) {
+    return 1;
+  }
+  if (options.mazeSpacing > 0) {
+    addMaze(
+      simulation.obstacles, WINDOW_WIDTH, WINDOW_HEIGHT, options.mazeSpacing,
+      simulation.rng
+    );
+  }
+  simulation.obstacles.bake(WINDOW_WIDTH, WINDOW_HEIGHT);
+  if (options.loadPath && !simulation.loadSnapshot(options.loadPath)) {
+    return 1;
+  }
+  if (options.recordPath &&
+      !simulation.recorder.open(options.recordPath, options.recordEvery)) {
+    return 1;
+  }
+
+  if (options.replayInputPath) {
+    return runReplay(simulation, replayLog);
+  }
+  if (options.recordInputPath &&
+      !simulation.inputLog.openForRecording(
+        options.recordInputPath, options.seed, simulation.checksum()
+      )) {
+    return 1;
+  }
+
+  if (options.headless) {
+    runHeadless(
+      simulation, collisionStats, options, "uniform-grid", "cell"
+    );
+    if (options.savePath) simulation.saveSnapshot(options.savePath);
+    return 0;
+  }
+
   char smallCircleCountBuffer[50];
   int numberOfSmallCirclesPresentFormatted;
   char bigCircleCountBuffer[50];
@@ -324,6 +1281,8 @@ int main() {
 
   bool paused(false);
 	bool showGrid(false);
+  bool showStats(false);
+  Drag drag;
 
   InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_NAME);
   SetTargetFPS(TARGET_FPS);
@@ -331,6 +1290,7 @@ int main() {
     deltaTime = GetFrameTime();
 
     if (IsKeyPressed(PAUSE_KEY)) {
+      simulation.inputLog.recordEvent(simulation.tick, InputAction::pause);
       paused = !paused;
     }
 
@@ -338,56 +1298,42 @@ int main() {
 			showGrid = !showGrid;
 		}
 
+    if (IsKeyPressed(STATS_KEY)) {
+      showStats = !showStats;
+    }
+
+    if (IsKeyPressed(SAVE_KEY)) {
+      simulation.saveSnapshot(
+        options.savePath ? options.savePath : DEFAULT_SNAPSHOT_PATH
+      );
+    }
+    if (IsKeyPressed(LOAD_KEY)) {
+      simulation.loadSnapshot(
+        options.loadPath ? options.loadPath : DEFAULT_SNAPSHOT_PATH
+      );
+    }
+
+    drag.handleMouse(simulation, deltaTime);
+    if (IsMouseButtonDown(DESPAWN_BUTTON)) {
+      simulation.inputLog.recordDespawn(simulation.tick, drag.mouse);
+      simulation.despawnInAabb(
+        Vector2SubtractValue(drag.mouse, DESPAWN_HALF_WIDTH),
+        Vector2AddValue(drag.mouse, DESPAWN_HALF_WIDTH)
+      );
+    }
+
     if (!paused) {
       if (IsKeyPressed(SPAWN_KEY)) {
-        numberOfSpawnKeyPresses += 1;
-        // If user reaches 10 presses, spawn a big boy
-        if (numberOfSpawnKeyPresses % NUMBER_OF_PRESSES_UNTIL_BIG_CIRCLE_SPAWNS == 0) {
-          circles.push_back(new Circle());
-          circles[circles.size() - 1]->spawn(CircleSize::big);
-          numberOfSpawnKeyPresses = 0;
-          numberOfBigCirclesPresent += 1;
-        }
-
-        // Spawn small circles
-        int numberOfSmallCirclesAfterSpawning =
-          numberOfSmallCirclesPresent + SMALL_CIRCLES_TO_SPAWN_SIMULTANEOUSLY;
-        for (size_t i = circles.size(); i < numberOfSmallCirclesAfterSpawning;
-             i++) {
-          circles.push_back(new Circle());
-          circles[i]->spawn();
-        }
-        numberOfSmallCirclesPresent = numberOfSmallCirclesAfterSpawning;
+        simulation.inputLog.recordEvent(simulation.tick, InputAction::spawn);
+        simulation.handleSpawnKeyPress();
       }
 
       // Physics update
       accumulator += deltaTime;
-      while (accumulator >= TIMESTEP) {
-				// Move objects first!
-        for (size_t i = 0; i < circles.size(); i++) {
-          circles[i]->update();
-        }
-
-        // Re-add objects into cells
-        refreshCellObjects(&uniformGrid, circles);
-
-        // Go through every cell and do collision handling
-        for (size_t i = 0; i < uniformGrid.cells.size(); i++) {
-          for (size_t j = 0; j < uniformGrid.cells[i].size(); j++) {
-						bool shouldHandleCircleCollision(true);
-            std::vector<Circle*> objects = uniformGrid.cells[i][j].objects;
-            if (objects.empty()) continue;
-						
-						// If there are less than 2 objects, don't handle Circle collision
-						if (objects.size() < 2) shouldHandleCircleCollision = false;
-            for (size_t i = 0; i < objects.size(); i++) {
-							if (shouldHandleCircleCollision) objects[i]->handleCircleCollision(objects);
-              objects[i]->handleEdgeCollision();
-            }
-          }
-        }
-
-        accumulator -= TIMESTEP;
+      while (accumulator >= simulation.timestep) {
+        drag.steer(simulation);
+        simulation.step();
+        accumulator -= simulation.timestep;
       }
     }
 
@@ -397,22 +1343,26 @@ int main() {
 
     // Draw grid
 		if (showGrid) {
-    	uniformGrid.draw();
+    	simulation.uniformGrid.draw();
 		}
 
-    // Draw circle
-    for (size_t i = 0; i < circles.size(); i++) {
-      circles[i]->draw();
+    // Draw obstacles, then circles
+    simulation.obstacles.draw(GRAY);
+    for (size_t i = 0; i < simulation.circles.size(); i++) {
+      simulation.circles[i].draw();
     }
+    drag.draw(simulation);
 
     // Small Circle Counter
     numberOfSmallCirclesPresentFormatted = sprintf(
-      smallCircleCountBuffer, "%d Small Circles", numberOfSmallCirclesPresent
+      smallCircleCountBuffer, "%d Small Circles",
+      simulation.numberOfSmallCirclesPresent
     );
     DrawText(smallCircleCountBuffer, 10, 10, 20, BLACK);
     // Big Circle Counter
     numberOfBigCirclesPresentFormatted = sprintf(
-      bigCircleCountBuffer, "%d Big Circles", numberOfBigCirclesPresent
+      bigCircleCountBuffer, "%d Big Circles",
+      simulation.numberOfBigCirclesPresent
     );
     DrawText(bigCircleCountBuffer, 10, 30, 20, BLACK);
 		
@@ -423,12 +1373,17 @@ int main() {
 		} else {
 			DrawText("Press A to pause.", 10, 70, 20, BLACK);
 		}
+
+    DrawText("Press W to toggle collision stats.", 10, 90, 20, BLACK);
+    DrawText("Press F5 to save and F9 to load a snapshot.", 10, 110, 20, BLACK);
+    DrawText("Drag a circle to throw it, hold right click to despawn.", 10, 130, 20, BLACK);
+    if (showStats) {
+      collisionStats.draw(10, 150, "cell");
+    }
     EndDrawing();
   }
 
-	for (size_t i = 0; i < circles.size(); i++) {
-		delete circles[i];
-	}
-	
+  if (options.savePath) simulation.saveSnapshot(options.savePath);
+
   return 0;
-}
\ No newline at end of file
+}